@@ -31,6 +31,8 @@
 #include <ngx_http.h>
 #include <nginx.h>
 
+#define NGX_HTTP_PUSH_STREAM_MAX_COUNTED_TEMPLATES   32 // templates after these are only formatted when a subscriber needs the message
+
 typedef struct {
     ngx_queue_t                     queue;
     ngx_regex_t                    *agent;
@@ -56,6 +58,12 @@ typedef struct {
     ngx_str_t                                  text;
 } ngx_http_push_stream_template_parts_t;
 
+// a step of a compiled template, literals point to the template text
+typedef struct {
+    ngx_http_push_stream_template_part_type    kind;
+    ngx_str_t                                  text;
+} ngx_http_push_stream_template_op_t;
+
 // template queue
 typedef struct {
     ngx_queue_t                     queue;
@@ -64,6 +72,8 @@ typedef struct {
     ngx_flag_t                      eventsource;
     ngx_flag_t                      websocket;
     ngx_queue_t                     parts;
+    ngx_http_push_stream_template_op_t *ops; // the parts on a contiguous array, in order
+    ngx_uint_t                      qtd_ops;
     ngx_uint_t                      qtd_message_id;
     ngx_uint_t                      qtd_event_id;
     ngx_uint_t                      qtd_event_type;
@@ -96,6 +106,11 @@ typedef struct {
     ngx_queue_t                     msg_templates;
     ngx_flag_t                      timeout_with_body;
     ngx_str_t                       events_channel_id;
+    ngx_uint_t                      channel_index;
+    ngx_uint_t                      channel_mutexes;
+    ngx_msec_t                      ipc_batch_window;
+    ngx_uint_t                      ipc_signal;
+    ngx_uint_t                      cleanup_budget;
     ngx_regex_t                    *backtrack_parser_regex;
     ngx_http_push_stream_msg_t     *ping_msg;
     ngx_http_push_stream_msg_t     *longpooling_timeout_msg;
@@ -111,6 +126,7 @@ typedef struct {
     ngx_str_t                       header_template;
     ngx_str_t                       message_template;
     ngx_int_t                       message_template_index;
+    ngx_http_push_stream_template_t *message_template_parsed; // the template at message_template_index, not looked up on each message
     ngx_str_t                       footer_template;
     ngx_uint_t                      wildcard_channel_max_qtd;
     ngx_uint_t                      location_type;
@@ -118,6 +134,7 @@ typedef struct {
     ngx_msec_t                      subscriber_connection_ttl;
     ngx_msec_t                      longpolling_connection_ttl;
     ngx_flag_t                      websocket_allow_publish;
+    size_t                          websocket_max_message_size;
     ngx_flag_t                      channel_info_on_publish;
     ngx_flag_t                      allow_connections_to_events_channel;
     ngx_http_complex_value_t       *last_received_message_time;
@@ -138,7 +155,8 @@ struct ngx_http_push_stream_msg_s {
     ngx_queue_t                     queue;
     time_t                          expires;
     time_t                          time;
-    ngx_flag_t                      deleted;
+    unsigned                        deleted:1;
+    unsigned                        qtd_templates:31;
     ngx_int_t                       id;
     ngx_str_t                       raw;
     ngx_int_t                       tag;
@@ -147,18 +165,33 @@ struct ngx_http_push_stream_msg_s {
     ngx_str_t                      *event_id_message;
     ngx_str_t                      *event_type_message;
     ngx_str_t                      *formatted_messages;
-    ngx_int_t                       workers_ref_count;
-    ngx_uint_t                      qtd_templates;
+    ngx_atomic_t                    workers_ref_count;
 };
 
 typedef struct ngx_http_push_stream_subscriber_s ngx_http_push_stream_subscriber_t;
 
+typedef struct {
+    ngx_shmtx_t                         mutex;
+    ngx_shmtx_sh_t                      lock;
+    ngx_atomic_t                        acquisitions;
+    ngx_atomic_t                        contentions;    // # of acquisitions that found the mutex locked
+} ngx_http_push_stream_channel_mutex_t;
+
+// stored messages of a channel with the same event id, positions are counted since the channel creation
+typedef struct {
+    ngx_uint_t                          oldest;
+    ngx_uint_t                          newest;
+    uint32_t                            key;
+} ngx_http_push_stream_event_id_entry_t;
+
 typedef struct {
     ngx_queue_t                         queue;
     pid_t                               pid;
     ngx_int_t                           slot;
     ngx_queue_t                         subscriptions;
     ngx_uint_t                          subscribers;
+    ngx_queue_t                         slot_queue; // on the entries of the worker on the slot, changed with the shared memory mutex held
+    ngx_http_push_stream_channel_t     *channel;
 } ngx_http_push_stream_pid_queue_t;
 
 struct ngx_http_push_stream_channel_s {
@@ -171,13 +204,21 @@ struct ngx_http_push_stream_channel_s {
     ngx_uint_t                          stored_messages;
     ngx_uint_t                          subscribers;
     ngx_queue_t                         workers_with_subscribers;
-    ngx_queue_t                         message_queue;
+    ngx_http_push_stream_pid_queue_t  **workers_sentinels; // entries of workers_with_subscribers by process slot
+    ngx_uint_t                          workers_sentinels_size; // power of 2, grows up to the greatest slot with subscribers
+    ngx_http_push_stream_msg_t        **messages; // ring of stored messages, from the oldest on messages_head
+    ngx_uint_t                          messages_head;
+    ngx_uint_t                          messages_capacity; // power of 2, grows as needed
+    ngx_uint_t                          messages_offset; // position of the oldest stored message
+    ngx_http_push_stream_event_id_entry_t *event_ids; // hash of the stored messages by event id, twice the messages capacity
     time_t                              expires;
+    ngx_queue_t                         expiry_queue;
+    time_t                              expiry_time; // when the channel will be checked for expired messages and inactivity, 0 while not on the expiry wheel
     ngx_flag_t                          deleted;
     ngx_flag_t                          wildcard;
     char                                for_events;
     ngx_http_push_stream_msg_t         *channel_deleted_message;
-    ngx_shmtx_t                        *mutex;
+    ngx_http_push_stream_channel_mutex_t *mutex;
 };
 
 typedef struct {
@@ -203,6 +244,7 @@ struct ngx_http_push_stream_subscriber_s {
     ngx_pid_t                                   worker_subscribed_pid;
     ngx_flag_t                                  longpolling;
     ngx_queue_t                                 worker_queue;
+    ngx_atomic_t                               *template_subscribers; // subscribers counter of the message template used, if any
 };
 
 typedef struct {
@@ -210,6 +252,10 @@ typedef struct {
     ngx_str_t                      *id;
     ngx_uint_t                      backtrack_messages;
     ngx_http_push_stream_channel_t *channel;
+    ngx_http_push_stream_msg_t    **old_messages; // snapshot of the stored messages to send, pinned by workers_ref_count
+    ngx_uint_t                      qtd_old_messages;
+    time_t                          last_message_time; // of the last message on the snapshot, taken with it under the channel lock
+    ngx_int_t                       last_message_tag;
 } ngx_http_push_stream_requested_channel_t;
 
 typedef struct {
@@ -226,6 +272,8 @@ typedef struct {
     ngx_uint_t step;
     ngx_buf_t  buf;
     ngx_str_t consolidated;
+    size_t consolidated_size; // allocated for the message being reassembled
+    size_t consolidated_ascii_len; // leading ASCII bytes of the message, not decoded as UTF-8 again
     unsigned char fragmented:1;
     unsigned char last_fragment:1;
 } ngx_http_push_stream_frame_t;
@@ -237,6 +285,7 @@ typedef struct {
     ngx_flag_t                          longpolling;
     ngx_flag_t                          message_sent;
     ngx_pool_t                         *temp_pool;
+    ngx_pool_t                         *send_pool; // messages formatted only for this request, released once written
     ngx_chain_t                        *free;
     ngx_chain_t                        *busy;
     ngx_http_push_stream_padding_t     *padding;
@@ -255,14 +304,46 @@ typedef struct {
     ngx_http_push_stream_main_conf_t   *mcf;
 } ngx_http_push_stream_worker_msg_t;
 
+// cell of the inbox, a bounded multiple producers single consumer ring of messages to a worker
 typedef struct {
-    ngx_queue_t                         messages_queue;
+    ngx_atomic_t                        sequence; // the cell can be written when equal to the position and read when equal to the position + 1
+    ngx_pid_t                           producer; // process writing the cell, 0 while it is free or before the writer sets it
+    ngx_http_push_stream_worker_msg_t   worker_msg;
+} ngx_http_push_stream_worker_inbox_cell_t;
+
+typedef struct {
+    // used by the publishers
+    ngx_http_push_stream_worker_inbox_cell_t *inbox;
+    ngx_atomic_t                        inbox_head; // next position to be read, changed only by the worker owning the inbox
+    ngx_atomic_t                        inbox_tail; // next position to be written, claimed by the publishers
+    ngx_atomic_t                        wakeup_pending; // when the batched wakeup scheduled to the worker is due, 0 if there is none
+    ngx_queue_t                         messages_queue; // used when the inbox is full
+    ngx_queue_t                         channels_entries; // entries of the worker on the channels with its subscribers, changed with the shared memory mutex held
+    // changed only by the process owning the slot
     ngx_queue_t                         subscribers_queue;
+    ngx_atomic_uint_t                   inbox_stalled_pos; // position claimed but not written found at the head
+    time_t                              inbox_stalled_since; // 0 when the head is not stalled
+    // changed without locks and summed when the statistics are read
     ngx_uint_t                          subscribers; // # of subscribers in the worker
+    ngx_int_t                           published_messages; // # of messages published by the processes which used the slot
+    ngx_int_t                           stored_messages; // # of messages stored minus removed by the processes which used the slot
     time_t                              startup;
     pid_t                               pid;
 } ngx_http_push_stream_worker_data_t;
 
+// open addressing channel index, resized incrementally
+typedef struct {
+    ngx_http_push_stream_channel_t    **buckets;
+    ngx_uint_t                          size;           // # of buckets, always a power of 2
+    ngx_uint_t                          used;           // # of buckets pointing to a channel
+    ngx_uint_t                          deleted;        // # of buckets marked as deleted
+    ngx_http_push_stream_channel_t    **old_buckets;    // buckets being migrated to the new table
+    ngx_uint_t                          old_size;
+    ngx_uint_t                          old_used;
+    ngx_uint_t                          migrated;       // # of old buckets already migrated
+    ngx_http_push_stream_channel_t    **retired_buckets; // kept until next migration ends, lockless readers may still be on it
+} ngx_http_push_stream_channel_hash_t;
+
 // shared memory
 struct ngx_http_push_stream_global_shm_data_s {
     pid_t                                   pid[NGX_MAX_PROCESSES];
@@ -271,11 +352,11 @@ struct ngx_http_push_stream_global_shm_data_s {
 
 struct ngx_http_push_stream_shm_data_s {
     ngx_rbtree_t                            tree;
+    ngx_uint_t                              channel_index;
+    ngx_http_push_stream_channel_hash_t     channels_hash;
+    ngx_atomic_t                            channels_index_version; // odd while the index is being changed
     ngx_uint_t                              channels;           // # of channels being used
     ngx_uint_t                              wildcard_channels;  // # of wildcard channels being used
-    ngx_uint_t                              published_messages; // # of published messagens in all channels
-    ngx_uint_t                              stored_messages;    // # of messages being stored
-    ngx_uint_t                              subscribers;        // # of subscribers in all channels
     ngx_queue_t                             messages_trash;
     ngx_shmtx_t                             messages_trash_mutex;
     ngx_shmtx_sh_t                          messages_trash_lock;
@@ -291,23 +372,32 @@ struct ngx_http_push_stream_shm_data_s {
     ngx_uint_t                              channels_in_delete; // # of channels in to delete queue
     ngx_uint_t                              channels_in_trash;  // # of channels in trash queue
     ngx_uint_t                              messages_in_trash;  // # of messages in trash queue
-    ngx_http_push_stream_worker_data_t      ipc[NGX_MAX_PROCESSES]; // interprocess stuff
+    ngx_http_push_stream_worker_data_t     *ipc[NGX_MAX_PROCESSES]; // interprocess stuff, allocated when a worker first starts on the slot
     time_t                                  startup;
+#if (NGX_PTR_SIZE == 8)
+    ngx_atomic_t                            last_message_sequence; // time of the last message on the high half and its tag on the low half
+#else
+    ngx_atomic_t                            last_message_lock;
     time_t                                  last_message_time;
     ngx_int_t                               last_message_tag;
+#endif
     ngx_queue_t                             shm_data_queue;
     ngx_http_push_stream_main_conf_t       *mcf;
     ngx_shm_zone_t                         *shm_zone;
     ngx_slab_pool_t                        *shpool;
-    ngx_uint_t                              slots_for_census;
-    ngx_uint_t                              mutex_round_robin;
-    ngx_shmtx_t                             channels_mutex[10];
-    ngx_shmtx_sh_t                          channels_lock[10];
+    ngx_uint_t                              channels_mutexes;   // # of mutexes shared by the channels
+    ngx_http_push_stream_channel_mutex_t   *channels_mutex;
+    ngx_uint_t                              qtd_templates;
+    ngx_atomic_t                            template_subscribers[NGX_HTTP_PUSH_STREAM_MAX_COUNTED_TEMPLATES]; // # of subscribers using each message template, kept across reloads
     ngx_shmtx_t                             cleanup_mutex;
     ngx_shmtx_sh_t                          cleanup_lock;
-    ngx_shmtx_t                             events_channel_mutex;
-    ngx_shmtx_sh_t                          events_channel_lock;
+    ngx_http_push_stream_channel_mutex_t    events_channel_mutex;
     ngx_http_push_stream_channel_t         *events_channel;
+    ngx_queue_t                            *expiry_wheel;       // channels by the second they have to be checked
+    ngx_queue_t                             expired_channels;   // channels taken from the wheel, waiting to be checked
+    time_t                                  expiry_wheel_time;  // last second processed on the wheel
+    ngx_shmtx_t                             expiry_wheel_mutex;
+    ngx_shmtx_sh_t                          expiry_wheel_lock;
 };
 
 ngx_shm_zone_t     *ngx_http_push_stream_global_shm_zone = NULL;
@@ -321,6 +411,7 @@ static ngx_int_t        ngx_http_push_stream_send_response_all_channels_info_det
 static ngx_int_t        ngx_http_push_stream_send_response_channels_info_detailed(ngx_http_request_t *r, ngx_http_push_stream_requested_channel_t *requested_channels);
 
 static ngx_int_t        ngx_http_push_stream_find_or_add_template(ngx_conf_t *cf, ngx_str_t template, ngx_flag_t eventsource, ngx_flag_t websocket);
+static ngx_int_t        ngx_http_push_stream_compile_template(ngx_conf_t *cf, ngx_http_push_stream_template_t *template);
 
 static const ngx_str_t  NGX_HTTP_PUSH_STREAM_ALL_CHANNELS_INFO_ID = ngx_string("ALL");
 
@@ -396,6 +487,46 @@ static const ngx_str_t  NGX_HTTP_PUSH_STREAM_MODE_WEBSOCKET   = ngx_string("webs
 #define NGX_HTTP_PUSH_STREAM_STATISTICS_MODE             7
 
 
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_RBTREE        0
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_HASH          1
+
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_INITIAL_SIZE   1024
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_MIGRATION_STEP 64
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED        ((ngx_http_push_stream_channel_t *) 1)
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_MAX_DEPTH     128
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_LOCKLESS_ATTEMPTS   4
+
+#define NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE           128 // must be a power of 2
+#define NGX_HTTP_PUSH_STREAM_WORKER_INBOX_STALL_TIMEOUT  5 // seconds a claimed cell may block the inbox head before its writer is checked
+#define NGX_HTTP_PUSH_STREAM_WORKER_MESSAGES_BATCH_SIZE  32
+
+#define NGX_HTTP_PUSH_STREAM_CHANNEL_MESSAGES_INITIAL_CAPACITY 4 // must be a power of 2
+#define NGX_HTTP_PUSH_STREAM_EVENT_ID_ENTRY_EMPTY        ((ngx_uint_t) -1)
+#define NGX_HTTP_PUSH_STREAM_EXPIRY_WHEEL_SIZE           1024 // one slot per second, must be a power of 2
+
+// the n-th stored message of the channel, starting from the oldest one
+#define ngx_http_push_stream_channel_stored_message(channel, n) (channel)->messages[((channel)->messages_head + (n)) & ((channel)->messages_capacity - 1)]
+
+// the entry of the worker on the slot at workers_with_subscribers, if any
+#define ngx_http_push_stream_channel_worker_sentinel(channel, slot) ((((ngx_uint_t) (slot)) < (channel)->workers_sentinels_size) ? (channel)->workers_sentinels[slot] : NULL)
+
+#define NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_SOCKETPAIR       0
+#define NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_EVENTFD          1
+
+#define NGX_HTTP_PUSH_STREAM_MESSAGE_NOT_FORMATTED       0
+#define NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTING          1
+#define NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTED           2
+#define NGX_HTTP_PUSH_STREAM_MESSAGE_FORMAT_ATTEMPTS     8 // formatting takes microseconds, after that the message is formatted on a temporary pool of the request
+
+// while formatting, the state also has the pid of the worker doing it, to recover the message if the worker dies
+#define ngx_http_push_stream_formatting_state(pid) ((((ngx_atomic_uint_t) (pid)) << 2) | NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTING)
+#define ngx_http_push_stream_formatting_pid(state) ((ngx_pid_t) ((state) >> 2))
+#define ngx_http_push_stream_is_formatting(state) (((state) & 3) == NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTING)
+
+// the formatting state of each template is kept on the message block, right after the formatted messages
+#define ngx_http_push_stream_formatted_message_state(msg, index) (((ngx_atomic_t *) ((msg)->formatted_messages + (msg)->qtd_templates)) + (index))
+
+
 #define NGX_HTTP_PUSH_STREAM_WEBSOCKET_VERSION_8         8
 #define NGX_HTTP_PUSH_STREAM_WEBSOCKET_VERSION_13        13
 
@@ -448,6 +579,33 @@ static const ngx_str_t  NGX_HTTP_PUSH_STREAM_ALLOWED_HEADERS = ngx_string("If-Mo
     (counter = (counter > qtd) ? counter - qtd : 0)
 
 #define NGX_HTTP_PUSH_STREAM_TIME_FMT_LEN   30 //sizeof("Mon, 28 Sep 1970 06:00:00 GMT")
+#define NGX_HTTP_PUSH_STREAM_ISO_8601_LEN   19 //sizeof("1970-09-28T06:00:00") - 1
+#define NGX_HTTP_PUSH_STREAM_TIME_CACHE_SIZE 64 // must be a power of 2
+
+// a second formatted on both patterns, cached by each worker
+typedef struct {
+    time_t                              sec;
+    u_char                              http_time[NGX_HTTP_PUSH_STREAM_TIME_FMT_LEN];
+    size_t                              http_time_len; // 0 while the slot is empty
+    u_char                              iso_8601[NGX_HTTP_PUSH_STREAM_ISO_8601_LEN];
+} ngx_http_push_stream_time_cache_t;
+
+// the message fields a template may use, formatted once for all the lines of the message
+typedef struct {
+    ngx_str_t                          *channel_id;
+    ngx_str_t                          *event_id;
+    ngx_str_t                          *event_type;
+    u_char                              id[NGX_INT_T_LEN];
+    size_t                              id_len;
+    u_char                              tag[NGX_INT_T_LEN];
+    size_t                              tag_len;
+    ngx_http_push_stream_time_cache_t  *time;
+    size_t                              time_len;
+    size_t                              fixed_len; // length of the template without the text and its size
+} ngx_http_push_stream_template_fields_t;
+
+// unmasks a websocket payload in place returning the length of its leading ASCII bytes, by blocks
+typedef size_t (*ngx_http_push_stream_unmask_pt) (u_char *p, size_t n, u_char *mask_key);
 
 
 /**
@@ -41,20 +41,26 @@
 
 // constants
 static ngx_channel_t NGX_CMD_HTTP_PUSH_STREAM_CHECK_MESSAGES = {49, 0, 0, -1};
-static ngx_channel_t NGX_CMD_HTTP_PUSH_STREAM_CENSUS_SUBSCRIBERS = {50, 0, 0, -1};
 static ngx_channel_t NGX_CMD_HTTP_PUSH_STREAM_DELETE_CHANNEL = {51, 0, 0, -1};
 static ngx_channel_t NGX_CMD_HTTP_PUSH_STREAM_CLEANUP_SHUTTING_DOWN = {52, 0, 0, -1};
 
 // worker processes of the world, unite.
 ngx_socket_t    ngx_http_push_stream_socketpairs[NGX_MAX_PROCESSES][2];
+ngx_fd_t        ngx_http_push_stream_eventfds[NGX_MAX_PROCESSES];
+ngx_flag_t      ngx_http_push_stream_eventfds_initialized = 0;
+
+// workers to be alerted when the batch window ends
+ngx_event_t     ngx_http_push_stream_ipc_wakeup_event;
+ngx_pid_t       ngx_http_push_stream_ipc_wakeup_pids[NGX_MAX_PROCESSES];
 
 static ngx_int_t    ngx_http_push_stream_register_worker_message_handler(ngx_cycle_t *cycle);
 
 static void    ngx_http_push_stream_broadcast(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_log_t *log, ngx_http_push_stream_main_conf_t *mcf);
 
 static ngx_int_t        ngx_http_push_stream_alert_worker(ngx_pid_t pid, ngx_int_t slot, ngx_log_t *log, ngx_channel_t command);
+static ngx_int_t        ngx_http_push_stream_wakeup_worker(ngx_http_push_stream_shm_data_t *data, ngx_pid_t pid, ngx_int_t slot, ngx_log_t *log);
+static void             ngx_http_push_stream_ipc_wakeup_timer_wake_handler(ngx_event_t *ev);
 #define ngx_http_push_stream_alert_worker_check_messages(pid, slot, log) ngx_http_push_stream_alert_worker(pid, slot, log, NGX_CMD_HTTP_PUSH_STREAM_CHECK_MESSAGES)
-#define ngx_http_push_stream_alert_worker_census_subscribers(pid, slot, log) ngx_http_push_stream_alert_worker(pid, slot, log, NGX_CMD_HTTP_PUSH_STREAM_CENSUS_SUBSCRIBERS)
 #define ngx_http_push_stream_alert_worker_delete_channel(pid, slot, log) ngx_http_push_stream_alert_worker(pid, slot, log, NGX_CMD_HTTP_PUSH_STREAM_DELETE_CHANNEL)
 #define ngx_http_push_stream_alert_worker_shutting_down_cleanup(pid, slot, log) ngx_http_push_stream_alert_worker(pid, slot, log, NGX_CMD_HTTP_PUSH_STREAM_CLEANUP_SHUTTING_DOWN)
 
@@ -64,14 +70,28 @@ static ngx_int_t        ngx_http_push_stream_init_ipc(ngx_cycle_t *cycle, ngx_in
 static void             ngx_http_push_stream_ipc_exit_worker(ngx_cycle_t *cycle);
 static ngx_int_t        ngx_http_push_stream_ipc_init_worker(void);
 static void             ngx_http_push_stream_clean_worker_data(ngx_http_push_stream_shm_data_t *data);
+static void             ngx_http_push_stream_unsubscribe_worker(ngx_http_push_stream_shm_data_t *data, ngx_int_t slot);
+static void             ngx_http_push_stream_release_worker_messages(ngx_http_push_stream_shm_data_t *data, ngx_int_t slot);
+static void             ngx_http_push_stream_discount_dead_workers(ngx_http_push_stream_shm_data_t *data);
+static void             ngx_http_push_stream_discount_dead_worker_locked(ngx_slab_pool_t *shpool, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_pid_queue_t *worker);
+static ngx_int_t        ngx_http_push_stream_init_worker_inbox(ngx_http_push_stream_worker_data_t *worker_data, ngx_slab_pool_t *shpool);
+static ngx_int_t        ngx_http_push_stream_worker_inbox_push(ngx_http_push_stream_worker_data_t *worker_data, ngx_http_push_stream_worker_msg_t *worker_msg, ngx_flag_t *inbox_was_empty);
+static ngx_int_t        ngx_http_push_stream_worker_inbox_pop(ngx_http_push_stream_worker_data_t *worker_data, ngx_http_push_stream_worker_msg_t *worker_msg);
+static ngx_int_t        ngx_http_push_stream_worker_inbox_skip_stalled_cell(ngx_http_push_stream_worker_data_t *worker_data, ngx_http_push_stream_worker_inbox_cell_t *cell, ngx_atomic_uint_t pos);
+static void             ngx_http_push_stream_check_worker_inbox(ngx_http_push_stream_shm_data_t *data);
+static ngx_uint_t       ngx_http_push_stream_batch_worker_message(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_worker_msg_t *batch, ngx_uint_t qtd);
+static void             ngx_http_push_stream_deliver_worker_messages(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_worker_msg_t *batch, ngx_uint_t qtd);
 static void             ngx_http_push_stream_channel_handler(ngx_event_t *ev);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t        ngx_http_push_stream_init_eventfd(ngx_cycle_t *cycle, ngx_int_t slot);
+static void             ngx_http_push_stream_eventfd_handler(ngx_event_t *ev);
+#endif
 static void             ngx_http_push_stream_alert_shutting_down_workers(void);
 
 
 static ngx_inline void  ngx_http_push_stream_process_worker_message(void);
-static ngx_inline void  ngx_http_push_stream_census_worker_subscribers(void);
 static ngx_inline void  ngx_http_push_stream_cleanup_shutting_down_worker(void);
 
-static ngx_int_t    ngx_http_push_stream_respond_to_subscribers(ngx_http_push_stream_channel_t *channel, ngx_queue_t *subscriptions, ngx_http_push_stream_msg_t *msg);
+static ngx_int_t    ngx_http_push_stream_respond_to_subscribers(ngx_http_push_stream_channel_t *channel, ngx_queue_t *subscriptions, ngx_http_push_stream_msg_t **msgs, ngx_uint_t qtd);
 
 #endif /* NGX_HTTP_PUSH_STREAM_MODULE_IPC_H_ */
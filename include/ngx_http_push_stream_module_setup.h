@@ -52,6 +52,14 @@ static time_t NGX_HTTP_PUSH_STREAM_DEFAULT_CHANNEL_INACTIVITY_TIME        = 30;
 
 #define NGX_HTTP_PUSH_STREAM_DEFAULT_EVENTS_CHANNEL_ID ""
 
+#define NGX_HTTP_PUSH_STREAM_DEFAULT_CHANNEL_MUTEXES 10
+
+#define NGX_HTTP_PUSH_STREAM_DEFAULT_IPC_BATCH_WINDOW 0 // disabled, workers are alerted as soon as they have messages
+
+#define NGX_HTTP_PUSH_STREAM_DEFAULT_CLEANUP_BUDGET 0 // unlimited, each cleanup handles everything already expired
+
+#define NGX_HTTP_PUSH_STREAM_DEFAULT_WEBSOCKET_MAX_MESSAGE_SIZE 0 // unlimited, a message is accepted while there is memory to reassemble it
+
 static char *       ngx_http_push_stream_channels_statistics(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 // publisher
@@ -29,6 +29,12 @@
 #include <ngx_http_push_stream_module.h>
 #include <ngx_http_push_stream_module_ipc.h>
 
+#if ((defined __GNUC__) && (defined __x86_64__))
+#define NGX_HTTP_PUSH_STREAM_HAVE_SSE2  1   // part of the x86_64 base instruction set
+#define NGX_HTTP_PUSH_STREAM_HAVE_AVX2  1   // compiled always, used only when the CPU supports it
+#include <immintrin.h>
+#endif
+
 typedef struct {
     ngx_queue_t           queue;
     ngx_str_t            *line;
@@ -46,45 +52,67 @@ typedef struct {
     ngx_str_t            *format_summarized;
     ngx_str_t            *format_summarized_worker_item;
     ngx_str_t            *format_summarized_worker_last_item;
+    ngx_str_t            *format_summarized_mutex_item;
+    ngx_str_t            *format_summarized_mutex_last_item;
+    ngx_str_t            *format_summarized_template_item;
+    ngx_str_t            *format_summarized_template_last_item;
 } ngx_http_push_stream_content_subtype_t;
 
 
 #define  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_PLAIN_PATTERN "channel: %s" CRLF"published_messages: %ui" CRLF"stored_messages: %ui" CRLF"active_subscribers: %ui"
 #define  NGX_HTTP_PUSH_STREAM_WORKER_INFO_PLAIN_PATTERN "  pid: %d" CRLF"  subscribers: %ui" CRLF"  uptime: %ui"
+#define  NGX_HTTP_PUSH_STREAM_MUTEX_INFO_PLAIN_PATTERN "  index: %ui" CRLF"  acquisitions: %uA" CRLF"  contentions: %uA"
+#define  NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_PLAIN_PATTERN "  index: %ui" CRLF"  subscribers: %uA"
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_PLAIN_PATTERN CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_HEAD_PLAIN = ngx_string("hostname: %s, time: %s, channels: %ui, wildcard_channels: %ui, uptime: %ui, infos: " CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_PLAIN = ngx_string(CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_PLAIN_PATTERN "," CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_LAST_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_PLAIN_PATTERN);
-static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_PLAIN = ngx_string("hostname: %s" CRLF "time: %s" CRLF "channels: %ui" CRLF "wildcard_channels: %ui" CRLF "published_messages: %ui" CRLF "stored_messages: %ui" CRLF "messages_in_trash: %ui" CRLF "channels_in_delete: %ui" CRLF "channels_in_trash: %ui" CRLF "subscribers: %ui" CRLF "uptime: %ui" CRLF "by_worker:"CRLF"%s" CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_PLAIN = ngx_string("hostname: %s" CRLF "time: %s" CRLF "channels: %ui" CRLF "wildcard_channels: %ui" CRLF "published_messages: %ui" CRLF "stored_messages: %ui" CRLF "messages_in_trash: %ui" CRLF "channels_in_delete: %ui" CRLF "channels_in_trash: %ui" CRLF "cleanup_lag: %ui" CRLF "subscribers: %ui" CRLF "uptime: %ui" CRLF "by_worker:"CRLF"%s" CRLF "by_channel_mutex:"CRLF"%s" CRLF "by_template:"CRLF"%s" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_WORKER_INFO_PLAIN_PATTERN "," CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_WORKER_INFO_PLAIN_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_MUTEX_INFO_PLAIN_PATTERN "," CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_MUTEX_INFO_PLAIN_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_PLAIN_PATTERN "," CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_PLAIN = ngx_string(NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_PLAIN_PATTERN);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_PLAIN = ngx_string("text/plain");
 
 
 #define  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON_PATTERN "{\"channel\": \"%s\", \"published_messages\": %ui, \"stored_messages\": %ui, \"subscribers\": %ui}"
 #define  NGX_HTTP_PUSH_STREAM_WORKER_INFO_JSON_PATTERN "{\"pid\": \"%d\", \"subscribers\": %ui, \"uptime\": %ui}"
+#define  NGX_HTTP_PUSH_STREAM_MUTEX_INFO_JSON_PATTERN "{\"index\": %ui, \"acquisitions\": %uA, \"contentions\": %uA}"
+#define  NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_JSON_PATTERN "{\"index\": %ui, \"subscribers\": %uA}"
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON_PATTERN CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_HEAD_JSON = ngx_string("{\"hostname\": \"%s\", \"time\": \"%s\", \"channels\": %ui, \"wildcard_channels\": %ui, \"uptime\": %ui, \"infos\": [" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_JSON = ngx_string("]}" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON_PATTERN "," CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_LAST_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON_PATTERN CRLF);
-static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_JSON = ngx_string("{\"hostname\": \"%s\", \"time\": \"%s\", \"channels\": %ui, \"wildcard_channels\": %ui, \"published_messages\": %ui, \"stored_messages\": %ui, \"messages_in_trash\": %ui, \"channels_in_delete\": %ui, \"channels_in_trash\": %ui, \"subscribers\": %ui, \"uptime\": %ui, \"by_worker\": [" CRLF "%s" CRLF"]}" CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_JSON = ngx_string("{\"hostname\": \"%s\", \"time\": \"%s\", \"channels\": %ui, \"wildcard_channels\": %ui, \"published_messages\": %ui, \"stored_messages\": %ui, \"messages_in_trash\": %ui, \"channels_in_delete\": %ui, \"channels_in_trash\": %ui, \"cleanup_lag\": %ui, \"subscribers\": %ui, \"uptime\": %ui, \"by_worker\": [" CRLF "%s" CRLF"], \"by_channel_mutex\": [" CRLF "%s" CRLF"], \"by_template\": [" CRLF "%s" CRLF"]}" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_WORKER_INFO_JSON_PATTERN "," CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_WORKER_INFO_JSON_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_MUTEX_INFO_JSON_PATTERN "," CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_MUTEX_INFO_JSON_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_JSON_PATTERN "," CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_JSON = ngx_string(NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_JSON_PATTERN);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_JSON = ngx_string("application/json");
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_X_JSON = ngx_string("text/x-json");
 
 #define  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML_PATTERN "  channel: %s" CRLF"  published_messages: %ui" CRLF"  stored_messages: %ui" CRLF"  subscribers: %ui"
 #define  NGX_HTTP_PUSH_STREAM_WORKER_INFO_YAML_PATTERN "    pid: %d" CRLF"    subscribers: %ui" CRLF"    uptime: %ui"
+#define  NGX_HTTP_PUSH_STREAM_MUTEX_INFO_YAML_PATTERN "    index: %ui" CRLF"    acquisitions: %uA" CRLF"    contentions: %uA"
+#define  NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_YAML_PATTERN "    index: %ui" CRLF"    subscribers: %uA"
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML = ngx_string(NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML_PATTERN CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_HEAD_YAML = ngx_string("hostname: %s" CRLF"time: %s" CRLF"channels: %ui" CRLF"wildcard_channels: %ui" CRLF"uptime: %ui" CRLF"infos: "CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_YAML = ngx_string(CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_ITEM_YAML = ngx_string(" -" CRLF NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML_PATTERN CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_LAST_ITEM_YAML = ngx_string(" -" CRLF NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML_PATTERN);
-static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_YAML = ngx_string("  hostname: %s" CRLF"  time: %s" CRLF"  channels: %ui" CRLF"  wildcard_channels: %ui" CRLF"  published_messages: %ui" CRLF"  stored_messages: %ui" CRLF"  messages_in_trash: %ui" CRLF"  channels_in_delete: %ui" CRLF"  channels_in_trash: %ui" CRLF"  subscribers: %ui" CRLF"  uptime: %ui" CRLF"  by_worker:"CRLF"%s" CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_YAML = ngx_string("  hostname: %s" CRLF"  time: %s" CRLF"  channels: %ui" CRLF"  wildcard_channels: %ui" CRLF"  published_messages: %ui" CRLF"  stored_messages: %ui" CRLF"  messages_in_trash: %ui" CRLF"  channels_in_delete: %ui" CRLF"  channels_in_trash: %ui" CRLF"  cleanup_lag: %ui" CRLF"  subscribers: %ui" CRLF"  uptime: %ui" CRLF"  by_worker:"CRLF"%s" CRLF"  by_channel_mutex:"CRLF"%s" CRLF"  by_template:"CRLF"%s" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_YAML = ngx_string("   -" CRLF NGX_HTTP_PUSH_STREAM_WORKER_INFO_YAML_PATTERN CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_YAML = ngx_string("   -" CRLF NGX_HTTP_PUSH_STREAM_WORKER_INFO_YAML_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_YAML = ngx_string("   -" CRLF NGX_HTTP_PUSH_STREAM_MUTEX_INFO_YAML_PATTERN CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_YAML = ngx_string("   -" CRLF NGX_HTTP_PUSH_STREAM_MUTEX_INFO_YAML_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_YAML = ngx_string("   -" CRLF NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_YAML_PATTERN CRLF);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_YAML = ngx_string("   -" CRLF NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_YAML_PATTERN);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_YAML = ngx_string("application/yaml");
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_X_YAML = ngx_string("text/x-yaml");
 
@@ -102,6 +130,17 @@ static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_X_YAML = ngx_string("text/x-
     "  <subscribers>%ui</subscribers>" CRLF \
     "  <uptime>%ui</uptime>" CRLF \
     "</worker>" CRLF
+#define  NGX_HTTP_PUSH_STREAM_MUTEX_INFO_XML_PATTERN \
+    "<channel_mutex>" CRLF \
+    "  <index>%ui</index>" CRLF \
+    "  <acquisitions>%uA</acquisitions>" CRLF \
+    "  <contentions>%uA</contentions>" CRLF \
+    "</channel_mutex>" CRLF
+#define  NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_XML_PATTERN \
+    "<template>" CRLF \
+    "  <index>%ui</index>" CRLF \
+    "  <subscribers>%uA</subscribers>" CRLF \
+    "</template>" CRLF
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_XML = ngx_string("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>" CRLF NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_XML_PATTERN CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_HEAD_XML = ngx_string("<?xml version=\"1.0\" encoding=\"UTF-8\" ?>" CRLF "<root>" CRLF"  <hostname>%s</hostname>" CRLF"  <time>%s</time>" CRLF"  <channels>%ui</channels>" CRLF"  <wildcard_channels>%ui</wildcard_channels>" CRLF"  <uptime>%ui</uptime>" CRLF"  <infos>" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_XML = ngx_string("  </infos>" CRLF"</root>" CRLF);
@@ -119,12 +158,19 @@ static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_XML = ngx_string
         "  <messages_in_trash>%ui</messages_in_trash>" CRLF \
         "  <channels_in_delete>%ui</channels_in_delete>" CRLF \
         "  <channels_in_trash>%ui</channels_in_trash>" CRLF \
+        "  <cleanup_lag>%ui</cleanup_lag>" CRLF \
         "  <subscribers>%ui</subscribers>" CRLF \
         "  <uptime>%ui</uptime>" CRLF \
         "  <by_worker>%s</by_worker>" CRLF \
+        "  <by_channel_mutex>%s</by_channel_mutex>" CRLF \
+        "  <by_template>%s</by_template>" CRLF \
         "</infos>" CRLF);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_XML = ngx_string(NGX_HTTP_PUSH_STREAM_WORKER_INFO_XML_PATTERN);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_XML = ngx_string(NGX_HTTP_PUSH_STREAM_WORKER_INFO_XML_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_XML = ngx_string(NGX_HTTP_PUSH_STREAM_MUTEX_INFO_XML_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_XML = ngx_string(NGX_HTTP_PUSH_STREAM_MUTEX_INFO_XML_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_XML = ngx_string(NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_XML_PATTERN);
+static ngx_str_t  NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_XML = ngx_string(NGX_HTTP_PUSH_STREAM_TEMPLATE_INFO_XML_PATTERN);
 static ngx_str_t  NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_XML = ngx_string("application/xml");
 
 static ngx_http_push_stream_content_subtype_t subtypes[] = {
@@ -137,7 +183,11 @@ static ngx_http_push_stream_content_subtype_t subtypes[] = {
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_PLAIN,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_PLAIN,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_PLAIN,
-            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_PLAIN},
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_PLAIN,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_PLAIN,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_PLAIN,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_PLAIN,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_PLAIN },
     { "json"  , 4,
             &NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_JSON,
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON,
@@ -147,7 +197,11 @@ static ngx_http_push_stream_content_subtype_t subtypes[] = {
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_JSON,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_JSON,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_JSON,
-            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_JSON },
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_JSON },
     { "yaml"  , 4,
             &NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_YAML,
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML,
@@ -157,7 +211,11 @@ static ngx_http_push_stream_content_subtype_t subtypes[] = {
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_YAML,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_YAML,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_YAML,
-            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_YAML },
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_YAML },
     { "xml"   , 3,
             &NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_XML,
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_XML,
@@ -167,7 +225,11 @@ static ngx_http_push_stream_content_subtype_t subtypes[] = {
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_XML,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_XML,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_XML,
-            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_XML },
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_XML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_XML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_XML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_XML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_XML },
     { "x-json", 6,
             &NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_X_JSON,
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_JSON,
@@ -177,7 +239,11 @@ static ngx_http_push_stream_content_subtype_t subtypes[] = {
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_JSON,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_JSON,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_JSON,
-            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_JSON },
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_JSON,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_JSON },
     { "x-yaml", 6,
             &NGX_HTTP_PUSH_STREAM_CONTENT_TYPE_X_YAML,
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_YAML,
@@ -187,7 +253,11 @@ static ngx_http_push_stream_content_subtype_t subtypes[] = {
             &NGX_HTTP_PUSH_STREAM_CHANNEL_INFO_GROUP_TAIL_YAML,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_YAML,
             &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_ITEM_YAML,
-            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_YAML }
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_WORKER_LAST_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_MUTEX_LAST_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_ITEM_YAML,
+            &NGX_HTTP_PUSH_STREAM_CHANNELS_INFO_SUMMARIZED_TEMPLATE_LAST_ITEM_YAML }
 };
 
 static const ngx_int_t  NGX_HTTP_PUSH_STREAM_PING_MESSAGE_ID = -1;
@@ -235,6 +305,7 @@ ngx_event_t         ngx_http_push_stream_memory_cleanup_event;
 ngx_event_t         ngx_http_push_stream_buffer_cleanup_event;
 
 // general request handling
+static u_char *             ngx_http_push_stream_copy_to_message_block(ngx_str_t *dst, u_char *last, ngx_str_t *text, ngx_flag_t null_terminated);
 ngx_http_push_stream_msg_t *ngx_http_push_stream_convert_char_to_msg_on_shared(ngx_http_push_stream_main_conf_t *mcf, u_char *data, size_t len, ngx_http_push_stream_channel_t *channel, ngx_int_t id, ngx_str_t *event_id, ngx_str_t *event_type, time_t time, ngx_int_t tag, ngx_pool_t *temp_pool);
 static ngx_int_t            ngx_http_push_stream_send_only_added_headers(ngx_http_request_t *r);
 static void                 ngx_http_push_stream_add_polling_headers(ngx_http_request_t *r, time_t last_modified_time, ngx_int_t tag, ngx_pool_t *temp_pool);
@@ -245,12 +316,28 @@ static ngx_int_t            ngx_http_push_stream_send_only_header_response(ngx_h
 static ngx_int_t            ngx_http_push_stream_send_only_header_response_and_finalize(ngx_http_request_t *r, ngx_int_t status, const ngx_str_t *explain_error_message);
 static ngx_str_t *          ngx_http_push_stream_str_replace(const ngx_str_t *org, const ngx_str_t *find, const ngx_str_t *replace, off_t offset, ngx_pool_t *temp_pool);
 static ngx_str_t *          ngx_http_push_stream_get_formatted_websocket_frame(const u_char *opcode, off_t opcode_len, const u_char *text, off_t text_len, ngx_pool_t *temp_pool);
+static size_t               ngx_http_push_stream_websocket_frame_header_len(off_t opcode_len, off_t len);
+static u_char *             ngx_http_push_stream_write_websocket_frame_header(u_char *last, const u_char *opcode, off_t opcode_len, off_t len);
+static ngx_http_push_stream_template_t *ngx_http_push_stream_get_template_by_index(ngx_http_push_stream_main_conf_t *mcf, ngx_uint_t index);
+static ngx_str_t *          ngx_http_push_stream_apply_template_to_message(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_http_push_stream_template_t *template, ngx_pool_t *temp_pool);
+static ngx_int_t            ngx_http_push_stream_format_message_on_shared(ngx_http_push_stream_main_conf_t *mcf, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_http_push_stream_template_t *template, ngx_str_t *formatted, ngx_log_t *log);
 static ngx_str_t *          ngx_http_push_stream_get_formatted_message(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg);
-static ngx_str_t *          ngx_http_push_stream_format_message(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *message, ngx_str_t *text, ngx_http_push_stream_template_t *template, ngx_pool_t *temp_pool);
+static ngx_pool_t *         ngx_http_push_stream_get_send_pool(ngx_http_request_t *r);
+static void                 ngx_http_push_stream_prepare_template_fields(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *message, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields);
+static size_t               ngx_http_push_stream_formatted_text_len(ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, size_t len);
+static u_char *             ngx_http_push_stream_write_formatted_text(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, u_char *text, size_t len);
+static u_char *             ngx_http_push_stream_next_line_break(u_char *start, u_char *end, u_char **cr, u_char **lf, size_t *step);
+static size_t               ngx_http_push_stream_formatted_eventsource_len(ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text);
+static u_char *             ngx_http_push_stream_write_formatted_eventsource(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text);
+static size_t               ngx_http_push_stream_formatted_message_len(ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text);
+static u_char *             ngx_http_push_stream_write_formatted_message(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text);
+static size_t               ngx_http_push_stream_framed_message_len(ngx_http_push_stream_template_t *template, size_t len);
+static u_char *             ngx_http_push_stream_write_framed_message(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text, size_t len);
 static ngx_str_t *          ngx_http_push_stream_apply_template_to_each_line(ngx_str_t *text, const ngx_str_t *message_template, ngx_pool_t *temp_pool);
 static ngx_int_t            ngx_http_push_stream_send_response_content_header(ngx_http_request_t *r, ngx_http_push_stream_loc_conf_t *pslcf);
 static ngx_int_t            ngx_http_push_stream_send_response(ngx_http_request_t *r, ngx_str_t *text, const ngx_str_t *content_type, ngx_int_t status_code);
 static ngx_int_t            ngx_http_push_stream_send_response_message(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_flag_t send_callback, ngx_flag_t send_separator);
+static ngx_int_t            ngx_http_push_stream_send_response_messages(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t **msgs, ngx_uint_t qtd, ngx_flag_t send_callback, ngx_flag_t send_separator);
 static ngx_int_t            ngx_http_push_stream_send_response_text(ngx_http_request_t *r, const u_char *text, uint len, ngx_flag_t last_buffer);
 static void                 ngx_http_push_stream_send_response_finalize(ngx_http_request_t *r);
 static void                 ngx_http_push_stream_send_response_finalize_for_longpolling_by_timeout(ngx_http_request_t *r);
@@ -262,6 +349,7 @@ static void                 ngx_http_push_stream_unescape_uri(ngx_str_t *value);
 static void                 ngx_http_push_stream_complex_value(ngx_http_request_t *r, ngx_http_complex_value_t *val, ngx_str_t *value);
 
 
+static void                 ngx_http_push_stream_next_message_sequence(ngx_http_push_stream_shm_data_t *data, time_t *time, ngx_int_t *tag);
 ngx_int_t                   ngx_http_push_stream_add_msg_to_channel(ngx_http_push_stream_main_conf_t *mcf, ngx_log_t *log, ngx_http_push_stream_channel_t *channel, u_char *text, size_t len, ngx_str_t *event_id, ngx_str_t *event_type, ngx_flag_t store_messages, ngx_pool_t *temp_pool);
 ngx_int_t                   ngx_http_push_stream_send_event(ngx_http_push_stream_main_conf_t *mcf, ngx_log_t *log, ngx_http_push_stream_channel_t *channel, ngx_str_t *event_id, ngx_pool_t *temp_pool);
 
@@ -276,17 +364,37 @@ static void                 ngx_http_push_stream_timer_reset(ngx_msec_t timer_in
 #define ngx_http_push_stream_memory_cleanup_timer_set(void) ngx_http_push_stream_timer_set(NGX_HTTP_PUSH_STREAM_DEFAULT_SHM_MEMORY_CLEANUP_INTERVAL, &ngx_http_push_stream_memory_cleanup_event, ngx_http_push_stream_memory_cleanup_timer_wake_handler, 1);
 #define ngx_http_push_stream_buffer_cleanup_timer_set(void) ngx_http_push_stream_timer_set(NGX_HTTP_PUSH_STREAM_MESSAGE_BUFFER_CLEANUP_INTERVAL, &ngx_http_push_stream_buffer_cleanup_event, ngx_http_push_stream_buffer_timer_wake_handler, 1);
 
+// objects each cleanup step may handle, the remaining ones are handled on the next cleanups
+#define ngx_http_push_stream_cleanup_budget(data, force) (((force) || ((data)->mcf->cleanup_budget == 0)) ? NGX_MAX_UINT32_VALUE : (data)->mcf->cleanup_budget)
+
 static void                 ngx_http_push_stream_worker_subscriber_cleanup(ngx_http_push_stream_subscriber_t *worker_subscriber);
 static ngx_str_t *          ngx_http_push_stream_create_str(ngx_pool_t *pool, uint len);
 
 static void                 ngx_http_push_stream_throw_the_message_away(ngx_http_push_stream_msg_t *msg, ngx_http_push_stream_shm_data_t *data);
 static ngx_int_t            ngx_http_push_stream_delete_channel(ngx_http_push_stream_main_conf_t *mcf, ngx_http_push_stream_channel_t *channel, u_char *text, size_t len, ngx_pool_t *temp_pool);
 static void                 ngx_http_push_stream_collect_expired_messages_data(ngx_http_push_stream_shm_data_t *data, ngx_flag_t force);
+static void                 ngx_http_push_stream_move_channel_to_trash_locked(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel);
+void                        ngx_http_push_stream_schedule_channel_expiry(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, time_t expires);
+void                        ngx_http_push_stream_unschedule_channel_expiry(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel);
+static void                 ngx_http_push_stream_expire_channels_data(ngx_http_push_stream_shm_data_t *data);
+time_t                      ngx_http_push_stream_get_cleanup_lag(ngx_http_push_stream_shm_data_t *data);
+void                        ngx_http_push_stream_sum_worker_counters(ngx_http_push_stream_shm_data_t *data, ngx_uint_t *published_messages, ngx_uint_t *stored_messages, ngx_uint_t *subscribers);
+
 static void                 ngx_http_push_stream_collect_expired_messages_and_empty_channels(ngx_flag_t force);
 static void                 ngx_http_push_stream_free_message_memory(ngx_slab_pool_t *shpool, ngx_http_push_stream_msg_t *msg);
+static void                 ngx_http_push_stream_release_worker_message(ngx_http_push_stream_msg_t *msg);
 static void                 ngx_http_push_stream_free_worker_message_memory(ngx_slab_pool_t *shpool, ngx_http_push_stream_worker_msg_t *worker_msg);
 static ngx_int_t            ngx_http_push_stream_free_memory_of_expired_messages_and_channels(ngx_flag_t force);
 ngx_uint_t                  ngx_http_push_stream_ensure_qtd_of_messages(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_uint_t max_messages, ngx_flag_t expired);
+static ngx_int_t            ngx_http_push_stream_grow_channel_messages(ngx_http_push_stream_channel_t *channel, ngx_slab_pool_t *shpool);
+static ngx_int_t            ngx_http_push_stream_init_channel_event_ids(ngx_http_push_stream_channel_t *channel, ngx_slab_pool_t *shpool);
+ngx_int_t                   ngx_http_push_stream_insert_channel_worker_sentinel_locked(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_pid_queue_t *worker);
+void                        ngx_http_push_stream_remove_channel_worker_sentinel_locked(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_pid_queue_t *worker, ngx_slab_pool_t *shpool);
+static void                 ngx_http_push_stream_index_channel_event_ids(ngx_http_push_stream_channel_t *channel);
+static ngx_http_push_stream_event_id_entry_t *ngx_http_push_stream_find_channel_event_id(ngx_http_push_stream_channel_t *channel, uint32_t key, ngx_str_t *event_id);
+static void                 ngx_http_push_stream_insert_channel_event_id(ngx_http_push_stream_channel_t *channel, ngx_uint_t position);
+static void                 ngx_http_push_stream_remove_channel_event_id(ngx_http_push_stream_channel_t *channel, ngx_uint_t position);
+static ngx_int_t            ngx_http_push_stream_get_channel_event_id_index(ngx_http_push_stream_channel_t *channel, ngx_str_t *event_id);
 static ngx_inline void      ngx_http_push_stream_delete_worker_channel(void);
 
 static ngx_http_push_stream_content_subtype_t *     ngx_http_push_stream_match_channel_info_format_and_content_type(ngx_http_request_t *r, ngx_uint_t default_subtype);
@@ -299,6 +407,7 @@ static ngx_http_push_stream_module_ctx_t *          ngx_http_push_stream_add_req
 static ngx_queue_t *        ngx_http_push_stream_parse_paddings(ngx_conf_t *cf, ngx_str_t *paddings_by_user_agent);
 
 static ngx_str_t *          ngx_http_push_stream_get_formatted_current_time(ngx_pool_t *pool);
+static ngx_http_push_stream_time_cache_t *ngx_http_push_stream_get_formatted_time(time_t sec);
 static ngx_str_t *          ngx_http_push_stream_get_formatted_hostname(ngx_pool_t *pool);
 
 uint64_t                    ngx_http_push_stream_htonll(uint64_t value);
@@ -309,7 +418,22 @@ static ngx_int_t            ngx_http_push_stream_set_expires(ngx_http_request_t
 ngx_http_push_stream_requested_channel_t *ngx_http_push_stream_parse_channels_ids_from_path(ngx_http_request_t *r, ngx_pool_t *pool);
 
 ngx_int_t                   ngx_http_push_stream_create_shmtx(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name);
+ngx_int_t                   ngx_http_push_stream_create_channel_mutex(ngx_http_push_stream_channel_mutex_t *mutex, u_char *name);
+void                        ngx_http_push_stream_lock_channel_mutex(ngx_http_push_stream_channel_mutex_t *mutex);
+void                        ngx_http_push_stream_unlock_channel_mutex(ngx_http_push_stream_channel_mutex_t *mutex);
+
+#define ngx_http_push_stream_lock_channel(channel) ngx_http_push_stream_lock_channel_mutex((channel)->mutex)
+#define ngx_http_push_stream_unlock_channel(channel) ngx_http_push_stream_unlock_channel_mutex((channel)->mutex)
 
 ngx_flag_t                  ngx_http_push_stream_is_utf8(u_char *p, size_t n);
+ngx_flag_t                  ngx_http_push_stream_unmask_and_check_utf8(u_char *p, size_t n, u_char *mask_key);
+void                        ngx_http_push_stream_select_unmask_implementation(ngx_log_t *log);
+static size_t               ngx_http_push_stream_unmask_ascii_word(u_char *p, size_t n, u_char *mask_key);
+#if (NGX_HTTP_PUSH_STREAM_HAVE_SSE2)
+static size_t               ngx_http_push_stream_unmask_ascii_sse2(u_char *p, size_t n, u_char *mask_key);
+#endif
+#if (NGX_HTTP_PUSH_STREAM_HAVE_AVX2)
+static size_t               ngx_http_push_stream_unmask_ascii_avx2(u_char *p, size_t n, u_char *mask_key);
+#endif
 
 #endif /* NGX_HTTP_PUSH_STREAM_MODULE_UTILS_H_ */
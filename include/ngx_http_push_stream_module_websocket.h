@@ -34,6 +34,7 @@
 #include <ngx_http_push_stream_module_subscriber.h>
 
 static ngx_int_t    ngx_http_push_stream_websocket_handler(ngx_http_request_t *r);
+static ngx_int_t    ngx_http_push_stream_reserve_websocket_message(ngx_http_push_stream_frame_t *frame, size_t len, size_t max_size, ngx_pool_t *temp_pool);
 
 #define NGX_HTTP_PUSH_STREAM_WEBSOCKET_READ_START_STEP           0
 #define NGX_HTTP_PUSH_STREAM_WEBSOCKET_READ_GET_REAL_SIZE_STEP   1
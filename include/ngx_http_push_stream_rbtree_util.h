@@ -37,6 +37,14 @@
 static ngx_http_push_stream_channel_t *     ngx_http_push_stream_get_channel(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_main_conf_t *mcf);
 static ngx_http_push_stream_channel_t *     ngx_http_push_stream_find_channel(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_main_conf_t *mcf);
 
+static ngx_http_push_stream_channel_t *     ngx_http_push_stream_find_channel_on_index(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_shm_data_t *data);
+static ngx_int_t    ngx_http_push_stream_channel_index_insert(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_log_t *log);
+static void         ngx_http_push_stream_channel_index_delete(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel);
+static ngx_http_push_stream_channel_t *     ngx_http_push_stream_find_channel_lockless(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_shm_data_t *data, ngx_flag_t *found);
+static void         ngx_http_push_stream_channel_index_write_begin(ngx_http_push_stream_shm_data_t *data);
+static void         ngx_http_push_stream_channel_index_write_end(ngx_http_push_stream_shm_data_t *data);
+static ngx_int_t    ngx_http_push_stream_channel_hash_init(ngx_http_push_stream_channel_hash_t *hash, ngx_slab_pool_t *shpool);
+
 static void         ngx_rbtree_generic_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel, int (*compare) (const ngx_rbtree_node_t *left, const ngx_rbtree_node_t *right));
 static void         ngx_http_push_stream_rbtree_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static int          ngx_http_push_stream_compare_rbtree_node(const ngx_rbtree_node_t *v_left, const ngx_rbtree_node_t *v_right);
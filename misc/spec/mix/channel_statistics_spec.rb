@@ -602,6 +602,98 @@ shared_examples_for "statistics location" do
     end
   end
 
+  it "should return the contention of each channel mutex in summarized channels statistics" do
+    channel = 'ch_test_get_channel_mutexes_in_summarized_channels_statistics'
+    body = 'body'
+
+    nginx_run_server(config.merge(:channel_mutexes => 4)) do |conf|
+      #create channel
+      publish_message(channel, headers, body)
+
+      EventMachine.run do
+        pub_2 = EventMachine::HttpRequest.new(nginx_address + '/channels-stats').get :head => headers
+        pub_2.callback do
+          expect(pub_2).to be_http_status(200)
+          response = JSON.parse(pub_2.response)
+          expect(response["by_channel_mutex"].count).to eql(4)
+          expect(response["by_channel_mutex"].map { |mutex| mutex["index"] }).to eql([0, 1, 2, 3])
+          expect(response["by_channel_mutex"].map { |mutex| mutex["acquisitions"] }.inject(:+)).to be > 0
+          expect(response["by_channel_mutex"][0]["contentions"].to_s).not_to be_empty
+          EventMachine.stop
+        end
+      end
+    end
+  end
+
+  it "should return the cleanup lag in summarized channels statistics" do
+    channel = 'ch_test_get_cleanup_lag_in_summarized_channels_statistics'
+    body = 'body'
+
+    nginx_run_server(config.merge(:cleanup_budget => 10, :message_ttl => '1s')) do |conf|
+      publish_message(channel, headers, body)
+
+      EventMachine.run do
+        EM.add_timer(7) do
+          pub_2 = EventMachine::HttpRequest.new(nginx_address + '/channels-stats').get :head => headers
+          pub_2.callback do
+            expect(pub_2).to be_http_status(200)
+            response = JSON.parse(pub_2.response)
+            expect(response["cleanup_lag"]).to eql(0)
+            expect(response["stored_messages"]).to eql(0)
+            EventMachine.stop
+          end
+        end
+      end
+    end
+  end
+
+  it "should drain the expired channels over successive cleanups when the budget is small" do
+    channel = 'ch_test_drain_expired_channels_over_successive_cleanups_'
+    body = 'body'
+    stored = []
+    lags = []
+
+    nginx_run_server(config.merge(:cleanup_budget => 1, :message_ttl => '1s'), :timeout => 60) do |conf|
+      10.times { |i| publish_message("#{channel}#{i}", headers, body) }
+
+      EventMachine.run do
+        EM.add_periodic_timer(1) do
+          pub_2 = EventMachine::HttpRequest.new(nginx_address + '/channels-stats').get :head => headers
+          pub_2.callback do
+            expect(pub_2).to be_http_status(200)
+            response = JSON.parse(pub_2.response)
+            stored << response["stored_messages"]
+            lags << response["cleanup_lag"]
+            if (response["stored_messages"] == 0) && (response["cleanup_lag"] == 0)
+              expect(stored).to eql(stored.sort.reverse)
+              expect(stored.select { |qtd| (qtd > 0) && (qtd < 10) }.uniq.count).to be > 1
+              expect(lags.max).to be > 0
+              EventMachine.stop
+            end
+          end
+        end
+      end
+    end
+  end
+
+  it "should return the number of subscribers by template in summarized channels statistics" do
+    channel = 'ch_test_get_subscribers_by_template_in_summarized_channels_statistics'
+
+    nginx_run_server(config) do |conf|
+      create_channel_by_subscribe(channel, headers) do
+        pub_1 = EventMachine::HttpRequest.new(nginx_address + '/channels-stats').get :head => headers
+        pub_1.callback do
+          expect(pub_1).to be_http_status(200)
+          response = JSON.parse(pub_1.response)
+          expect(response["by_template"].count).to eql(1)
+          expect(response["by_template"][0]["index"]).to eql(1)
+          expect(response["by_template"][0]["subscribers"]).to eql(1)
+          EventMachine.stop
+        end
+      end
+    end
+  end
+
   it "should return the number of messages in the trash in summarized channels statistics" do
     channel = 'ch_test_get_messages_in_trash_in_summarized_channels_statistics'
     body = 'body'
@@ -14,17 +14,18 @@ describe "Measure Memory" do
     }
   end
 
-  message_estimate_size = 168
-  channel_estimate_size = 270
-  subscriber_estimate_size = 400
+  message_estimate_size = 162
+  channel_estimate_size = 348
+  subscriber_estimate_size = 408
   subscriber_estimate_system_size = 8384
+  worker_inbox_size = 8192
 
   it "should check message size" do
     channel = 'ch_test_message_size'
     body = '1'
 
     nginx_run_server(config, :timeout => 30) do |conf|
-      shared_size = conf.shared_memory_size.to_i * 1024 * 1024
+      shared_size = conf.shared_memory_size.to_i * 1024 * 1024 - worker_inbox_size * conf.workers
 
       post_channel_message = "POST /pub?id=#{channel} HTTP/1.1\r\nHost: localhost\r\nContent-Length: #{body.size}\r\n\r\n#{body}"
       socket = open_socket(nginx_host, nginx_port)
@@ -54,7 +55,7 @@ describe "Measure Memory" do
     body = '1'
 
     nginx_run_server(config, :timeout => 150) do |conf|
-      shared_size = conf.shared_memory_size.to_i * 1024 * 1024
+      shared_size = conf.shared_memory_size.to_i * 1024 * 1024 - worker_inbox_size * conf.workers
 
       socket = open_socket(nginx_host, nginx_port)
 
@@ -84,7 +85,7 @@ describe "Measure Memory" do
 
   it "should check subscriber size" do
     nginx_run_server(config.merge({:shared_memory_size => "128k", :header_template => "H"})) do |conf|
-      shared_size = conf.shared_memory_size.to_i * 1024 #shm size is in kbytes for this test
+      shared_size = conf.shared_memory_size.to_i * 1024 - worker_inbox_size * conf.workers #shm size is in kbytes for this test
 
       EventMachine.run do
         subscriber_in_loop(1000, headers) do
@@ -54,6 +54,14 @@ describe "Setup Parameters" do
     expect(nginx_test_configuration(config)).to include("max number of wildcard channels cannot be smaller than value in push_stream_wildcard_channel_max_qtd")
   end
 
+  it "should not accept '0' as number of channel mutexes" do
+    expect(nginx_test_configuration({:channel_mutexes => 0})).to include("push_stream_channel_mutexes cannot be zero")
+  end
+
+  it "should not accept an invalid channel index" do
+    expect(nginx_test_configuration({:channel_index => "btree"})).to include("invalid value \"btree\" in \"push_stream_channel_index\" directive")
+  end
+
   it "should accept a configuration without http block" do
     config = {
       :configuration_template => %q{
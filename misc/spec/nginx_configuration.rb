@@ -60,6 +60,11 @@ module NginxConfiguration
       :channels_path => '$1',
 
       :events_channel_id => nil,
+      :channel_index => nil,
+      :channel_mutexes => nil,
+      :ipc_batch_window => nil,
+      :ipc_signal => nil,
+      :cleanup_budget => nil,
       :allow_connections_to_events_channel => nil,
 
       :extra_location => '',
@@ -156,6 +161,11 @@ http {
   <%= write_directive("push_stream_channel_inactivity_time", channel_inactivity_time) %>
 
   <%= write_directive("push_stream_events_channel_id", events_channel_id) %>
+  <%= write_directive("push_stream_channel_index", channel_index) %>
+  <%= write_directive("push_stream_channel_mutexes", channel_mutexes) %>
+  <%= write_directive("push_stream_ipc_batch_window", ipc_batch_window) %>
+  <%= write_directive("push_stream_ipc_signal", ipc_signal) %>
+  <%= write_directive("push_stream_cleanup_budget", cleanup_budget) %>
   <%= write_directive("push_stream_allow_connections_to_events_channel", allow_connections_to_events_channel) %>
 
   server {
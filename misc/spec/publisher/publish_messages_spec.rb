@@ -191,6 +191,54 @@ describe "Publisher Publishing Messages" do
     end
   end
 
+  it "should publish many messages in the same channel batching the wakeups of the workers" do
+    body_prefix = 'published_message_'
+    channel = 'ch_test_publish_many_messages_batching_wakeups'
+    messagens_to_publish = 500
+
+    response = ""
+    nginx_run_server(config.merge(:ipc_batch_window => "1ms", :message_template => "~text~|")) do |conf|
+      EventMachine.run do
+        sub = EventMachine::HttpRequest.new(nginx_address + '/sub/' + channel.to_s).get :head => headers
+        sub.stream do |chunk|
+          response += chunk
+          recieved_messages = response.split("|")
+
+          if recieved_messages.length == messagens_to_publish
+            expect(recieved_messages.last).to eql(body_prefix + messagens_to_publish.to_s)
+            EventMachine.stop
+          end
+        end
+
+        EM.add_timer(0.5) do
+          socket = open_socket(nginx_host, nginx_port)
+          1.upto(messagens_to_publish) do |i|
+            resp_headers, body = post_in_socket("/pub?id=#{channel}", "#{body_prefix}#{i}", socket, {:wait_for => "}\r\n"})
+            fail("Message was not published: " + body_prefix + i.to_s) unless resp_headers.include?("HTTP/1.1 200 OK")
+          end
+          socket.close
+        end
+      end
+    end
+  end
+
+  it "should receive the published message when workers are signaled through eventfd", :if => RUBY_PLATFORM.include?("linux") do
+    body = 'published unique message'
+    channel = 'ch_test_publish_messages_signaling_with_eventfd'
+
+    nginx_run_server(config.merge(:ipc_signal => "eventfd")) do |conf|
+      EventMachine.run do
+        sub = EventMachine::HttpRequest.new(nginx_address + '/sub/' + channel.to_s).get :head => headers
+        sub.stream do |chunk|
+          expect(chunk).to eql(body)
+          EventMachine.stop
+        end
+
+        publish_message_inline(channel, headers, body)
+      end
+    end
+  end
+
   it "should set an event id to the message through header parameter" do
     event_id = 'event_id_with_generic_text_01'
     body = 'test message'
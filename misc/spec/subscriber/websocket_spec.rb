@@ -692,6 +692,46 @@ describe "Subscriber WebSocket" do
     end
   end
 
+  it "should accept non latin characters after a large ASCII text" do
+    channel = 'ch_test_publish_non_latin_after_ascii'
+    text = ("a" * 70000) + "\xD8\xA3\xD9\x8E\xD8\xA8\xD9\x92 \xD8\xB9\xD9\x8E"
+
+    nginx_run_server(config) do |conf|
+      EventMachine.run do
+        ws = WebSocket::EventMachine::Client.connect(:uri => "ws://#{nginx_host}:#{nginx_port}/ws/#{channel}")
+        ws.onmessage do |message, type|
+          expect(message.force_encoding('BINARY')).to eq(text.force_encoding('BINARY'))
+          EventMachine.stop
+        end
+
+        EM.add_timer(1) do
+          ws.send text
+        end
+      end
+    end
+  end
+
+  it "should reject an invalid utf8 sequence after a large ASCII text" do
+    channel = 'ch_test_publish_invalid_utf8_after_ascii'
+
+    nginx_run_server(config) do |conf|
+      EventMachine.run do
+        ws = WebSocket::EventMachine::Client.connect(:uri => "ws://#{nginx_host}:#{nginx_port}/ws/#{channel}")
+        ws.onmessage do |text, type|
+          fail("Should not have received a message with #{text.size} bytes")
+        end
+
+        ws.onclose do
+          EventMachine.stop
+        end
+
+        EM.add_timer(1) do
+          ws.send(("a" * 70000) + "\xA3\xD9\x8E\xD8\xA8")
+        end
+      end
+    end
+  end
+
   it "should reject unsupported frames" do
     channel = 'ch_test_reject_unsupported_frames'
     frame = "%c%c%c%c%c%c%c%c%c%c%c" % [0x82, 0x85, 0xBD, 0xD0, 0xE5, 0x2A, 0xD5, 0xB5, 0x89, 0x46, 0xD2] #send binary frame
@@ -830,6 +870,113 @@ describe "Subscriber WebSocket" do
     end
   end
 
+  it "should accept a message sent in many fragments" do
+    channel = 'ch_test_publish_many_fragments'
+
+    configuration = config.merge({
+      shared_memory_size: '15m',
+      message_template: '{\"channel\":\"~channel~\", \"message\":\"~text~\"}',
+      subscriber_mode: 'long-polling',
+    })
+
+    nginx_run_server(configuration, timeout: 60) do |conf|
+      EventMachine.run do
+        text = ("Hello" * 200) + "\xC3\xA9"
+        fragments = text.bytes.each_slice(7).map { |bytes| bytes.pack('C*') } # 1001 is a multiple of 7, the two bytes of the last character go on different fragments
+        frames = fragments.each_with_index.map do |fragment, i|
+          fin = (i == fragments.size - 1) ? 0x80 : 0x00
+          opcode = (i == 0) ? 0x01 : 0x00
+          "%c%c" % [fin | opcode, fragment.bytesize] + fragment
+        end
+
+        request = "GET /ws/#{channel} HTTP/1.0\r\nConnection: Upgrade\r\nSec-WebSocket-Key: /mQoZf6pRiv8+6o72GncLQ==\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 8\r\n"
+
+        socket = open_socket(nginx_host, nginx_port)
+        socket.print("#{request}\r\n")
+        headers, body = read_response_on_socket(socket)
+        socket.print(frames.join)
+        body, dummy = read_response_on_socket(socket, "\xC3\xA9")
+        socket.close
+
+        sub = EventMachine::HttpRequest.new(nginx_address + '/sub/' + channel.to_s + '.b1').get :timeout => 30
+        sub.callback do
+          expect(sub).to be_http_status(200)
+          response = JSON.parse(sub.response)
+          expect(response["channel"].to_s).to eql(channel)
+          expect(response["message"].force_encoding('BINARY')).to eql(text.force_encoding('BINARY'))
+          EventMachine.stop
+        end
+      end
+    end
+  end
+
+  it "should close the connection when a message is bigger than the max message size" do
+    channel = 'ch_test_publish_bigger_than_max_message_size'
+    frame_part1 = "%c%c%c%c%c" % [0x01, 0x03, 0x48, 0x65, 0x6c] #send 'Hel' frame
+    frame_part2 = "%c%c%c%c" % [0x80, 0x02, 0x6c, 0x6f] #send 'lo' frame
+
+    configuration = config.merge({
+      extra_location: config[:extra_location].sub("push_stream_store_messages              on;", "push_stream_store_messages              on;\n            push_stream_websocket_max_message_size  4;")
+    })
+
+    request = "GET /ws/#{channel} HTTP/1.0\r\nConnection: Upgrade\r\nSec-WebSocket-Key: /mQoZf6pRiv8+6o72GncLQ==\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 8\r\n"
+
+    nginx_run_server(configuration) do |conf|
+      socket = open_socket(nginx_host, nginx_port)
+      socket.print("#{request}\r\n")
+      headers, body = read_response_on_socket(socket)
+      socket.print(frame_part1)
+      sleep 0.0001
+      socket.print(frame_part2)
+      body, dummy = read_response_on_socket(socket, "\210\000")
+      expect(body).to eql("\210\000")
+
+      EventMachine.run do
+        pub = EventMachine::HttpRequest.new(nginx_address + '/channels-stats?id=' + channel.to_s).get :timeout => 30
+        pub.callback do
+          socket.close
+          expect(pub).to be_http_status(200).with_body
+          response = JSON.parse(pub.response)
+          expect(response["channel"].to_s).to eql(channel)
+          expect(response["published_messages"].to_i).to eql(0)
+          EventMachine.stop
+        end
+      end
+    end
+  end
+
+  it "should close the connection when the length of a fragment would overflow the message size" do
+    channel = 'ch_test_publish_fragment_overflowing_message_size'
+    frame_part1 = "%c%c" % [0x01, 100] + ("a" * 100) #send a 100 bytes frame
+    frame_part2 = "%c%c" % [0x80, 127] + [2**64 - 100].pack('Q>') #announce a continuation of 2^64 - 100 bytes
+
+    request = "GET /ws/#{channel} HTTP/1.0\r\nConnection: Upgrade\r\nSec-WebSocket-Key: /mQoZf6pRiv8+6o72GncLQ==\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 8\r\n"
+
+    nginx_run_server(config) do |conf|
+      socket = open_socket(nginx_host, nginx_port)
+      socket.print("#{request}\r\n")
+      headers, body = read_response_on_socket(socket)
+      socket.print(frame_part1)
+      sleep 0.0001
+      socket.print(frame_part2)
+      body, dummy = read_response_on_socket(socket, "\210\000")
+      expect(body).to eql("\210\000")
+
+      EventMachine.run do
+        pub = EventMachine::HttpRequest.new(nginx_address + '/channels-stats?id=' + channel.to_s).get :timeout => 30
+        pub.callback do
+          socket.close
+          expect(pub).to be_http_status(200).with_body
+          response = JSON.parse(pub.response)
+          expect(response["channel"].to_s).to eql(channel)
+          expect(response["published_messages"].to_i).to eql(0)
+          expect(response["subscribers"].to_i).to eql(0)
+          EventMachine.stop
+        end
+      end
+    end
+  end
+
   it "should accept all kinds of frames mixed" do
     channel = 'ch_test_publish_frames_mixed'
 
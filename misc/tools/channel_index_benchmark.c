@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2010-2022 Wandenberg Peixoto <wandenberg@gmail.com>, Rogério Carvalho Schneider <stockrt@gmail.com>
+ *
+ * This file is part of Nginx Push Stream Module.
+ *
+ * Nginx Push Stream Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Push Stream Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Push Stream Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * channel_index_benchmark.c
+ *
+ * Compare the cost to find a channel by id on a red-black tree keyed by crc32
+ * (glibc tsearch is a red-black tree) with the open addressing hash table used
+ * when push_stream_channel_index is set to hash.
+ *
+ * usage: ./channel_index_benchmark [number of channels] [number of lookups]
+ */
+
+#define _GNU_SOURCE
+#include <search.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HASH_INITIAL_SIZE   1024
+#define HASH_DELETED        ((channel_t *) 1)
+
+typedef struct {
+    uint32_t    key;
+    size_t      len;
+    char        id[32];
+} channel_t;
+
+typedef struct {
+    channel_t **buckets;
+    size_t      size;
+    size_t      used;
+} channel_hash_t;
+
+static uint32_t crc32_table[256];
+
+
+static void
+crc32_init(void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc32_table[i] = c;
+    }
+}
+
+
+static uint32_t
+crc32_short(const char *p, size_t len)
+{
+    uint32_t crc = 0xffffffff;
+
+    while (len--) {
+        crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xffffffff;
+}
+
+
+static int
+compare_channel(const void *l, const void *r)
+{
+    const channel_t *left = l, *right = r;
+
+    if (left->key != right->key) {
+        return (left->key < right->key) ? -1 : 1;
+    }
+
+    if (left->len != right->len) {
+        return (left->len < right->len) ? -1 : 1;
+    }
+
+    return memcmp(left->id, right->id, left->len);
+}
+
+
+static void
+hash_place(channel_hash_t *hash, channel_t *channel)
+{
+    size_t i, mask = hash->size - 1;
+
+    for (i = channel->key & mask; (hash->buckets[i] != NULL) && (hash->buckets[i] != HASH_DELETED); i = (i + 1) & mask) { /* void */ }
+
+    hash->buckets[i] = channel;
+    hash->used++;
+}
+
+
+static void
+hash_insert(channel_hash_t *hash, channel_t *channel)
+{
+    channel_t **old = hash->buckets;
+    size_t      i, old_size = hash->size;
+
+    // the module migrates buckets incrementally, here the whole table is moved at once
+    if (((hash->used + 1) * 4) > (hash->size * 3)) {
+        hash->size *= 2;
+        hash->used = 0;
+        hash->buckets = calloc(hash->size, sizeof(channel_t *));
+        for (i = 0; i < old_size; i++) {
+            if ((old[i] != NULL) && (old[i] != HASH_DELETED)) {
+                hash_place(hash, old[i]);
+            }
+        }
+        free(old);
+    }
+
+    hash_place(hash, channel);
+}
+
+
+static channel_t *
+hash_find(channel_hash_t *hash, const char *id, size_t len)
+{
+    channel_t  *channel;
+    uint32_t    key = crc32_short(id, len);
+    size_t      i, mask = hash->size - 1;
+
+    for (i = key & mask; hash->buckets[i] != NULL; i = (i + 1) & mask) {
+        channel = hash->buckets[i];
+        if ((channel != HASH_DELETED) && (channel->key == key) && (channel->len == len) && (memcmp(channel->id, id, len) == 0)) {
+            return channel;
+        }
+    }
+
+    return NULL;
+}
+
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    size_t              channels = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t              lookups = (argc > 2) ? strtoul(argv[2], NULL, 10) : 5000000;
+    channel_t          *all, query, **found;
+    channel_hash_t      hash;
+    void               *tree = NULL;
+    struct timespec     start, end;
+    size_t              i, hits;
+
+    if ((channels == 0) || (lookups == 0)) {
+        fprintf(stderr, "usage: %s [number of channels] [number of lookups]\n", argv[0]);
+        return 1;
+    }
+
+    crc32_init();
+
+    hash.size = HASH_INITIAL_SIZE;
+    hash.used = 0;
+    hash.buckets = calloc(hash.size, sizeof(channel_t *));
+
+    if (((all = calloc(channels, sizeof(channel_t))) == NULL) || (hash.buckets == NULL)) {
+        fprintf(stderr, "unable to allocate memory for %zu channels\n", channels);
+        return 1;
+    }
+
+    for (i = 0; i < channels; i++) {
+        all[i].len = snprintf(all[i].id, sizeof(all[i].id), "channel_%zu", i);
+        all[i].key = crc32_short(all[i].id, all[i].len);
+        tsearch(&all[i], &tree, compare_channel);
+        hash_insert(&hash, &all[i]);
+    }
+
+    srand(42);
+
+    hits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < lookups; i++) {
+        channel_t *c = &all[rand() % channels];
+        query.len = c->len;
+        memcpy(query.id, c->id, c->len);
+        query.key = crc32_short(query.id, query.len);
+        found = tfind(&query, &tree, compare_channel);
+        hits += (found != NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("rbtree: %zu channels, %zu lookups, %zu hits, %.1f ns/lookup\n", channels, lookups, hits, elapsed_ns(&start, &end) / lookups);
+
+    srand(42);
+
+    hits = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < lookups; i++) {
+        channel_t *c = &all[rand() % channels];
+        query.len = c->len;
+        memcpy(query.id, c->id, c->len);
+        hits += (hash_find(&hash, query.id, query.len) != NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("hash:   %zu channels, %zu lookups, %zu hits, %.1f ns/lookup (%zu buckets)\n", channels, lookups, hits, elapsed_ns(&start, &end) / lookups, hash.size);
+
+    return 0;
+}
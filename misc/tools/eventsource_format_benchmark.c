@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2010-2022 Wandenberg Peixoto <wandenberg@gmail.com>, Rogério Carvalho Schneider <stockrt@gmail.com>
+ *
+ * This file is part of Nginx Push Stream Module.
+ *
+ * Nginx Push Stream Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Push Stream Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Push Stream Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * eventsource_format_benchmark.c
+ *
+ * Compare the cost to format a multi-line message for EventSource splitting it
+ * on a list of lines, formatting each one and joining them, with scanning the
+ * message for line breaks with memchr and writing the prefixed lines straight
+ * to the final buffer.
+ *
+ * usage: ./eventsource_format_benchmark [message size] [line size] [number of messages]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PREFIX      "data: "
+#define PREFIX_LEN  (sizeof(PREFIX) - 1)
+
+typedef struct line_s {
+    struct line_s  *next;
+    char           *data;
+    size_t          len;
+} line_t;
+
+
+static line_t *
+add_line(line_t **tail, char *data, size_t len)
+{
+    line_t *line = malloc(sizeof(line_t));
+
+    line->next = NULL;
+    line->data = malloc(len);
+    line->len = len;
+    memcpy(line->data, data, len);
+    *tail = line;
+
+    return line;
+}
+
+
+// as the module did: split with strstr on a list, format and join each line, copy with the trailing line break
+static size_t
+format_list(char *msg, size_t len, char **out)
+{
+    line_t *lines = NULL, **tail = &lines, *cur, *next;
+    char   *start = msg, *pos, *crlf, *cr, *lf, *result = NULL, *tmp;
+    size_t  step, result_len = 0;
+
+    do {
+        crlf = strstr(start, "\r\n");
+        cr = strstr(start, "\r");
+        lf = strstr(start, "\n");
+
+        pos = crlf;
+        step = 2;
+        if ((pos == NULL) || ((cr != NULL) && (cr < pos))) {
+            pos = cr;
+            step = 1;
+        }
+        if ((pos == NULL) || ((lf != NULL) && (lf < pos))) {
+            pos = lf;
+            step = 1;
+        }
+
+        if (pos != NULL) {
+            if (pos > start) {
+                tail = &add_line(tail, start, pos - start)->next;
+            }
+            start = pos + step;
+        }
+    } while (pos != NULL);
+
+    if (msg + len > start) {
+        add_line(tail, start, msg + len - start);
+    }
+
+    for (cur = lines; cur != NULL; cur = cur->next) {
+        tmp = malloc(PREFIX_LEN + cur->len + 1);
+        memcpy(tmp, PREFIX, PREFIX_LEN);
+        memcpy(tmp + PREFIX_LEN, cur->data, cur->len);
+        tmp[PREFIX_LEN + cur->len] = '\n';
+        free(cur->data);
+        cur->data = tmp;
+        cur->len += PREFIX_LEN + 1;
+    }
+
+    for (cur = lines; cur != NULL; cur = next) {
+        next = cur->next;
+        tmp = malloc(result_len + cur->len);
+        if (result != NULL) {
+            memcpy(tmp, result, result_len);
+            free(result);
+        }
+        memcpy(tmp + result_len, cur->data, cur->len);
+        result = tmp;
+        result_len += cur->len;
+        free(cur->data);
+        free(cur);
+    }
+
+    *out = malloc(result_len + 1);
+    if (result != NULL) {
+        memcpy(*out, result, result_len);
+        free(result);
+    }
+    (*out)[result_len] = '\n';
+
+    return result_len + 1;
+}
+
+
+static char *
+next_line_break(char *start, char *end, char **cr, char **lf, size_t *step)
+{
+    char *pos;
+
+    if (*cr < start) {
+        *cr = memchr(start, '\r', end - start);
+        *cr = (*cr != NULL) ? *cr : end;
+    }
+
+    if (*lf < start) {
+        *lf = memchr(start, '\n', end - start);
+        *lf = (*lf != NULL) ? *lf : end;
+    }
+
+    pos = (*cr < *lf) ? *cr : *lf;
+    *step = ((pos == *cr) && (pos + 1 < end) && (pos[1] == '\n')) ? 2 : 1;
+
+    return pos;
+}
+
+
+// as the module does: one scan to measure, one scan to write to the final buffer
+static size_t
+format_scan(char *msg, size_t len, char **out)
+{
+    char   *start, *end = msg + len, *cr, *lf, *pos, *last;
+    size_t  total = 1, step;
+
+    for (start = msg, cr = NULL, lf = NULL; start < end; start = pos + step) {
+        pos = next_line_break(start, end, &cr, &lf, &step);
+        if (pos > start) {
+            total += PREFIX_LEN + (pos - start) + 1;
+        }
+    }
+
+    last = *out = malloc(total);
+    for (start = msg, cr = NULL, lf = NULL; start < end; start = pos + step) {
+        pos = next_line_break(start, end, &cr, &lf, &step);
+        if (pos > start) {
+            last = memcpy(last, PREFIX, PREFIX_LEN) + PREFIX_LEN;
+            last = memcpy(last, start, pos - start) + (pos - start);
+            *last++ = '\n';
+        }
+    }
+    *last = '\n';
+
+    return total;
+}
+
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    size_t              size = (argc > 1) ? strtoul(argv[1], NULL, 10) : 65536;
+    size_t              line_size = (argc > 2) ? strtoul(argv[2], NULL, 10) : 80;
+    size_t              messages = (argc > 3) ? strtoul(argv[3], NULL, 10) : 2000;
+    struct timespec     start, end;
+    size_t              i, len_list = 0, len_scan = 0;
+    char               *msg, *out_list, *out_scan;
+
+    if ((size == 0) || (line_size == 0) || (messages == 0)) {
+        fprintf(stderr, "usage: %s [message size] [line size] [number of messages]\n", argv[0]);
+        return 1;
+    }
+
+    msg = malloc(size + 1);
+    for (i = 0; i < size; i++) {
+        msg[i] = ((i % line_size) == line_size - 1) ? '\n' : 'a' + (i % 26);
+    }
+    msg[size] = '\0';
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < messages; i++) {
+        len_list = format_list(msg, size, &out_list);
+        if (i < messages - 1) {
+            free(out_list);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("list: %zu messages of %zu bytes, %.1f us/message\n", messages, size, elapsed_ns(&start, &end) / messages / 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < messages; i++) {
+        len_scan = format_scan(msg, size, &out_scan);
+        if (i < messages - 1) {
+            free(out_scan);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("scan: %zu messages of %zu bytes, %.1f us/message\n", messages, size, elapsed_ns(&start, &end) / messages / 1000);
+
+    if ((len_list != len_scan) || (memcmp(out_list, out_scan, len_list) != 0)) {
+        fprintf(stderr, "formatted messages differ\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2010-2022 Wandenberg Peixoto <wandenberg@gmail.com>, Rogério Carvalho Schneider <stockrt@gmail.com>
+ *
+ * This file is part of Nginx Push Stream Module.
+ *
+ * Nginx Push Stream Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Push Stream Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Push Stream Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * template_format_benchmark.c
+ *
+ * Compare the cost to format a message walking a linked list of template parts,
+ * formatting every field of the message, with walking the compiled array of
+ * parts, formatting only the fields used by the template.
+ *
+ * usage: ./template_format_benchmark [number of messages] [template]
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TIME_FMT_LEN    30
+
+typedef enum {
+    PART_ID = 0,
+    PART_TAG,
+    PART_TIME,
+    PART_EVENT_ID,
+    PART_EVENT_TYPE,
+    PART_CHANNEL,
+    PART_TEXT,
+    PART_SIZE,
+    PART_LITERAL
+} part_type;
+
+typedef struct part_s {
+    struct part_s  *next;
+    part_type       kind;
+    const char     *text;
+    size_t          len;
+} part_t;
+
+typedef struct {
+    part_t         *parts;
+    part_t         *ops;
+    size_t          qtd_ops;
+    size_t          qtd[PART_LITERAL];
+    size_t          literal_len;
+} template_t;
+
+typedef struct {
+    long            id;
+    long            tag;
+    time_t          time;
+    const char     *event_id;
+    const char     *event_type;
+    const char     *channel;
+    const char     *text;
+    size_t          len;
+} message_t;
+
+static const char  *tokens[PART_LITERAL] = { "~id~", "~tag~", "~time~", "~event-id~", "~event-type~", "~channel~", "~text~", "~size~" };
+
+
+static void
+add_part(template_t *template, part_t **tail, part_type kind, const char *text, size_t len)
+{
+    part_t *part = calloc(1, sizeof(part_t));
+
+    part->kind = kind;
+    part->text = text;
+    part->len = len;
+    *tail = part;
+
+    if (kind == PART_LITERAL) {
+        template->literal_len += len;
+    } else {
+        template->qtd[kind]++;
+    }
+}
+
+
+static void
+parse_template(template_t *template, const char *text)
+{
+    part_t    **tail = &template->parts, *part;
+    const char *last = text, *start = text;
+    size_t      i;
+    int         kind;
+
+    while ((start = strchr(start, '~')) != NULL) {
+        for (kind = 0; kind < PART_LITERAL; kind++) {
+            if (strncmp(start, tokens[kind], strlen(tokens[kind])) == 0) {
+                break;
+            }
+        }
+
+        if (kind == PART_LITERAL) {
+            start++;
+            continue;
+        }
+
+        if (start > last) {
+            add_part(template, tail, PART_LITERAL, last, start - last);
+            tail = &(*tail)->next;
+        }
+        add_part(template, tail, kind, NULL, 0);
+        tail = &(*tail)->next;
+        start += strlen(tokens[kind]);
+        last = start;
+    }
+
+    if (*last != '\0') {
+        add_part(template, tail, PART_LITERAL, last, strlen(last));
+    }
+
+    for (part = template->parts; part != NULL; part = part->next) {
+        template->qtd_ops++;
+    }
+
+    template->ops = calloc(template->qtd_ops + 1, sizeof(part_t));
+    for (i = 0, part = template->parts; part != NULL; i++, part = part->next) {
+        template->ops[i] = *part;
+    }
+}
+
+
+static size_t
+http_time(char *buf, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    return strftime(buf, TIME_FMT_LEN, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+
+static char *
+copy_part(char *last, part_type kind, const char *text, size_t len, message_t *msg, const char *id, size_t id_len, const char *tag, size_t tag_len, const char *tm, size_t time_len, const char *size, size_t size_len)
+{
+    switch (kind) {
+        case PART_ID:         memcpy(last, id, id_len); return last + id_len;
+        case PART_TAG:        memcpy(last, tag, tag_len); return last + tag_len;
+        case PART_TIME:       memcpy(last, tm, time_len); return last + time_len;
+        case PART_EVENT_ID:   len = strlen(msg->event_id); memcpy(last, msg->event_id, len); return last + len;
+        case PART_EVENT_TYPE: len = strlen(msg->event_type); memcpy(last, msg->event_type, len); return last + len;
+        case PART_CHANNEL:    len = strlen(msg->channel); memcpy(last, msg->channel, len); return last + len;
+        case PART_TEXT:       memcpy(last, msg->text, msg->len); return last + msg->len;
+        case PART_SIZE:       memcpy(last, size, size_len); return last + size_len;
+        default:              memcpy(last, text, len); return last + len;
+    }
+}
+
+
+// as the module did: every field formatted, parts on a linked list
+static size_t
+format_list(template_t *template, message_t *msg, char *out)
+{
+    char    id[24], tag[24], size[24], tm[TIME_FMT_LEN];
+    size_t  id_len, tag_len, size_len, time_len;
+    char   *last = out;
+    part_t *part;
+
+    sprintf(id, "%ld", msg->id);
+    id_len = strlen(id);
+    time_len = http_time(tm, msg->time);
+    sprintf(tag, "%ld", msg->tag);
+    tag_len = strlen(tag);
+    sprintf(size, "%zu", msg->len);
+    size_len = strlen(size);
+
+    for (part = template->parts; part != NULL; part = part->next) {
+        last = copy_part(last, part->kind, part->text, part->len, msg, id, id_len, tag, tag_len, tm, time_len, size, size_len);
+    }
+
+    return last - out;
+}
+
+
+// as the module does: only the fields used formatted, parts on an array
+static size_t
+format_compiled(template_t *template, message_t *msg, char *out)
+{
+    char    id[24], tag[24], size[24], tm[TIME_FMT_LEN];
+    size_t  id_len = 0, tag_len = 0, size_len = 0, time_len = 0;
+    char   *last = out;
+    part_t *op, *end;
+
+    if (template->qtd[PART_ID] > 0) {
+        id_len = sprintf(id, "%ld", msg->id);
+    }
+    if (template->qtd[PART_TIME] > 0) {
+        time_len = http_time(tm, msg->time);
+    }
+    if (template->qtd[PART_TAG] > 0) {
+        tag_len = sprintf(tag, "%ld", msg->tag);
+    }
+    if (template->qtd[PART_SIZE] > 0) {
+        size_len = sprintf(size, "%zu", msg->len);
+    }
+
+    for (op = template->ops, end = template->ops + template->qtd_ops; op < end; op++) {
+        last = copy_part(last, op->kind, op->text, op->len, msg, id, id_len, tag, tag_len, tm, time_len, size, size_len);
+    }
+
+    return last - out;
+}
+
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    size_t              messages = (argc > 1) ? strtoul(argv[1], NULL, 10) : 5000000;
+    const char         *text = (argc > 2) ? argv[2] : "{\"id\": ~id~, \"channel\": \"~channel~\", \"text\": \"~text~\"}";
+    template_t          template;
+    message_t           msg;
+    struct timespec     start, end;
+    size_t              i, total;
+    char                out[4096];
+
+    if (messages == 0) {
+        fprintf(stderr, "usage: %s [number of messages] [template]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&template, 0, sizeof(template));
+    parse_template(&template, text);
+
+    msg.tag = 1;
+    msg.time = time(NULL);
+    msg.event_id = "event_1";
+    msg.event_type = "update";
+    msg.channel = "my_channel";
+    msg.text = "a message published to the channel with a regular size";
+    msg.len = strlen(msg.text);
+
+    total = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < messages; i++) {
+        msg.id = i;
+        total += format_list(&template, &msg, out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("list:     %zu messages, %zu bytes, %.1f ns/message\n", messages, total, elapsed_ns(&start, &end) / messages);
+
+    total = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < messages; i++) {
+        msg.id = i;
+        total += format_compiled(&template, &msg, out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("compiled: %zu messages, %zu bytes, %.1f ns/message (%zu parts)\n", messages, total, elapsed_ns(&start, &end) / messages, template.qtd_ops);
+
+    return 0;
+}
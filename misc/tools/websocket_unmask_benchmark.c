@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2010-2022 Wandenberg Peixoto <wandenberg@gmail.com>, Rogério Carvalho Schneider <stockrt@gmail.com>
+ *
+ * This file is part of Nginx Push Stream Module.
+ *
+ * Nginx Push Stream Module is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Nginx Push Stream Module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nginx Push Stream Module.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * websocket_unmask_benchmark.c
+ *
+ * Compare the cost to unmask a websocket payload byte by byte and then check
+ * it is valid UTF-8 byte by byte, with unmasking it by words, SSE2 and AVX2
+ * blocks checking for ASCII on the same pass.
+ *
+ * usage: ./websocket_unmask_benchmark [payload size] [number of payloads]
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if (defined __x86_64__)
+#include <immintrin.h>
+#endif
+
+
+// same as ngx_utf8_decode, only the validity is needed here
+static uint32_t
+utf8_decode(unsigned char **p, size_t n)
+{
+    size_t    len;
+    uint32_t  u, i, valid;
+
+    u = **p;
+
+    if (u >= 0xf0) {
+        u &= 0x07; valid = 0xffff; len = 3;
+    } else if (u >= 0xe0) {
+        u &= 0x0f; valid = 0x7ff; len = 2;
+    } else if (u >= 0xc2) {
+        u &= 0x1f; valid = 0x7f; len = 1;
+    } else {
+        (*p)++;
+        return 0xffffffff;
+    }
+
+    if (n - 1 < len) {
+        return 0xfffffffe;
+    }
+
+    (*p)++;
+
+    while (len) {
+        i = *(*p)++;
+        if (i < 0x80) {
+            return 0xffffffff;
+        }
+        u = (u << 6) | (i & 0x3f);
+        len--;
+    }
+
+    return (u > valid) ? u : 0xffffffff;
+}
+
+
+// as the module did: unmask byte by byte, then check each byte
+static int
+unmask_bytes(unsigned char *p, size_t n, unsigned char *mask_key)
+{
+    unsigned char *last = p + n;
+    size_t         i;
+
+    for (i = 0; i < n; i++) {
+        p[i] = p[i] ^ mask_key[i % 4];
+    }
+
+    while (p < last) {
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+        if (utf8_decode(&p, last - p) > 0x10ffff) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static int
+is_utf8(unsigned char *p, size_t n)
+{
+    unsigned char *last = p + n;
+    uint64_t       word;
+
+    while (p < last) {
+        if (*p < 0x80) {
+            if (last - p >= 8) {
+                memcpy(&word, p, 8);
+                if ((word & 0x8080808080808080ULL) == 0) {
+                    p += 8;
+                    continue;
+                }
+            }
+            p++;
+            continue;
+        }
+        if (utf8_decode(&p, last - p) > 0x10ffff) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static size_t
+unmask_ascii_word(unsigned char *p, size_t n, unsigned char *mask_key)
+{
+    uint32_t  key;
+    uint64_t  mask, word;
+    size_t    i, ascii = n;
+
+    memcpy(&key, mask_key, 4);
+    mask = ((uint64_t) key << 32) | key;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        memcpy(&word, p + i, 8);
+        word ^= mask;
+        memcpy(p + i, &word, 8);
+        if ((ascii == n) && (word & 0x8080808080808080ULL)) {
+            ascii = i;
+        }
+    }
+
+    for (; i < n; i++) {
+        p[i] ^= ((unsigned char *) &key)[i % 4];
+        if ((ascii == n) && (p[i] & 0x80)) {
+            ascii = i;
+        }
+    }
+
+    return ascii;
+}
+
+
+#if (defined __x86_64__)
+static size_t
+unmask_ascii_sse2(unsigned char *p, size_t n, unsigned char *mask_key)
+{
+    uint32_t  key;
+    __m128i   mask, block;
+    size_t    i, ascii = n, tail;
+
+    memcpy(&key, mask_key, 4);
+    mask = _mm_set1_epi32((int) key);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        block = _mm_xor_si128(_mm_loadu_si128((__m128i *) (p + i)), mask);
+        _mm_storeu_si128((__m128i *) (p + i), block);
+        if ((ascii == n) && _mm_movemask_epi8(block)) {
+            ascii = i;
+        }
+    }
+
+    tail = unmask_ascii_word(p + i, n - i, mask_key);
+
+    return (ascii < n) ? ascii : i + tail;
+}
+
+
+__attribute__((target("avx2")))
+static size_t
+unmask_ascii_avx2(unsigned char *p, size_t n, unsigned char *mask_key)
+{
+    uint32_t  key;
+    __m256i   mask, block;
+    size_t    i, ascii = n, tail;
+
+    memcpy(&key, mask_key, 4);
+    mask = _mm256_set1_epi32((int) key);
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        block = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) (p + i)), mask);
+        _mm256_storeu_si256((__m256i *) (p + i), block);
+        if ((ascii == n) && _mm256_movemask_epi8(block)) {
+            ascii = i;
+        }
+    }
+
+    tail = unmask_ascii_sse2(p + i, n - i, mask_key);
+
+    return (ascii < n) ? ascii : i + tail;
+}
+#endif
+
+
+static double
+elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+
+static int
+run(const char *name, size_t (*unmask)(unsigned char *, size_t, unsigned char *), unsigned char *masked, unsigned char *expected, unsigned char *buf, size_t size, size_t payloads, unsigned char *mask_key)
+{
+    struct timespec  start, end;
+    size_t           i, ascii;
+    int              valid = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < payloads; i++) {
+        memcpy(buf, masked, size);
+        if (unmask == NULL) {
+            valid = unmask_bytes(buf, size, mask_key);
+        } else {
+            ascii = unmask(buf, size, mask_key);
+            valid = (ascii == size) || is_utf8(buf + ascii, size - ascii);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-6s %zu payloads of %zu bytes, %.1f us/payload\n", name, payloads, size, elapsed_ns(&start, &end) / payloads / 1000);
+
+    if (!valid || (memcmp(buf, expected, size) != 0)) {
+        fprintf(stderr, "%s: payload wrongly unmasked\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    size_t           size = (argc > 1) ? strtoul(argv[1], NULL, 10) : 65536;
+    size_t           payloads = (argc > 2) ? strtoul(argv[2], NULL, 10) : 20000;
+    unsigned char    mask_key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    unsigned char   *text, *masked, *buf;
+    size_t           i;
+    int              rc = 0;
+
+    if ((size == 0) || (payloads == 0)) {
+        fprintf(stderr, "usage: %s [payload size] [number of payloads]\n", argv[0]);
+        return 1;
+    }
+
+    text = malloc(size);
+    masked = malloc(size);
+    buf = malloc(size);
+
+    // a JSON like ASCII payload ending with a two bytes UTF-8 character, when it fits
+    for (i = 0; i < size; i++) {
+        text[i] = "{\"key\": \"value\", \"n\": 1234}"[i % 27];
+    }
+    if (size >= 2) {
+        text[size - 2] = 0xc3;
+        text[size - 1] = 0xa9;
+    }
+
+    for (i = 0; i < size; i++) {
+        masked[i] = text[i] ^ mask_key[i % 4];
+    }
+
+    rc |= run("bytes", NULL, masked, text, buf, size, payloads, mask_key);
+    rc |= run("word", unmask_ascii_word, masked, text, buf, size, payloads, mask_key);
+#if (defined __x86_64__)
+    rc |= run("sse2", unmask_ascii_sse2, masked, text, buf, size, payloads, mask_key);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        rc |= run("avx2", unmask_ascii_avx2, masked, text, buf, size, payloads, mask_key);
+    }
+#endif
+
+    return rc;
+}
@@ -60,12 +60,14 @@ ngx_http_push_stream_send_response_all_channels_info_summarized(ngx_http_request
 {
     ngx_uint_t                                   len;
     ngx_str_t                                   *currenttime, *hostname, *format, *text;
-    u_char                                      *subscribers_by_workers, *start;
+    u_char                                      *subscribers_by_workers, *contention_by_mutexes, *subscribers_by_templates, *start;
     int                                          i, j, used_slots;
+    ngx_http_push_stream_channel_mutex_t        *mutex;
     ngx_http_push_stream_main_conf_t            *mcf = ngx_http_get_module_main_conf(r, ngx_http_push_stream_module);
     ngx_http_push_stream_shm_data_t             *data = mcf->shm_data;
     ngx_http_push_stream_worker_data_t          *worker_data;
     ngx_http_push_stream_content_subtype_t      *subtype;
+    ngx_uint_t                                   published_messages, stored_messages, subscribers;
 
     subtype = ngx_http_push_stream_match_channel_info_format_and_content_type(r, 1);
     currenttime = ngx_http_push_stream_get_formatted_current_time(r->pool);
@@ -73,7 +75,7 @@ ngx_http_push_stream_send_response_all_channels_info_summarized(ngx_http_request
 
     used_slots = 0;
     for(i = 0; i < NGX_MAX_PROCESSES; i++) {
-        if (data->ipc[i].pid > 0) {
+        if ((data->ipc[i] != NULL) && (data->ipc[i]->pid > 0)) {
             used_slots++;
         }
     }
@@ -86,8 +88,8 @@ ngx_http_push_stream_send_response_all_channels_info_summarized(ngx_http_request
     }
     start = subscribers_by_workers;
     for (i = 0, j = 0; (i < used_slots) && (j < NGX_MAX_PROCESSES); j++) {
-        worker_data = data->ipc + j;
-        if (worker_data->pid > 0) {
+        worker_data = data->ipc[j];
+        if ((worker_data != NULL) && (worker_data->pid > 0)) {
             format = (i < used_slots - 1) ? subtype->format_summarized_worker_item : subtype->format_summarized_worker_last_item;
             start = ngx_sprintf(start, (char *) format->data, worker_data->pid, worker_data->subscribers, ngx_time() - worker_data->startup);
             i++;
@@ -95,14 +97,43 @@ ngx_http_push_stream_send_response_all_channels_info_summarized(ngx_http_request
     }
     *start = '\0';
 
-    len = 8*NGX_INT_T_LEN + subtype->format_summarized->len + hostname->len + currenttime->len + ngx_strlen(subscribers_by_workers) - 24;// minus 24 sprintf
+    len = (subtype->format_summarized_mutex_item->len > subtype->format_summarized_mutex_last_item->len) ? subtype->format_summarized_mutex_item->len : subtype->format_summarized_mutex_last_item->len;
+    len = data->channels_mutexes * (3*NGX_ATOMIC_T_LEN + len - 9) + 1; //minus 9 sprintf
+    if ((contention_by_mutexes = ngx_pcalloc(r->pool, len)) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Failed to allocate memory to write channel mutexes statistics.");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    start = contention_by_mutexes;
+    for (i = 0; (ngx_uint_t) i < data->channels_mutexes; i++) {
+        mutex = data->channels_mutex + i;
+        format = ((ngx_uint_t) i < data->channels_mutexes - 1) ? subtype->format_summarized_mutex_item : subtype->format_summarized_mutex_last_item;
+        start = ngx_sprintf(start, (char *) format->data, (ngx_uint_t) i, mutex->acquisitions, mutex->contentions);
+    }
+    *start = '\0';
+
+    len = (subtype->format_summarized_template_item->len > subtype->format_summarized_template_last_item->len) ? subtype->format_summarized_template_item->len : subtype->format_summarized_template_last_item->len;
+    len = data->qtd_templates * (2*NGX_ATOMIC_T_LEN + len - 6) + 1; //minus 6 sprintf
+    if ((subscribers_by_templates = ngx_pcalloc(r->pool, len)) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Failed to allocate memory to write templates statistics.");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    start = subscribers_by_templates;
+    for (i = 0; (ngx_uint_t) i < data->qtd_templates; i++) {
+        format = ((ngx_uint_t) i < data->qtd_templates - 1) ? subtype->format_summarized_template_item : subtype->format_summarized_template_last_item;
+        start = ngx_sprintf(start, (char *) format->data, (ngx_uint_t) i + 1, data->template_subscribers[i]);
+    }
+    *start = '\0';
+
+    len = 9*NGX_INT_T_LEN + subtype->format_summarized->len + hostname->len + currenttime->len + ngx_strlen(subscribers_by_workers) + ngx_strlen(contention_by_mutexes) + ngx_strlen(subscribers_by_templates) - 31;// minus 31 sprintf
 
     if ((text = ngx_http_push_stream_create_str(r->pool, len)) == NULL) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Failed to allocate response buffer.");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    ngx_sprintf(text->data, (char *) subtype->format_summarized->data, hostname->data, currenttime->data, data->channels, data->wildcard_channels, data->published_messages, data->stored_messages, data->messages_in_trash, data->channels_in_delete, data->channels_in_trash, data->subscribers, ngx_time() - data->startup, subscribers_by_workers);
+    ngx_http_push_stream_sum_worker_counters(data, &published_messages, &stored_messages, &subscribers);
+
+    ngx_sprintf(text->data, (char *) subtype->format_summarized->data, hostname->data, currenttime->data, data->channels, data->wildcard_channels, published_messages, stored_messages, data->messages_in_trash, data->channels_in_delete, data->channels_in_trash, (ngx_uint_t) ngx_http_push_stream_get_cleanup_lag(data), subscribers, ngx_time() - data->startup, subscribers_by_workers, contention_by_mutexes, subscribers_by_templates);
     text->len = ngx_strlen(text->data);
 
     return ngx_http_push_stream_send_response(r, text, subtype->content_type, NGX_HTTP_OK);
@@ -411,5 +442,37 @@ ngx_http_push_stream_find_or_add_template(ngx_conf_t *cf, ngx_str_t template, ng
         ngx_queue_insert_tail(&cur->parts, &part->queue);
     }
 
+    if (ngx_http_push_stream_compile_template(cf, cur) != NGX_OK) {
+        return -1;
+    }
+
     return cur->index;
 }
+
+
+// copy the parts to an array, formatting a message walks it instead of the queue
+static ngx_int_t
+ngx_http_push_stream_compile_template(ngx_conf_t *cf, ngx_http_push_stream_template_t *template)
+{
+    ngx_queue_t                           *q;
+    ngx_http_push_stream_template_parts_t *part;
+    ngx_uint_t                             i = 0;
+
+    for (q = ngx_queue_head(&template->parts); q != ngx_queue_sentinel(&template->parts); q = ngx_queue_next(q)) {
+        i++;
+    }
+
+    if ((template->ops = ngx_pcalloc(cf->pool, ngx_max(i, 1) * sizeof(ngx_http_push_stream_template_op_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, cf->log, 0, "push stream module: unable to allocate memory for compile template");
+        return NGX_ERROR;
+    }
+
+    template->qtd_ops = i;
+    for (i = 0, q = ngx_queue_head(&template->parts); q != ngx_queue_sentinel(&template->parts); i++, q = ngx_queue_next(q)) {
+        part = ngx_queue_data(q, ngx_http_push_stream_template_parts_t, queue);
+        template->ops[i].kind = part->kind;
+        template->ops[i].text = part->text;
+    }
+
+    return NGX_OK;
+}
@@ -33,8 +33,7 @@
 
 #include <ngx_http_push_stream_module_ipc.h>
 
-void ngx_http_push_stream_ipc_init_worker_data(ngx_http_push_stream_shm_data_t *data);
-static ngx_inline void ngx_http_push_stream_census_worker_subscribers_data(ngx_http_push_stream_shm_data_t *data);
+ngx_int_t ngx_http_push_stream_ipc_init_worker_data(ngx_http_push_stream_shm_data_t *data);
 static ngx_inline void ngx_http_push_stream_process_worker_message_data(ngx_http_push_stream_shm_data_t *data);
 
 
@@ -44,6 +43,12 @@ ngx_http_push_stream_init_ipc(ngx_cycle_t *cycle, ngx_int_t workers)
     int         i, s = 0, on = 1;
     ngx_int_t   last_expected_process = ngx_last_process;
 
+    if (!ngx_http_push_stream_eventfds_initialized) {
+        for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+            ngx_http_push_stream_eventfds[i] = NGX_INVALID_FILE;
+        }
+        ngx_http_push_stream_eventfds_initialized = 1;
+    }
 
     /*
      * here's the deal: we have no control over fork()ing, nginx's internal
@@ -99,6 +104,19 @@ ngx_http_push_stream_init_ipc(ngx_cycle_t *cycle, ngx_int_t workers)
             return NGX_ERROR;
         }
 
+        // the eventfd left by the previous worker on this slot is not used anymore
+        if (ngx_http_push_stream_eventfds[s] != NGX_INVALID_FILE) {
+            close(ngx_http_push_stream_eventfds[s]);
+            ngx_http_push_stream_eventfds[s] = NGX_INVALID_FILE;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if ((ngx_http_push_stream_ipc_signal == NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_EVENTFD) && (ngx_http_push_stream_init_eventfd(cycle, s) != NGX_OK)) {
+            ngx_close_channel(socks, cycle->log);
+            return NGX_ERROR;
+        }
+#endif
+
         s++; // NEXT!!
     }
 
@@ -106,10 +124,42 @@ ngx_http_push_stream_init_ipc(ngx_cycle_t *cycle, ngx_int_t workers)
 }
 
 
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t
+ngx_http_push_stream_init_eventfd(ngx_cycle_t *cycle, ngx_int_t slot)
+{
+    int         fd;
+
+    if ((fd = eventfd(0, 0)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "eventfd() failed while initializing push stream module");
+        return NGX_ERROR;
+    }
+    if (ngx_nonblocking(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, ngx_nonblocking_n " failed on eventfd while initializing push stream module");
+        close(fd);
+        return NGX_ERROR;
+    }
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "fcntl(FD_CLOEXEC) failed on eventfd while initializing push stream module");
+        close(fd);
+        return NGX_ERROR;
+    }
+
+    ngx_http_push_stream_eventfds[slot] = fd;
+
+    return NGX_OK;
+}
+#endif
+
+
 static void
 ngx_http_push_stream_ipc_exit_worker(ngx_cycle_t *cycle)
 {
     ngx_close_channel((ngx_socket_t *) ngx_http_push_stream_socketpairs[ngx_process_slot], cycle->log);
+    if (ngx_http_push_stream_eventfds[ngx_process_slot] != NGX_INVALID_FILE) {
+        close(ngx_http_push_stream_eventfds[ngx_process_slot]);
+        ngx_http_push_stream_eventfds[ngx_process_slot] = NGX_INVALID_FILE;
+    }
 }
 
 
@@ -120,48 +170,219 @@ ngx_http_push_stream_ipc_init_worker(void)
     ngx_slab_pool_t                        *global_shpool = (ngx_slab_pool_t *) ngx_http_push_stream_global_shm_zone->shm.addr;
     ngx_http_push_stream_global_shm_data_t *global_data = (ngx_http_push_stream_global_shm_data_t *) ngx_http_push_stream_global_shm_zone->data;
     ngx_queue_t                            *q;
-    int                                     i;
+
+    ngx_http_push_stream_ipc_wakeup_event.handler = ngx_http_push_stream_ipc_wakeup_timer_wake_handler;
+    ngx_http_push_stream_ipc_wakeup_event.data = &ngx_http_push_stream_ipc_wakeup_event;
+    ngx_http_push_stream_ipc_wakeup_event.log = ngx_cycle->log;
 
     ngx_shmtx_lock(&global_shpool->mutex);
     global_data->pid[ngx_process_slot] = ngx_pid;
     for (q = ngx_queue_head(&global_data->shm_datas_queue); q != ngx_queue_sentinel(&global_data->shm_datas_queue); q = ngx_queue_next(q)) {
         ngx_http_push_stream_shm_data_t *data = ngx_queue_data(q, ngx_http_push_stream_shm_data_t, shm_data_queue);
-        ngx_http_push_stream_ipc_init_worker_data(data);
-    }
-    ngx_shmtx_unlock(&global_shpool->mutex);
-
-    for(i = 0; i < NGX_MAX_PROCESSES; i++) {
-        if (global_data->pid[i] > 0) {
-            ngx_http_push_stream_alert_worker_census_subscribers(global_data->pid[i], i, ngx_cycle->log);
+        if (ngx_http_push_stream_ipc_init_worker_data(data) != NGX_OK) {
+            ngx_shmtx_unlock(&global_shpool->mutex);
+            return NGX_ERROR;
         }
     }
+    ngx_shmtx_unlock(&global_shpool->mutex);
 
     return NGX_OK;
 }
 
 
-void
+ngx_int_t
 ngx_http_push_stream_ipc_init_worker_data(ngx_http_push_stream_shm_data_t *data)
 {
     ngx_slab_pool_t                        *shpool = data->shpool;
-    int                                     i;
+    ngx_http_push_stream_worker_data_t     *worker_data;
+
+    // only the slots used get memory, rounded to whole cache lines the slab chunk does not share a line with another slot
+    if (data->ipc[ngx_process_slot] == NULL) {
+        if ((worker_data = ngx_slab_alloc(shpool, ngx_align(sizeof(ngx_http_push_stream_worker_data_t), NGX_CPU_CACHE_LINE))) == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "push stream module: unable to allocate worker data in shared memory");
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(worker_data, sizeof(ngx_http_push_stream_worker_data_t));
+        worker_data->pid = NGX_INVALID_FILE;
+        ngx_queue_init(&worker_data->messages_queue);
+        ngx_queue_init(&worker_data->subscribers_queue);
+        ngx_queue_init(&worker_data->channels_entries);
+        data->ipc[ngx_process_slot] = worker_data;
+    }
 
     // cleanning old content if worker die and another one is set on same slot
     ngx_http_push_stream_clean_worker_data(data);
 
     ngx_shmtx_lock(&shpool->mutex);
 
-    data->ipc[ngx_process_slot].pid = ngx_pid;
-    data->ipc[ngx_process_slot].startup = ngx_time();
+    data->ipc[ngx_process_slot]->pid = ngx_pid;
+    data->ipc[ngx_process_slot]->startup = ngx_time();
+    data->ipc[ngx_process_slot]->wakeup_pending = 0;
+    data->ipc[ngx_process_slot]->inbox_stalled_since = 0;
 
-    data->slots_for_census = 0;
-    for(i = 0; i < NGX_MAX_PROCESSES; i++) {
-        if (data->ipc[i].pid > 0) {
-            data->slots_for_census++;
-        }
+    // the inbox is kept when another worker takes the slot
+    if ((data->ipc[ngx_process_slot]->inbox == NULL) && (ngx_http_push_stream_init_worker_inbox(data->ipc[ngx_process_slot], shpool) != NGX_OK)) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push stream module: unable to allocate worker inbox, messages to this worker will be queued");
     }
 
     ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_init_worker_inbox(ngx_http_push_stream_worker_data_t *worker_data, ngx_slab_pool_t *shpool)
+{
+    ngx_http_push_stream_worker_inbox_cell_t *inbox;
+    ngx_uint_t                                i;
+
+    if ((inbox = ngx_slab_alloc_locked(shpool, sizeof(ngx_http_push_stream_worker_inbox_cell_t) * NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE; i++) {
+        inbox[i].sequence = i;
+        inbox[i].producer = 0;
+    }
+
+    worker_data->inbox_head = 0;
+    worker_data->inbox_tail = 0;
+    worker_data->inbox_stalled_since = 0;
+    ngx_memory_barrier();
+    worker_data->inbox = inbox;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_worker_inbox_push(ngx_http_push_stream_worker_data_t *worker_data, ngx_http_push_stream_worker_msg_t *worker_msg, ngx_flag_t *inbox_was_empty)
+{
+    ngx_http_push_stream_worker_inbox_cell_t *cell;
+    ngx_atomic_uint_t                         pos;
+    ngx_atomic_int_t                          dif;
+
+    pos = worker_data->inbox_tail;
+    for ( ;; ) {
+        cell = worker_data->inbox + (pos & (NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE - 1));
+        dif = (ngx_atomic_int_t) (cell->sequence - pos);
+        if (dif == 0) {
+            if (ngx_atomic_cmp_set(&worker_data->inbox_tail, pos, pos + 1)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // the worker did not read this cell yet, the inbox is full
+            return NGX_DECLINED;
+        }
+        pos = worker_data->inbox_tail;
+    }
+
+    /*
+     * from the claim above until the sequence is set below the cell blocks the inbox head,
+     * if this process dies in between the worker skips the cell once it finds this pid gone (or never set),
+     * losing the message on it and the reference it holds
+     */
+    cell->producer = ngx_pid;
+    ngx_memory_barrier();
+
+    cell->worker_msg.msg = worker_msg->msg;
+    cell->worker_msg.pid = worker_msg->pid;
+    cell->worker_msg.channel = worker_msg->channel;
+    cell->worker_msg.subscriptions_sentinel = worker_msg->subscriptions_sentinel;
+    cell->worker_msg.mcf = worker_msg->mcf;
+
+    // the locked operation publishes the cell before the head is read, pairing with the head increment on pop,
+    // it fails only if the cell was skipped as stalled, then the message goes to the queue
+    if (!ngx_atomic_cmp_set(&cell->sequence, pos, pos + 1)) {
+        return NGX_DECLINED;
+    }
+    *inbox_was_empty = (worker_data->inbox_head == pos);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_worker_inbox_pop(ngx_http_push_stream_worker_data_t *worker_data, ngx_http_push_stream_worker_msg_t *worker_msg)
+{
+    ngx_http_push_stream_worker_inbox_cell_t *cell;
+    ngx_atomic_uint_t                         pos = worker_data->inbox_head;
+
+    if (worker_data->inbox == NULL) {
+        return NGX_DECLINED;
+    }
+
+    cell = worker_data->inbox + (pos & (NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE - 1));
+    if (cell->sequence != pos + 1) {
+        // claimed by a publisher and not written yet
+        if ((cell->sequence == pos) && (worker_data->inbox_tail != pos) && (ngx_http_push_stream_worker_inbox_skip_stalled_cell(worker_data, cell, pos) == NGX_OK)) {
+            return ngx_http_push_stream_worker_inbox_pop(worker_data, worker_msg);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    *worker_msg = cell->worker_msg;
+
+    // release the cell to be written again on the next lap
+    cell->producer = 0;
+    ngx_memory_barrier();
+    cell->sequence = pos + NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE;
+    ngx_atomic_fetch_add(&worker_data->inbox_head, 1);
+    worker_data->inbox_stalled_since = 0;
+
+    return NGX_OK;
+}
+
+
+// a publisher which died between claiming a cell and writing it would hold the messages behind it forever
+static ngx_int_t
+ngx_http_push_stream_worker_inbox_skip_stalled_cell(ngx_http_push_stream_worker_data_t *worker_data, ngx_http_push_stream_worker_inbox_cell_t *cell, ngx_atomic_uint_t pos)
+{
+    ngx_pid_t                                 producer;
+
+    if ((worker_data->inbox_stalled_since == 0) || (worker_data->inbox_stalled_pos != pos)) {
+        worker_data->inbox_stalled_pos = pos;
+        worker_data->inbox_stalled_since = ngx_time();
+        return NGX_DECLINED;
+    }
+
+    if (ngx_time() - worker_data->inbox_stalled_since < NGX_HTTP_PUSH_STREAM_WORKER_INBOX_STALL_TIMEOUT) {
+        return NGX_DECLINED;
+    }
+
+    // a live publisher is only slow, the cell is left to it
+    producer = cell->producer;
+    if ((producer != 0) && ((kill(producer, 0) == 0) || (ngx_errno != NGX_ESRCH))) {
+        return NGX_DECLINED;
+    }
+
+    if (!ngx_atomic_cmp_set(&cell->sequence, pos, pos + NGX_HTTP_PUSH_STREAM_WORKER_INBOX_SIZE)) {
+        // written meanwhile
+        return NGX_DECLINED;
+    }
+
+    cell->producer = 0;
+    ngx_atomic_fetch_add(&worker_data->inbox_head, 1);
+    worker_data->inbox_stalled_since = 0;
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push stream module: worker %P skipped a message left unwritten on its inbox by process %P", ngx_pid, producer);
+
+    return NGX_OK;
+}
+
+
+// publishers alert a worker only when its inbox was empty, a stalled cell would keep the messages pushed after it there
+static void
+ngx_http_push_stream_check_worker_inbox(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_http_push_stream_worker_data_t     *thisworker_data = data->ipc[ngx_process_slot];
+
+    if ((thisworker_data->inbox != NULL) && (thisworker_data->inbox_head != thisworker_data->inbox_tail)) {
+        ngx_http_push_stream_process_worker_message_data(data);
+    }
 }
 
 
@@ -177,57 +398,130 @@ ngx_http_push_stream_alert_shutting_down_workers(void)
             ngx_close_channel((ngx_socket_t *) ngx_http_push_stream_socketpairs[i], ngx_cycle->log);
             ngx_http_push_stream_socketpairs[i][0] = NGX_INVALID_FILE;
             ngx_http_push_stream_socketpairs[i][1] = NGX_INVALID_FILE;
+            if (ngx_http_push_stream_eventfds[i] != NGX_INVALID_FILE) {
+                close(ngx_http_push_stream_eventfds[i]);
+                ngx_http_push_stream_eventfds[i] = NGX_INVALID_FILE;
+            }
         }
     }
 }
 
 
-static ngx_int_t
-ngx_http_push_stream_unsubscribe_worker(ngx_http_push_stream_channel_t *channel, ngx_slab_pool_t *shpool)
+// only the worker on a slot adds entries to its queue, the caller holds the lock taken by a worker starting on a slot
+static void
+ngx_http_push_stream_unsubscribe_worker(ngx_http_push_stream_shm_data_t *data, ngx_int_t slot)
 {
+    ngx_slab_pool_t                         *shpool = data->shpool;
+    ngx_queue_t                             *entries = &data->ipc[slot]->channels_entries;
     ngx_http_push_stream_pid_queue_t        *worker;
-    ngx_queue_t                             *q;
+    ngx_http_push_stream_channel_t          *channel;
+    ngx_http_push_stream_channel_mutex_t    *mutex;
+    ngx_uint_t                               subscribers = 0;
+    ngx_flag_t                               found;
 
-    ngx_shmtx_lock(channel->mutex);
-    for (q = ngx_queue_head(&channel->workers_with_subscribers); q != ngx_queue_sentinel(&channel->workers_with_subscribers); q = ngx_queue_next(q)) {
-        worker = ngx_queue_data(q, ngx_http_push_stream_pid_queue_t, queue);
-        if ((worker->pid == ngx_pid) || (worker->slot == ngx_process_slot)) {
-            ngx_queue_remove(&worker->queue);
-            ngx_slab_free(shpool, worker);
+    for (;;) {
+        ngx_shmtx_lock(&shpool->mutex);
+        if (ngx_queue_empty(entries)) {
+            ngx_shmtx_unlock(&shpool->mutex);
             break;
         }
+        worker = ngx_queue_data(ngx_queue_head(entries), ngx_http_push_stream_pid_queue_t, slot_queue);
+        channel = worker->channel;
+        mutex = channel->mutex;
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        // the channel may have been released with its entries before its mutex was taken
+        ngx_http_push_stream_lock_channel_mutex(mutex);
+        ngx_shmtx_lock(&shpool->mutex);
+        found = !ngx_queue_empty(entries) && (ngx_queue_head(entries) == &worker->slot_queue);
+        ngx_shmtx_unlock(&shpool->mutex);
+        if (found) {
+            ngx_http_push_stream_discount_dead_worker_locked(shpool, channel, worker);
+            subscribers = channel->subscribers;
+        }
+        ngx_http_push_stream_unlock_channel_mutex(mutex);
+
+        // the channel may be collected once the subscribers of the dead worker are discounted
+        if (found && (subscribers == 0)) {
+            ngx_http_push_stream_schedule_channel_expiry(data, channel, channel->expires);
+        }
     }
-    ngx_shmtx_unlock(channel->mutex);
+}
 
-    return NGX_OK;
+
+// the subscribers of a worker which died never leave the channel by themselves, they are discounted with its entry
+static void
+ngx_http_push_stream_discount_dead_worker_locked(ngx_slab_pool_t *shpool, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_pid_queue_t *worker)
+{
+    NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER_BY(channel->subscribers, worker->subscribers);
+    ngx_http_push_stream_remove_channel_worker_sentinel_locked(channel, worker, shpool);
 }
 
 
+// references to messages left for a worker which is gone would keep them from expiring
 static void
-ngx_http_push_stream_clean_worker_data(ngx_http_push_stream_shm_data_t *data)
+ngx_http_push_stream_release_worker_messages(ngx_http_push_stream_shm_data_t *data, ngx_int_t slot)
 {
-    ngx_slab_pool_t                        *shpool = data->shpool;
-    ngx_queue_t                            *cur, *q;
-    ngx_http_push_stream_channel_t         *channel;
-    ngx_http_push_stream_worker_msg_t      *worker_msg;
+    ngx_http_push_stream_worker_data_t     *worker_data = data->ipc[slot];
+    ngx_queue_t                            *cur;
+    ngx_http_push_stream_worker_msg_t      *worker_msg, inbox_msg;
+
+    while (ngx_http_push_stream_worker_inbox_pop(worker_data, &inbox_msg) == NGX_OK) {
+        ngx_http_push_stream_release_worker_message(inbox_msg.msg);
+    }
 
-    while (!ngx_queue_empty(&data->ipc[ngx_process_slot].messages_queue)) {
-        cur = ngx_queue_head(&data->ipc[ngx_process_slot].messages_queue);
+    while (!ngx_queue_empty(&worker_data->messages_queue)) {
+        cur = ngx_queue_head(&worker_data->messages_queue);
         worker_msg = ngx_queue_data(cur, ngx_http_push_stream_worker_msg_t, queue);
-        ngx_http_push_stream_free_worker_message_memory(shpool, worker_msg);
+        ngx_http_push_stream_free_worker_message_memory(data->shpool, worker_msg);
     }
+}
 
-    ngx_queue_init(&data->ipc[ngx_process_slot].subscribers_queue);
 
-    ngx_shmtx_lock(&data->channels_queue_mutex);
-    for (q = ngx_queue_head(&data->channels_queue); q != ngx_queue_sentinel(&data->channels_queue); q = ngx_queue_next(q)) {
-        channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, queue);
-        ngx_http_push_stream_unsubscribe_worker(channel, shpool);
-    }
-    ngx_shmtx_unlock(&data->channels_queue_mutex);
+static void
+ngx_http_push_stream_clean_worker_data(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_http_push_stream_unsubscribe_worker(data, ngx_process_slot);
+    ngx_http_push_stream_release_worker_messages(data, ngx_process_slot);
 
-    data->ipc[ngx_process_slot].pid = NGX_INVALID_FILE;
-    data->ipc[ngx_process_slot].subscribers = 0;
+    ngx_queue_init(&data->ipc[ngx_process_slot]->subscribers_queue);
+
+    data->ipc[ngx_process_slot]->pid = NGX_INVALID_FILE;
+    data->ipc[ngx_process_slot]->subscribers = 0;
+}
+
+
+// the subscribers of a worker which died are discounted by the first live worker noticing it, without waiting another worker to take its slot
+static void
+ngx_http_push_stream_discount_dead_workers(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_slab_pool_t                        *global_shpool = (ngx_slab_pool_t *) ngx_http_push_stream_global_shm_zone->shm.addr;
+    ngx_pid_t                               pid;
+    int                                     i;
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        if ((i == ngx_process_slot) || (data->ipc[i] == NULL)) {
+            continue;
+        }
+
+        pid = data->ipc[i]->pid;
+        if ((pid <= 0) || (kill(pid, 0) != -1) || (ngx_errno != NGX_ESRCH)) {
+            continue;
+        }
+
+        // same lock taken by a worker starting on a slot, it may have been taken or discounted meanwhile
+        ngx_shmtx_lock(&global_shpool->mutex);
+        if (data->ipc[i]->pid == pid) {
+            ngx_http_push_stream_unsubscribe_worker(data, i);
+            ngx_http_push_stream_release_worker_messages(data, i);
+
+            data->ipc[i]->pid = NGX_INVALID_FILE;
+            data->ipc[i]->subscribers = 0;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push stream module: worker %P discounted the subscribers of the dead worker %P", ngx_pid, pid);
+        }
+        ngx_shmtx_unlock(&global_shpool->mutex);
+    }
 }
 
 
@@ -239,6 +533,13 @@ ngx_http_push_stream_register_worker_message_handler(ngx_cycle_t *cycle)
         return NGX_ERROR;
     }
 
+#if (NGX_HAVE_EVENTFD)
+    if ((ngx_http_push_stream_eventfds[ngx_process_slot] != NGX_INVALID_FILE) && (ngx_add_channel_event(cycle, ngx_http_push_stream_eventfds[ngx_process_slot], NGX_READ_EVENT, ngx_http_push_stream_eventfd_handler) == NGX_ERROR)) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno, "failed to register eventfd handler while initializing push stream module worker");
+        return NGX_ERROR;
+    }
+#endif
+
     return NGX_OK;
 }
 
@@ -278,8 +579,6 @@ ngx_http_push_stream_channel_handler(ngx_event_t *ev)
 
         if (ch.command == NGX_CMD_HTTP_PUSH_STREAM_CHECK_MESSAGES.command) {
             ngx_http_push_stream_process_worker_message();
-        } else if (ch.command == NGX_CMD_HTTP_PUSH_STREAM_CENSUS_SUBSCRIBERS.command) {
-            ngx_http_push_stream_census_worker_subscribers();
         } else if (ch.command == NGX_CMD_HTTP_PUSH_STREAM_DELETE_CHANNEL.command) {
             ngx_http_push_stream_delete_worker_channel();
         } else if (ch.command == NGX_CMD_HTTP_PUSH_STREAM_CLEANUP_SHUTTING_DOWN.command) {
@@ -289,9 +588,50 @@ ngx_http_push_stream_channel_handler(ngx_event_t *ev)
 }
 
 
+#if (NGX_HAVE_EVENTFD)
+static void
+ngx_http_push_stream_eventfd_handler(ngx_event_t *ev)
+{
+    ngx_connection_t   *c = ev->data;
+    uint64_t            signals;
+
+    if (ev->timedout) {
+        ev->timedout = 0;
+        return;
+    }
+
+    // a single read resets the counter, no matter how many times the worker was signaled
+    if ((read(c->fd, &signals, sizeof(uint64_t)) == -1) && (ngx_errno != NGX_EAGAIN)) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno, "push stream module: read() failed on eventfd");
+        if (ngx_event_flags & NGX_USE_EPOLL_EVENT) {
+            ngx_del_conn(c, 0);
+        }
+        ngx_close_connection(c);
+        return;
+    }
+
+    ngx_http_push_stream_process_worker_message();
+}
+#endif
+
+
 static ngx_int_t
 ngx_http_push_stream_alert_worker(ngx_pid_t pid, ngx_int_t slot, ngx_log_t *log, ngx_channel_t command)
 {
+#if (NGX_HAVE_EVENTFD)
+    uint64_t            signal = 1;
+
+    // check messages is the only frequent command, the other ones keep going through the socketpair
+    if ((command.command == NGX_CMD_HTTP_PUSH_STREAM_CHECK_MESSAGES.command) && (ngx_http_push_stream_eventfds[slot] != NGX_INVALID_FILE)) {
+        // EAGAIN means the counter is full, the worker was already signaled
+        if ((write(ngx_http_push_stream_eventfds[slot], &signal, sizeof(uint64_t)) == -1) && (ngx_errno != NGX_EAGAIN)) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "push stream module: write() failed on eventfd of worker process, pid: %P, slot: %d", pid, slot);
+            return NGX_ERROR;
+        }
+        return NGX_OK;
+    }
+#endif
+
     if (ngx_http_push_stream_socketpairs[slot][0] != NGX_INVALID_FILE) {
         return ngx_write_channel(ngx_http_push_stream_socketpairs[slot][0], &command, sizeof(ngx_channel_t), log);
     }
@@ -299,85 +639,52 @@ ngx_http_push_stream_alert_worker(ngx_pid_t pid, ngx_int_t slot, ngx_log_t *log,
 }
 
 
-static ngx_inline void
-ngx_http_push_stream_census_worker_subscribers(void)
+static ngx_int_t
+ngx_http_push_stream_wakeup_worker(ngx_http_push_stream_shm_data_t *data, ngx_pid_t pid, ngx_int_t slot, ngx_log_t *log)
 {
-    ngx_slab_pool_t                        *global_shpool = (ngx_slab_pool_t *) ngx_http_push_stream_global_shm_zone->shm.addr;
-    ngx_http_push_stream_global_shm_data_t *global_data = (ngx_http_push_stream_global_shm_data_t *) ngx_http_push_stream_global_shm_zone->data;
-    ngx_queue_t                            *q;
+    ngx_http_push_stream_worker_data_t     *worker_data = data->ipc[slot];
+    ngx_atomic_uint_t                       pending, due;
 
-    ngx_shmtx_lock(&global_shpool->mutex);
-    for (q = ngx_queue_head(&global_data->shm_datas_queue); q != ngx_queue_sentinel(&global_data->shm_datas_queue); q = ngx_queue_next(q)) {
-        ngx_http_push_stream_shm_data_t *data = ngx_queue_data(q, ngx_http_push_stream_shm_data_t, shm_data_queue);
-        ngx_http_push_stream_census_worker_subscribers_data(data);
+    if (ngx_http_push_stream_ipc_batch_window == 0) {
+        return ngx_http_push_stream_alert_worker_check_messages(pid, slot, log);
     }
-    ngx_shmtx_unlock(&global_shpool->mutex);
-}
 
-static ngx_inline void
-ngx_http_push_stream_census_worker_subscribers_data(ngx_http_push_stream_shm_data_t *data)
-{
-    ngx_slab_pool_t                             *shpool = data->shpool;
-    ngx_http_push_stream_worker_data_t          *thisworker_data = &data->ipc[ngx_process_slot];
-    ngx_queue_t                                 *q, *cur, *cur_worker;
-    int                                          i;
-
-
-    thisworker_data->subscribers = 0;
-
-    ngx_shmtx_lock(&data->channels_queue_mutex);
-    for (q = ngx_queue_head(&data->channels_queue); q != ngx_queue_sentinel(&data->channels_queue); q = ngx_queue_next(q)) {
-        ngx_http_push_stream_channel_t *channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, queue);
-        ngx_shmtx_lock(channel->mutex);
-        for (cur_worker = ngx_queue_head(&channel->workers_with_subscribers); cur_worker != ngx_queue_sentinel(&channel->workers_with_subscribers); cur_worker = ngx_queue_next(cur_worker)) {
-            ngx_http_push_stream_pid_queue_t *worker = ngx_queue_data(cur_worker, ngx_http_push_stream_pid_queue_t, queue);
-            if (worker->pid == ngx_pid) {
-                worker->subscribers = 0;
-            }
-        }
-        ngx_shmtx_unlock(channel->mutex);
+    // a wakeup is already scheduled to this worker for the current window,
+    // unless it is late for more than a window, when the worker who scheduled it probably died
+    pending = worker_data->wakeup_pending;
+    if ((pending != 0) && ((ngx_msec_int_t) (ngx_current_msec - pending) < (ngx_msec_int_t) ngx_http_push_stream_ipc_batch_window)) {
+        return NGX_OK;
     }
-    ngx_shmtx_unlock(&data->channels_queue_mutex);
 
-    for (q = ngx_queue_head(&thisworker_data->subscribers_queue); q != ngx_queue_sentinel(&thisworker_data->subscribers_queue); q = ngx_queue_next(q)) {
-        ngx_http_push_stream_subscriber_t *subscriber = ngx_queue_data(q, ngx_http_push_stream_subscriber_t, worker_queue);
+    due = (ngx_current_msec + ngx_http_push_stream_ipc_batch_window) | 1;
+    if (!ngx_atomic_cmp_set(&worker_data->wakeup_pending, pending, due)) {
+        // another publisher won the race and will alert the worker
+        return NGX_OK;
+    }
 
-        for (cur = ngx_queue_head(&subscriber->subscriptions); cur != ngx_queue_sentinel(&subscriber->subscriptions); cur = ngx_queue_next(cur)) {
-            ngx_http_push_stream_subscription_t *subscription = ngx_queue_data(cur, ngx_http_push_stream_subscription_t, queue);
-            subscription->channel_worker_sentinel->subscribers++;
-        }
-        thisworker_data->subscribers++;
+    ngx_http_push_stream_ipc_wakeup_pids[slot] = pid;
+    if (!ngx_http_push_stream_ipc_wakeup_event.timer_set) {
+        ngx_add_timer(&ngx_http_push_stream_ipc_wakeup_event, ngx_http_push_stream_ipc_batch_window);
     }
 
-    ngx_shmtx_lock(&shpool->mutex);
-    data->slots_for_census--;
-    ngx_shmtx_unlock(&shpool->mutex);
+    return NGX_OK;
+}
 
-    if (data->slots_for_census == 0) {
-        ngx_shmtx_lock(&shpool->mutex);
-        data->subscribers = 0;
-        for (i = 0; i < NGX_MAX_PROCESSES; i++) {
-            if (data->ipc[i].pid > 0) {
-                data->subscribers += data->ipc[i].subscribers;
-            }
-        }
-        ngx_shmtx_unlock(&shpool->mutex);
 
-        ngx_shmtx_lock(&data->channels_queue_mutex);
-        for (q = ngx_queue_head(&data->channels_queue); q != ngx_queue_sentinel(&data->channels_queue); q = ngx_queue_next(q)) {
-            ngx_http_push_stream_channel_t *channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, queue);
-            ngx_shmtx_lock(channel->mutex);
-            channel->subscribers = 0;
-            for (cur_worker = ngx_queue_head(&channel->workers_with_subscribers); cur_worker != ngx_queue_sentinel(&channel->workers_with_subscribers); cur_worker = ngx_queue_next(cur_worker)) {
-                ngx_http_push_stream_pid_queue_t *worker = ngx_queue_data(cur_worker, ngx_http_push_stream_pid_queue_t, queue);
-                channel->subscribers += worker->subscribers;
+static void
+ngx_http_push_stream_ipc_wakeup_timer_wake_handler(ngx_event_t *ev)
+{
+    ngx_pid_t           pid;
+    int                 i;
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        if ((pid = ngx_http_push_stream_ipc_wakeup_pids[i]) > 0) {
+            ngx_http_push_stream_ipc_wakeup_pids[i] = 0;
+            if (ngx_http_push_stream_alert_worker_check_messages(pid, i, ev->log) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, ev->log, 0, "push stream module: error communicating with worker process, pid: %P, slot: %d", pid, i);
             }
-            ngx_shmtx_unlock(channel->mutex);
         }
-        ngx_shmtx_unlock(&data->channels_queue_mutex);
     }
-
-
 }
 
 
@@ -397,39 +704,98 @@ ngx_http_push_stream_process_worker_message(void)
 static ngx_inline void
 ngx_http_push_stream_process_worker_message_data(ngx_http_push_stream_shm_data_t *data)
 {
-    ngx_http_push_stream_worker_msg_t      *worker_msg;
-    ngx_queue_t                            *cur, *q;
+    ngx_http_push_stream_worker_msg_t      *worker_msg, batch[NGX_HTTP_PUSH_STREAM_WORKER_MESSAGES_BATCH_SIZE];
+    ngx_queue_t                            *cur;
     ngx_slab_pool_t                        *shpool = data->shpool;
-    ngx_http_push_stream_worker_data_t     *thisworker_data = data->ipc + ngx_process_slot;
+    ngx_http_push_stream_worker_data_t     *thisworker_data = data->ipc[ngx_process_slot];
+    ngx_atomic_uint_t                       pending;
+    ngx_uint_t                              qtd = 0;
 
+    // cleared with a locked operation, a publisher still seeing the wakeup as pending pushed its message before the inbox is read
+    while (((pending = thisworker_data->wakeup_pending) != 0) && !ngx_atomic_cmp_set(&thisworker_data->wakeup_pending, pending, 0)) { /* void */ }
 
+    // messages on the inbox are older than the ones queued while it was full
+    while (ngx_http_push_stream_worker_inbox_pop(thisworker_data, &batch[qtd]) == NGX_OK) {
+        qtd = ngx_http_push_stream_batch_worker_message(data, batch, qtd + 1);
+    }
+
+    // messages pushed to the inbox from now on alert this worker again, since it was found empty
     while (!ngx_queue_empty(&thisworker_data->messages_queue)) {
         cur = ngx_queue_head(&thisworker_data->messages_queue);
         worker_msg = ngx_queue_data(cur, ngx_http_push_stream_worker_msg_t, queue);
-        if (worker_msg->pid == ngx_pid) {
-            // everything is okay
-            ngx_http_push_stream_respond_to_subscribers(worker_msg->channel, worker_msg->subscriptions_sentinel, worker_msg->msg);
-        } else {
-            // that's quite bad you see. a previous worker died with an undelivered message.
-            // but all its subscribers' connections presumably got canned, too. so it's not so bad after all.
-
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: worker %i intercepted a message intended for another worker process (%i) that probably died and will remove the reference to the old worker", ngx_pid, worker_msg->pid);
-
-            // delete that invalid sucker
-            ngx_shmtx_lock(worker_msg->channel->mutex);
-            for (q = ngx_queue_head(&worker_msg->channel->workers_with_subscribers); q != ngx_queue_sentinel(&worker_msg->channel->workers_with_subscribers); q = ngx_queue_next(q)) {
-                ngx_http_push_stream_pid_queue_t *worker = ngx_queue_data(q, ngx_http_push_stream_pid_queue_t, queue);
-                if (worker->pid == worker_msg->pid) {
-                    ngx_queue_remove(&worker->queue);
-                    ngx_slab_free(shpool, worker);
-                    break;
-                }
-            }
-            ngx_shmtx_unlock(worker_msg->channel->mutex);
+        batch[qtd] = *worker_msg;
+
+        // the reference to the message is kept on the batch
+        ngx_shmtx_lock(&shpool->mutex);
+        ngx_queue_remove(&worker_msg->queue);
+        ngx_slab_free_locked(shpool, worker_msg);
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        qtd = ngx_http_push_stream_batch_worker_message(data, batch, qtd + 1);
+    }
+
+    ngx_http_push_stream_deliver_worker_messages(data, batch, qtd);
+}
+
+
+static ngx_uint_t
+ngx_http_push_stream_batch_worker_message(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_worker_msg_t *batch, ngx_uint_t qtd)
+{
+    ngx_http_push_stream_worker_msg_t      *worker_msg = batch + qtd - 1;
+
+    // consecutive messages to the same subscribers are sent together, keeping the order between channels
+    if ((qtd > 1) && ((worker_msg->channel != batch->channel) || (worker_msg->subscriptions_sentinel != batch->subscriptions_sentinel) || (worker_msg->pid != batch->pid))) {
+        ngx_http_push_stream_deliver_worker_messages(data, batch, qtd - 1);
+        *batch = *worker_msg;
+        return 1;
+    }
+
+    if (qtd == NGX_HTTP_PUSH_STREAM_WORKER_MESSAGES_BATCH_SIZE) {
+        ngx_http_push_stream_deliver_worker_messages(data, batch, qtd);
+        return 0;
+    }
+
+    return qtd;
+}
+
+
+static void
+ngx_http_push_stream_deliver_worker_messages(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_worker_msg_t *batch, ngx_uint_t qtd)
+{
+    ngx_http_push_stream_msg_t             *msgs[NGX_HTTP_PUSH_STREAM_WORKER_MESSAGES_BATCH_SIZE];
+    ngx_http_push_stream_pid_queue_t       *worker;
+    ngx_uint_t                              i;
+
+    if (qtd == 0) {
+        return;
+    }
+
+    if (batch->pid == ngx_pid) {
+        // everything is okay
+        for (i = 0; i < qtd; i++) {
+            msgs[i] = batch[i].msg;
+        }
+        ngx_http_push_stream_respond_to_subscribers(batch->channel, batch->subscriptions_sentinel, msgs, qtd);
+    } else {
+        // that's quite bad you see. a previous worker died with an undelivered message.
+        // but all its subscribers' connections presumably got canned, too. so it's not so bad after all.
+
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: worker %i intercepted a message intended for another worker process (%i) that probably died and will remove the reference to the old worker", ngx_pid, batch->pid);
+
+        // delete that invalid sucker, it had the slot of this worker
+        ngx_http_push_stream_lock_channel(batch->channel);
+        if (((worker = ngx_http_push_stream_channel_worker_sentinel(batch->channel, ngx_process_slot)) != NULL) && (worker->pid == batch->pid)) {
+            ngx_http_push_stream_discount_dead_worker_locked(data->shpool, batch->channel, worker);
         }
+        ngx_http_push_stream_unlock_channel(batch->channel);
 
-        // free worker_msg already sent
-        ngx_http_push_stream_free_worker_message_memory(shpool, worker_msg);
+        if (batch->channel->subscribers == 0) {
+            ngx_http_push_stream_schedule_channel_expiry(data, batch->channel, batch->channel->expires);
+        }
+    }
+
+    for (i = 0; i < qtd; i++) {
+        ngx_http_push_stream_release_worker_message(batch[i].msg);
     }
 }
 
@@ -438,23 +804,37 @@ static ngx_int_t
 ngx_http_push_stream_send_worker_message(ngx_http_push_stream_channel_t *channel, ngx_queue_t *subscriptions_sentinel, ngx_pid_t pid, ngx_int_t worker_slot, ngx_http_push_stream_msg_t *msg, ngx_flag_t *queue_was_empty, ngx_log_t *log, ngx_http_push_stream_main_conf_t *mcf)
 {
     ngx_slab_pool_t                         *shpool = mcf->shpool;
-    ngx_http_push_stream_worker_data_t      *thisworker_data = mcf->shm_data->ipc + worker_slot;
-    ngx_http_push_stream_worker_msg_t       *newmessage;
+    ngx_http_push_stream_worker_data_t      *thisworker_data = mcf->shm_data->ipc[worker_slot];
+    ngx_http_push_stream_worker_msg_t       *newmessage, inbox_msg;
+
+    ngx_atomic_fetch_add(&msg->workers_ref_count, 1);
+
+    // while there are queued messages the new ones go to the queue too, to be delivered in order
+    if ((thisworker_data->inbox != NULL) && ngx_queue_empty(&thisworker_data->messages_queue)) {
+        inbox_msg.msg = msg;
+        inbox_msg.pid = pid;
+        inbox_msg.subscriptions_sentinel = subscriptions_sentinel;
+        inbox_msg.channel = channel;
+        inbox_msg.mcf = mcf;
+        if (ngx_http_push_stream_worker_inbox_push(thisworker_data, &inbox_msg, queue_was_empty) == NGX_OK) {
+            return NGX_OK;
+        }
+    }
 
     ngx_shmtx_lock(&shpool->mutex);
     if ((newmessage = ngx_slab_alloc_locked(shpool, sizeof(ngx_http_push_stream_worker_msg_t))) == NULL) {
         ngx_shmtx_unlock(&shpool->mutex);
+        ngx_http_push_stream_release_worker_message(msg);
         ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to allocate worker message, pid: %P, slot: %d", pid, worker_slot);
         return NGX_ERROR;
     }
 
-    msg->workers_ref_count++;
     newmessage->msg = msg;
     newmessage->pid = pid;
     newmessage->subscriptions_sentinel = subscriptions_sentinel;
     newmessage->channel = channel;
     newmessage->mcf = mcf;
-    *queue_was_empty = ngx_queue_empty(&thisworker_data->messages_queue);
+    *queue_was_empty = ngx_queue_empty(&thisworker_data->messages_queue) && (thisworker_data->inbox_head == thisworker_data->inbox_tail);
     ngx_queue_insert_tail(&thisworker_data->messages_queue, &newmessage->queue);
     ngx_shmtx_unlock(&shpool->mutex);
 
@@ -471,28 +851,24 @@ ngx_http_push_stream_broadcast(ngx_http_push_stream_channel_t *channel, ngx_http
     ngx_queue_t                             *q;
     ngx_flag_t                               queue_was_empty[NGX_MAX_PROCESSES];
 
-    ngx_shmtx_lock(channel->mutex);
+    ngx_http_push_stream_lock_channel(channel);
     for (q = ngx_queue_head(&channel->workers_with_subscribers); q != ngx_queue_sentinel(&channel->workers_with_subscribers); q = ngx_queue_next(q)) {
         worker = ngx_queue_data(q, ngx_http_push_stream_pid_queue_t, queue);
         ngx_http_push_stream_send_worker_message(channel, &worker->subscriptions, worker->pid, worker->slot, msg, &queue_was_empty[worker->slot], log, mcf);
     }
-    ngx_shmtx_unlock(channel->mutex);
+    ngx_http_push_stream_unlock_channel(channel);
 
     for (q = ngx_queue_head(&channel->workers_with_subscribers); q != ngx_queue_sentinel(&channel->workers_with_subscribers); q = ngx_queue_next(q)) {
         worker = ngx_queue_data(q, ngx_http_push_stream_pid_queue_t, queue);
         // interprocess communication breakdown
-        if (queue_was_empty[worker->slot] && (ngx_http_push_stream_alert_worker_check_messages(worker->pid, worker->slot, log) != NGX_OK)) {
+        if (queue_was_empty[worker->slot] && (ngx_http_push_stream_wakeup_worker(mcf->shm_data, worker->pid, worker->slot, log) != NGX_OK)) {
             ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: error communicating with worker process, pid: %P, slot: %d", worker->pid, worker->slot);
         }
     }
-
-    if (ngx_queue_empty(&msg->queue)) {
-        ngx_http_push_stream_throw_the_message_away(msg, mcf->shm_data);
-    }
 }
 
 static ngx_int_t
-ngx_http_push_stream_respond_to_subscribers(ngx_http_push_stream_channel_t *channel, ngx_queue_t *subscriptions, ngx_http_push_stream_msg_t *msg)
+ngx_http_push_stream_respond_to_subscribers(ngx_http_push_stream_channel_t *channel, ngx_queue_t *subscriptions, ngx_http_push_stream_msg_t **msgs, ngx_uint_t qtd)
 {
     ngx_queue_t      *q;
 
@@ -500,7 +876,7 @@ ngx_http_push_stream_respond_to_subscribers(ngx_http_push_stream_channel_t *chan
         return NGX_ERROR;
     }
 
-    if (msg != NULL) {
+    if (qtd > 0) {
 
         // now let's respond to some requests!
         for (q = ngx_queue_head(subscriptions); q != ngx_queue_sentinel(subscriptions);) {
@@ -508,14 +884,16 @@ ngx_http_push_stream_respond_to_subscribers(ngx_http_push_stream_channel_t *chan
             q = ngx_queue_next(q);
             ngx_http_push_stream_subscriber_t *subscriber = subscription->subscriber;
             if (subscriber->longpolling) {
-                ngx_http_push_stream_add_polling_headers(subscriber->request, msg->time, msg->tag, subscriber->request->pool);
+                // the request is finished with the first message, the others are taken on the next request
+                ngx_http_push_stream_add_polling_headers(subscriber->request, msgs[0]->time, msgs[0]->tag, subscriber->request->pool);
                 ngx_http_send_header(subscriber->request);
 
                 ngx_http_push_stream_send_response_content_header(subscriber->request, ngx_http_get_module_loc_conf(subscriber->request, ngx_http_push_stream_module));
-                ngx_http_push_stream_send_response_message(subscriber->request, channel, msg, 1, 0);
+                ngx_http_push_stream_send_response_message(subscriber->request, channel, msgs[0], 1, 0);
                 ngx_http_push_stream_send_response_finalize(subscriber->request);
             } else {
-                if (ngx_http_push_stream_send_response_message(subscriber->request, channel, msg, 0, 0) != NGX_OK) {
+                // all messages of the batch on a single chain, written at once
+                if (ngx_http_push_stream_send_response_messages(subscriber->request, channel, msgs, qtd, 0, 0) != NGX_OK) {
                     ngx_http_push_stream_send_response_finalize(subscriber->request);
                 } else {
                     ngx_http_push_stream_module_ctx_t     *ctx = ngx_http_get_module_ctx(subscriber->request, ngx_http_push_stream_module);
@@ -27,6 +27,29 @@
 
 ngx_uint_t ngx_http_push_stream_padding_max_len = 0;
 ngx_flag_t ngx_http_push_stream_enabled = 0;
+ngx_msec_t ngx_http_push_stream_ipc_batch_window = 0;
+ngx_uint_t ngx_http_push_stream_ipc_signal = NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_SOCKETPAIR;
+ngx_http_push_stream_time_cache_t ngx_http_push_stream_time_cache[NGX_HTTP_PUSH_STREAM_TIME_CACHE_SIZE]; // recent seconds formatted, by the second
+#if (NGX_HTTP_PUSH_STREAM_HAVE_SSE2)
+ngx_http_push_stream_unmask_pt ngx_http_push_stream_unmask_ascii = ngx_http_push_stream_unmask_ascii_sse2; // replaced by the widest one supported by the CPU
+#else
+ngx_http_push_stream_unmask_pt ngx_http_push_stream_unmask_ascii = ngx_http_push_stream_unmask_ascii_word;
+#endif
+#if (NGX_DEBUG)
+ngx_uint_t ngx_http_push_stream_channel_locks_held = 0; // channel mutexes held by this process, nothing is written to a subscriber while holding one
+#endif
+
+static ngx_conf_enum_t  ngx_http_push_stream_channel_index_types[] = {
+    { ngx_string("rbtree"), NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_RBTREE },
+    { ngx_string("hash"), NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_HASH },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_push_stream_ipc_signal_types[] = {
+    { ngx_string("socketpair"), NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_SOCKETPAIR },
+    { ngx_string("eventfd"), NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_EVENTFD },
+    { ngx_null_string, 0 }
+};
 
 static ngx_command_t    ngx_http_push_stream_commands[] = {
     { ngx_string("push_stream_channels_statistics"),
@@ -127,6 +150,36 @@ static ngx_command_t    ngx_http_push_stream_commands[] = {
         NGX_HTTP_MAIN_CONF_OFFSET,
         offsetof(ngx_http_push_stream_main_conf_t, events_channel_id),
         NULL },
+    { ngx_string("push_stream_channel_index"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_push_stream_main_conf_t, channel_index),
+        &ngx_http_push_stream_channel_index_types },
+    { ngx_string("push_stream_channel_mutexes"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_push_stream_main_conf_t, channel_mutexes),
+        NULL },
+    { ngx_string("push_stream_ipc_batch_window"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_push_stream_main_conf_t, ipc_batch_window),
+        NULL },
+    { ngx_string("push_stream_ipc_signal"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_enum_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_push_stream_main_conf_t, ipc_signal),
+        &ngx_http_push_stream_ipc_signal_types },
+    { ngx_string("push_stream_cleanup_budget"),
+        NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_push_stream_main_conf_t, cleanup_budget),
+        NULL },
 
     /* Location directives */
     { ngx_string("push_stream_channels_path"),
@@ -207,6 +260,12 @@ static ngx_command_t    ngx_http_push_stream_commands[] = {
         NGX_HTTP_LOC_CONF_OFFSET,
         offsetof(ngx_http_push_stream_loc_conf_t, websocket_allow_publish),
         NULL },
+    { ngx_string("push_stream_websocket_max_message_size"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_push_stream_loc_conf_t, websocket_max_message_size),
+        NULL },
     { ngx_string("push_stream_last_received_message_time"),
         NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_HTTP_LIF_CONF|NGX_CONF_TAKE1,
         ngx_http_set_complex_value_slot,
@@ -292,6 +351,8 @@ ngx_http_push_stream_init_module(ngx_cycle_t *cycle)
         return NGX_OK;
     }
 
+    ngx_http_push_stream_select_unmask_implementation(cycle->log);
+
     // initialize our little IPC
     ngx_int_t rc;
     if ((rc = ngx_http_push_stream_init_ipc(cycle, ccf->worker_processes)) == NGX_OK) {
@@ -464,6 +525,11 @@ ngx_http_push_stream_create_main_conf(ngx_conf_t *cf)
     mcf->qtd_templates = 0;
     mcf->timeout_with_body = NGX_CONF_UNSET;
     ngx_str_null(&mcf->events_channel_id);
+    mcf->channel_index = NGX_CONF_UNSET_UINT;
+    mcf->channel_mutexes = NGX_CONF_UNSET_UINT;
+    mcf->ipc_batch_window = NGX_CONF_UNSET_MSEC;
+    mcf->ipc_signal = NGX_CONF_UNSET_UINT;
+    mcf->cleanup_budget = NGX_CONF_UNSET_UINT;
     mcf->ping_msg = NULL;
     mcf->longpooling_timeout_msg = NULL;
     ngx_queue_init(&mcf->msg_templates);
@@ -488,6 +554,11 @@ ngx_http_push_stream_init_main_conf(ngx_conf_t *cf, void *parent)
     ngx_conf_merge_str_value(conf->wildcard_channel_prefix, conf->wildcard_channel_prefix, NGX_HTTP_PUSH_STREAM_DEFAULT_WILDCARD_CHANNEL_PREFIX);
     ngx_conf_merge_str_value(conf->events_channel_id, conf->events_channel_id, NGX_HTTP_PUSH_STREAM_DEFAULT_EVENTS_CHANNEL_ID);
     ngx_conf_init_value(conf->timeout_with_body, 0);
+    ngx_conf_init_uint_value(conf->channel_index, NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_RBTREE);
+    ngx_conf_init_uint_value(conf->channel_mutexes, NGX_HTTP_PUSH_STREAM_DEFAULT_CHANNEL_MUTEXES);
+    ngx_conf_init_msec_value(conf->ipc_batch_window, NGX_HTTP_PUSH_STREAM_DEFAULT_IPC_BATCH_WINDOW);
+    ngx_conf_init_uint_value(conf->ipc_signal, NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_SOCKETPAIR);
+    ngx_conf_init_uint_value(conf->cleanup_budget, NGX_HTTP_PUSH_STREAM_DEFAULT_CLEANUP_BUDGET);
 
     // sanity checks
     // shm size should be set
@@ -496,6 +567,20 @@ ngx_http_push_stream_init_main_conf(ngx_conf_t *cf, void *parent)
         return NGX_CONF_ERROR;
     }
 
+    // number of channel mutexes cannot be zero
+    if (conf->channel_mutexes == 0) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "push stream module: push_stream_channel_mutexes cannot be zero.");
+        return NGX_CONF_ERROR;
+    }
+
+#if !(NGX_HAVE_EVENTFD)
+    // eventfd is only available on linux
+    if (conf->ipc_signal == NGX_HTTP_PUSH_STREAM_IPC_SIGNAL_EVENTFD) {
+        ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "push stream module: push_stream_ipc_signal eventfd is not supported on this platform.");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
     // max number of channels cannot be zero
     if ((conf->max_number_of_channels != NGX_CONF_UNSET_UINT) && (conf->max_number_of_channels == 0)) {
         ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "push stream module: push_stream_max_number_of_channels cannot be zero.");
@@ -552,6 +637,10 @@ ngx_http_push_stream_init_main_conf(ngx_conf_t *cf, void *parent)
 
     conf->backtrack_parser_regex = backtrack_parser->regex;
 
+    // the workers are alerted the same way for all zones
+    ngx_http_push_stream_ipc_batch_window = conf->ipc_batch_window;
+    ngx_http_push_stream_ipc_signal = conf->ipc_signal;
+
     return NGX_CONF_OK;
 }
 
@@ -570,6 +659,7 @@ ngx_http_push_stream_create_loc_conf(ngx_conf_t *cf)
     lcf->authorized_channels_only = NGX_CONF_UNSET_UINT;
     lcf->store_messages = NGX_CONF_UNSET_UINT;
     lcf->message_template_index = -1;
+    lcf->message_template_parsed = NULL;
     ngx_str_null(&lcf->message_template);
     ngx_str_null(&lcf->header_template);
     ngx_str_null(&lcf->footer_template);
@@ -579,6 +669,7 @@ ngx_http_push_stream_create_loc_conf(ngx_conf_t *cf)
     lcf->subscriber_connection_ttl = NGX_CONF_UNSET_MSEC;
     lcf->longpolling_connection_ttl = NGX_CONF_UNSET_MSEC;
     lcf->websocket_allow_publish = NGX_CONF_UNSET_UINT;
+    lcf->websocket_max_message_size = NGX_CONF_UNSET_SIZE;
     lcf->channel_info_on_publish = NGX_CONF_UNSET_UINT;
     lcf->allow_connections_to_events_channel = NGX_CONF_UNSET_UINT;
     lcf->last_received_message_time = NULL;
@@ -609,6 +700,7 @@ ngx_http_push_stream_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->subscriber_connection_ttl, prev->subscriber_connection_ttl, NGX_CONF_UNSET_MSEC);
     ngx_conf_merge_msec_value(conf->longpolling_connection_ttl, prev->longpolling_connection_ttl, conf->subscriber_connection_ttl);
     ngx_conf_merge_value(conf->websocket_allow_publish, prev->websocket_allow_publish, 0);
+    ngx_conf_merge_size_value(conf->websocket_max_message_size, prev->websocket_max_message_size, NGX_HTTP_PUSH_STREAM_DEFAULT_WEBSOCKET_MAX_MESSAGE_SIZE);
     ngx_conf_merge_value(conf->channel_info_on_publish, prev->channel_info_on_publish, 1);
     ngx_conf_merge_value(conf->allow_connections_to_events_channel, prev->allow_connections_to_events_channel, 0);
     ngx_conf_merge_str_value(conf->padding_by_user_agent, prev->padding_by_user_agent, NGX_HTTP_PUSH_STREAM_DEFAULT_PADDING_BY_USER_AGENT);
@@ -770,6 +862,8 @@ ngx_http_push_stream_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
             return NGX_CONF_ERROR;
         }
 
+        conf->message_template_parsed = ngx_http_push_stream_get_template_by_index(mcf, conf->message_template_index);
+
 
         if (conf->padding_by_user_agent.len > 0) {
             if ((conf->paddings = ngx_http_push_stream_parse_paddings(cf, &conf->padding_by_user_agent)) == NULL) {
@@ -1051,6 +1145,14 @@ ngx_http_push_stream_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
         d->shm_zone = shm_zone;
         d->shpool = mcf->shpool;
         mcf->shm_data = data;
+        if (d->channel_index != mcf->channel_index) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push stream module: cannot change push_stream_channel_index without restart, ignoring change on zone: %V", &shm_zone->shm.name);
+        }
+        if (d->channels_mutexes != mcf->channel_mutexes) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push stream module: cannot change push_stream_channel_mutexes without restart, ignoring change on zone: %V", &shm_zone->shm.name);
+        }
+        // the subscribers counters are kept, the subscribers of the old workers still decrement them
+        d->qtd_templates = ngx_min(mcf->qtd_templates, NGX_HTTP_PUSH_STREAM_MAX_COUNTED_TEMPLATES);
         ngx_queue_insert_tail(&global_shm_data->shm_datas_queue, &d->shm_data_queue);
         return NGX_OK;
     }
@@ -1064,27 +1166,24 @@ ngx_http_push_stream_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
     mcf->shm_data = d;
     shm_zone->data = d;
     for (i = 0; i < NGX_MAX_PROCESSES; i++) {
-        d->ipc[i].pid = -1;
-        d->ipc[i].startup = 0;
-        d->ipc[i].subscribers = 0;
-        ngx_queue_init(&d->ipc[i].messages_queue);
-        ngx_queue_init(&d->ipc[i].subscribers_queue);
+        d->ipc[i] = NULL;
     }
 
     d->channels = 0;
     d->wildcard_channels = 0;
-    d->published_messages = 0;
-    d->stored_messages = 0;
-    d->subscribers = 0;
     d->channels_in_delete = 0;
     d->channels_in_trash = 0;
     d->messages_in_trash = 0;
     d->startup = ngx_time();
+#if (NGX_PTR_SIZE == 8)
+    d->last_message_sequence = 0;
+#else
+    d->last_message_lock = 0;
     d->last_message_time = 0;
     d->last_message_tag = 0;
+#endif
     d->shm_zone = shm_zone;
     d->shpool = mcf->shpool;
-    d->slots_for_census = 0;
     d->events_channel = NULL;
 
     // initialize rbtree
@@ -1093,10 +1192,31 @@ ngx_http_push_stream_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
     }
     ngx_rbtree_init(&d->tree, sentinel, ngx_http_push_stream_rbtree_insert);
 
+    // initialize channels hash, when used
+    d->channel_index = mcf->channel_index;
+    d->channels_index_version = 0;
+    ngx_memzero(&d->channels_hash, sizeof(ngx_http_push_stream_channel_hash_t));
+    if ((d->channel_index == NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_HASH) && (ngx_http_push_stream_channel_hash_init(&d->channels_hash, mcf->shpool) != NGX_OK)) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(d->template_subscribers, sizeof(d->template_subscribers));
+    d->qtd_templates = ngx_min(mcf->qtd_templates, NGX_HTTP_PUSH_STREAM_MAX_COUNTED_TEMPLATES);
+
     ngx_queue_init(&d->messages_trash);
     ngx_queue_init(&d->channels_queue);
     ngx_queue_init(&d->channels_to_delete);
     ngx_queue_init(&d->channels_trash);
+    ngx_queue_init(&d->expired_channels);
+
+    if ((d->expiry_wheel = ngx_slab_alloc(mcf->shpool, NGX_HTTP_PUSH_STREAM_EXPIRY_WHEEL_SIZE * sizeof(ngx_queue_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: unable to allocate memory for channels expiry wheel");
+        return NGX_ERROR;
+    }
+    for (i = 0; i < NGX_HTTP_PUSH_STREAM_EXPIRY_WHEEL_SIZE; i++) {
+        ngx_queue_init(&d->expiry_wheel[i]);
+    }
+    d->expiry_wheel_time = ngx_time();
 
     ngx_queue_insert_tail(&global_shm_data->shm_datas_queue, &d->shm_data_queue);
 
@@ -1120,23 +1240,32 @@ ngx_http_push_stream_init_shm_zone(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_ERROR;
     }
 
-    u_char lock_name[25];
-    for (i = 0; i < 10; i++) {
+    if (ngx_http_push_stream_create_shmtx(&d->expiry_wheel_mutex, &d->expiry_wheel_lock, (u_char *) "push_stream_expiry_wheel") != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    // channels are mapped to one of these mutexes by the hash of their id
+    if ((d->channels_mutex = ngx_slab_alloc(mcf->shpool, mcf->channel_mutexes * sizeof(ngx_http_push_stream_channel_mutex_t))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: unable to allocate memory for %ui channel mutexes", mcf->channel_mutexes);
+        return NGX_ERROR;
+    }
+    d->channels_mutexes = mcf->channel_mutexes;
+
+    u_char lock_name[sizeof("push_stream_channels_") + NGX_INT_T_LEN];
+    for (i = 0; (ngx_uint_t) i < d->channels_mutexes; i++) {
         ngx_sprintf(lock_name, "push_stream_channels_%d%Z", i);
-        if (ngx_http_push_stream_create_shmtx(&d->channels_mutex[i], &d->channels_lock[i], lock_name) != NGX_OK) {
+        if (ngx_http_push_stream_create_channel_mutex(&d->channels_mutex[i], lock_name) != NGX_OK) {
             return NGX_ERROR;
         }
     }
 
-    d->mutex_round_robin = 0;
-
     if (mcf->events_channel_id.len > 0) {
         if ((d->events_channel = ngx_http_push_stream_get_channel(&mcf->events_channel_id, ngx_cycle->log, mcf)) == NULL) {
             ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: unable to create events channel");
             return NGX_ERROR;
         }
 
-        if (ngx_http_push_stream_create_shmtx(&d->events_channel_mutex, &d->events_channel_lock, (u_char *) "push_stream_events_channel") != NGX_OK) {
+        if (ngx_http_push_stream_create_channel_mutex(&d->events_channel_mutex, (u_char *) "push_stream_events_channel") != NGX_OK) {
             return NGX_ERROR;
         }
 
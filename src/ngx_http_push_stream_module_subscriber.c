@@ -28,9 +28,12 @@
 static ngx_int_t                                 ngx_http_push_stream_subscriber_assign_channel(ngx_http_push_stream_main_conf_t *mcf, ngx_http_push_stream_loc_conf_t *cf, ngx_http_request_t *r, ngx_http_push_stream_requested_channel_t *requested_channel, time_t if_modified_since, ngx_int_t tag, ngx_str_t *last_event_id, ngx_http_push_stream_subscriber_t *subscriber, ngx_pool_t *temp_pool);
 static ngx_http_push_stream_subscriber_t        *ngx_http_push_stream_subscriber_prepare_request_to_keep_connected(ngx_http_request_t *r);
 static ngx_int_t                                 ngx_http_push_stream_registry_subscriber(ngx_http_request_t *r, ngx_http_push_stream_subscriber_t *worker_subscriber);
-static ngx_flag_t                                ngx_http_push_stream_has_old_messages_to_send(ngx_http_push_stream_channel_t *channel, ngx_uint_t backtrack, time_t if_modified_since, ngx_int_t tag, time_t greater_message_time, ngx_int_t greater_message_tag, ngx_str_t *last_event_id);
-static void                                      ngx_http_push_stream_send_old_messages(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_uint_t backtrack, time_t if_modified_since, ngx_int_t tag, time_t greater_message_time, ngx_int_t greater_message_tag, ngx_str_t *last_event_id);
-static ngx_http_push_stream_pid_queue_t         *ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(ngx_slab_pool_t *shpool, ngx_http_push_stream_channel_t *channel, ngx_log_t *log);
+static ngx_uint_t                                ngx_http_push_stream_get_first_old_message_index(ngx_http_push_stream_channel_t *channel, time_t if_modified_since, ngx_int_t tag, ngx_str_t *last_event_id);
+static ngx_int_t                                 ngx_http_push_stream_collect_old_messages(ngx_http_push_stream_requested_channel_t *requested_channel, time_t if_modified_since, ngx_int_t tag, ngx_str_t *last_event_id, ngx_pool_t *temp_pool);
+static void                                      ngx_http_push_stream_send_old_messages(ngx_http_request_t *r, ngx_http_push_stream_requested_channel_t *requested_channel, time_t greater_message_time, ngx_int_t greater_message_tag);
+static void                                      ngx_http_push_stream_release_old_messages(ngx_http_push_stream_requested_channel_t *requested_channel);
+static void                                      ngx_http_push_stream_release_requested_channels_old_messages(ngx_http_push_stream_requested_channel_t *requested_channels);
+static ngx_http_push_stream_pid_queue_t         *ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_log_t *log);
 static ngx_http_push_stream_subscription_t      *ngx_http_push_stream_create_channel_subscription(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_subscriber_t *subscriber);
 static ngx_int_t                                 ngx_http_push_stream_assing_subscription_to_channel(ngx_slab_pool_t *shpool, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_subscription_t *subscription, ngx_queue_t *subscriptions, ngx_log_t *log);
 static ngx_int_t                                 ngx_http_push_stream_subscriber_polling_handler(ngx_http_request_t *r, ngx_http_push_stream_requested_channel_t *channels_ids, time_t if_modified_since, ngx_int_t tag, ngx_str_t *last_event_id, ngx_flag_t longpolling, ngx_pool_t *temp_pool);
@@ -179,14 +182,20 @@ ngx_http_push_stream_subscriber_polling_handler(ngx_http_request_t *r, ngx_http_
     for (q = ngx_queue_head(&requested_channels->queue); q != ngx_queue_sentinel(&requested_channels->queue); q = ngx_queue_next(q)) {
         requested_channel = ngx_queue_data(q, ngx_http_push_stream_requested_channel_t, queue);
 
-        if (ngx_http_push_stream_has_old_messages_to_send(requested_channel->channel, requested_channel->backtrack_messages, if_modified_since, tag, greater_message_time, greater_message_tag, last_event_id)) {
+        if (ngx_http_push_stream_collect_old_messages(requested_channel, if_modified_since, tag, last_event_id, temp_pool) != NGX_OK) {
+            ngx_http_push_stream_release_requested_channels_old_messages(requested_channels);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (requested_channel->qtd_old_messages > 0) {
             has_message_to_send = 1;
-            if (requested_channel->channel->last_message_time > greater_message_time) {
-                greater_message_time = requested_channel->channel->last_message_time;
-                greater_message_tag = requested_channel->channel->last_message_tag;
+            // a message published after the snapshot is not sent now, the polling headers must not skip it on the next request
+            if (requested_channel->last_message_time > greater_message_time) {
+                greater_message_time = requested_channel->last_message_time;
+                greater_message_tag = requested_channel->last_message_tag;
             } else {
-                if ((requested_channel->channel->last_message_time == greater_message_time) && (requested_channel->channel->last_message_tag > greater_message_tag) ) {
-                    greater_message_tag = requested_channel->channel->last_message_tag;
+                if ((requested_channel->last_message_time == greater_message_time) && (requested_channel->last_message_tag > greater_message_tag) ) {
+                    greater_message_tag = requested_channel->last_message_tag;
                 }
             }
         }
@@ -235,6 +244,7 @@ ngx_http_push_stream_subscriber_polling_handler(ngx_http_request_t *r, ngx_http_
 
     // sending response content header
     if (ngx_http_push_stream_send_response_content_header(r, cf) == NGX_ERROR) {
+        ngx_http_push_stream_release_requested_channels_old_messages(requested_channels);
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: could not send content header to subscriber");
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
@@ -246,7 +256,7 @@ ngx_http_push_stream_subscriber_polling_handler(ngx_http_request_t *r, ngx_http_
 
     for (q = ngx_queue_head(&requested_channels->queue); q != ngx_queue_sentinel(&requested_channels->queue); q = ngx_queue_next(q)) {
         requested_channel = ngx_queue_data(q, ngx_http_push_stream_requested_channel_t, queue);
-        ngx_http_push_stream_send_old_messages(r, requested_channel->channel, requested_channel->backtrack_messages, if_modified_since, tag, greater_message_time, greater_message_tag, last_event_id);
+        ngx_http_push_stream_send_old_messages(r, requested_channel, greater_message_time, greater_message_tag);
     }
 
     if (ctx->callback != NULL) {
@@ -273,7 +283,10 @@ ngx_http_push_stream_subscriber_assign_channel(ngx_http_push_stream_main_conf_t
     }
 
     // send old messages to new subscriber
-    ngx_http_push_stream_send_old_messages(r, requested_channel->channel, requested_channel->backtrack_messages, if_modified_since, tag, 0, -1, last_event_id);
+    if (ngx_http_push_stream_collect_old_messages(requested_channel, if_modified_since, tag, last_event_id, temp_pool) != NGX_OK) {
+        return NGX_ERROR;
+    }
+    ngx_http_push_stream_send_old_messages(r, requested_channel, 0, -1);
 
     return ngx_http_push_stream_assing_subscription_to_channel(shpool, requested_channel->channel, subscription, &subscriber->subscriptions, r->connection->log);
 }
@@ -390,6 +403,7 @@ ngx_http_push_stream_subscriber_prepare_request_to_keep_connected(ngx_http_reque
     worker_subscriber->longpolling = 0;
     worker_subscriber->request = r;
     worker_subscriber->worker_subscribed_pid = ngx_pid;
+    worker_subscriber->template_subscribers = NULL;
     ngx_queue_init(&worker_subscriber->worker_queue);
     ngx_queue_init(&worker_subscriber->subscriptions);
     ctx->subscriber = worker_subscriber;
@@ -420,10 +434,9 @@ ngx_http_push_stream_registry_subscriber(ngx_http_request_t *r, ngx_http_push_st
     ngx_http_push_stream_main_conf_t               *mcf = ngx_http_get_module_main_conf(r, ngx_http_push_stream_module);
     ngx_http_push_stream_loc_conf_t                *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_stream_module);
     ngx_http_push_stream_shm_data_t                *data = mcf->shm_data;
-    ngx_http_push_stream_worker_data_t             *thisworker_data = &data->ipc[ngx_process_slot];
+    ngx_http_push_stream_worker_data_t             *thisworker_data = data->ipc[ngx_process_slot];
     ngx_msec_t                                      connection_ttl = worker_subscriber->longpolling ? cf->longpolling_connection_ttl : cf->subscriber_connection_ttl;
     ngx_http_push_stream_module_ctx_t              *ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module);
-    ngx_slab_pool_t                                *shpool = mcf->shpool;
 
     // adding subscriber to worker list of subscribers
     ngx_queue_insert_tail(&thisworker_data->subscribers_queue, &worker_subscriber->worker_queue);
@@ -460,126 +473,170 @@ ngx_http_push_stream_registry_subscriber(ngx_http_request_t *r, ngx_http_push_st
         }
     }
 
-    // increment global subscribers count
-    ngx_shmtx_lock(&shpool->mutex);
-    data->subscribers++;
-    ngx_shmtx_unlock(&shpool->mutex);
+    // the global subscribers count is the sum of the workers counts
     thisworker_data->subscribers++;
 
+    // count the subscribers using each template, to format the messages only for those in use
+    if ((cf->message_template_index > 0) && ((ngx_uint_t) cf->message_template_index <= data->qtd_templates)) {
+        worker_subscriber->template_subscribers = data->template_subscribers + cf->message_template_index - 1;
+        ngx_atomic_fetch_add(worker_subscriber->template_subscribers, 1);
+    }
+
     return NGX_OK;
 }
 
-static ngx_flag_t
-ngx_http_push_stream_has_old_messages_to_send(ngx_http_push_stream_channel_t *channel, ngx_uint_t backtrack, time_t if_modified_since, ngx_int_t tag, time_t greater_message_time, ngx_int_t greater_message_tag, ngx_str_t *last_event_id)
+// index of the first stored message after the last one received by the subscriber, must be called with the channel locked
+static ngx_uint_t
+ngx_http_push_stream_get_first_old_message_index(ngx_http_push_stream_channel_t *channel, time_t if_modified_since, ngx_int_t tag, ngx_str_t *last_event_id)
 {
-    ngx_flag_t old_messages = 0;
     ngx_http_push_stream_msg_t *message;
-    ngx_queue_t                *q;
-
-    if (channel->stored_messages > 0) {
-
-        if (backtrack > 0) {
-            old_messages = 1;
-        } else if ((last_event_id != NULL) || (if_modified_since >= 0)) {
-            ngx_flag_t found = 0;
-            ngx_shmtx_lock(channel->mutex);
-            for (q = ngx_queue_head(&channel->message_queue); q != ngx_queue_sentinel(&channel->message_queue); q = ngx_queue_next(q)) {
-                message = ngx_queue_data(q, ngx_http_push_stream_msg_t, queue);
-                if (message->deleted) {
-                    break;
-                }
+    ngx_uint_t                  low = 0, high = channel->stored_messages, middle, start = channel->stored_messages;
+    ngx_int_t                   event_id_index = -1;
+
+    if (if_modified_since >= 0) {
+        // messages are stored ordered by time and tag, look for the first one not older than the given values
+        while (low < high) {
+            middle = low + (high - low) / 2;
+            message = ngx_http_push_stream_channel_stored_message(channel, middle);
+            if ((message->time > if_modified_since) || ((message->time == if_modified_since) && (tag >= 0) && (message->tag >= tag))) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
 
-                if ((!found) && (last_event_id != NULL) && (message->event_id != NULL) && (ngx_memn2cmp(message->event_id->data, last_event_id->data, message->event_id->len, last_event_id->len) == 0)) {
-                    found = 1;
-                    continue;
-                }
+        start = low;
+        if (start < channel->stored_messages) {
+            message = ngx_http_push_stream_channel_stored_message(channel, start);
+            if ((message->time == if_modified_since) && (message->tag == tag)) {
+                start++;
+            }
+        }
+    } else {
+        low = channel->stored_messages;
+    }
 
-                if ((!found) && (if_modified_since >= 0) && ((message->time > if_modified_since) || ((message->time == if_modified_since) && (tag >= 0) && (message->tag >= tag)))) {
-                    found = 1;
-                    if ((message->time == if_modified_since) && (message->tag == tag)) {
-                        continue;
-                    }
-                }
+    // a message with the last event id before the first one by time, or at the same one, takes precedence
+    if ((last_event_id != NULL) && ((event_id_index = ngx_http_push_stream_get_channel_event_id_index(channel, last_event_id)) >= 0) && ((ngx_uint_t) event_id_index <= low)) {
+        start = event_id_index + 1;
+    }
 
-                if (found) {
-                    old_messages = 1;
-                    break;
-                }
+    return start;
+}
+
+// pin the stored messages to be sent to the subscriber with a single pass under the channel lock, they are sent after it is released
+static ngx_int_t
+ngx_http_push_stream_collect_old_messages(ngx_http_push_stream_requested_channel_t *requested_channel, time_t if_modified_since, ngx_int_t tag, ngx_str_t *last_event_id, ngx_pool_t *temp_pool)
+{
+    ngx_http_push_stream_channel_t *channel = requested_channel->channel;
+    ngx_http_push_stream_msg_t     *message;
+    ngx_uint_t                      i, start, backtrack = requested_channel->backtrack_messages;
+
+    requested_channel->qtd_old_messages = 0;
+
+    if ((channel->stored_messages == 0) || ((backtrack == 0) && (last_event_id == NULL) && (if_modified_since < 0))) {
+        return NGX_OK;
+    }
+
+    ngx_http_push_stream_lock_channel(channel);
+
+    if (backtrack > 0) {
+        start = (backtrack > channel->stored_messages) ? 0 : channel->stored_messages - backtrack;
+    } else {
+        start = ngx_http_push_stream_get_first_old_message_index(channel, if_modified_since, tag, last_event_id);
+    }
+
+    if (start < channel->stored_messages) {
+        if ((requested_channel->old_messages = ngx_palloc(temp_pool, (channel->stored_messages - start) * sizeof(ngx_http_push_stream_msg_t *))) == NULL) {
+            ngx_http_push_stream_unlock_channel(channel);
+            ngx_log_error(NGX_LOG_ERR, temp_pool->log, 0, "push stream module: unable to allocate memory to old messages list");
+            return NGX_ERROR;
+        }
+
+        for (i = start; i < channel->stored_messages; i++) {
+            message = ngx_http_push_stream_channel_stored_message(channel, i);
+            if (message->deleted) {
+                break;
             }
-            ngx_shmtx_unlock(channel->mutex);
+
+            ngx_atomic_fetch_add(&message->workers_ref_count, 1);
+            requested_channel->old_messages[requested_channel->qtd_old_messages++] = message;
+            requested_channel->last_message_time = message->time;
+            requested_channel->last_message_tag = message->tag;
         }
     }
-    return old_messages;
+
+    ngx_http_push_stream_unlock_channel(channel);
+
+    return NGX_OK;
 }
 
 static void
-ngx_http_push_stream_send_old_messages(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_uint_t backtrack, time_t if_modified_since, ngx_int_t tag, time_t greater_message_time, ngx_int_t greater_message_tag, ngx_str_t *last_event_id)
+ngx_http_push_stream_send_old_messages(ngx_http_request_t *r, ngx_http_push_stream_requested_channel_t *requested_channel, time_t greater_message_time, ngx_int_t greater_message_tag)
 {
     ngx_http_push_stream_module_ctx_t     *ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module);
-    ngx_http_push_stream_msg_t            *message;
-    ngx_queue_t                           *q;
+    ngx_http_push_stream_msg_t            *message, **messages = requested_channel->old_messages;
+    ngx_uint_t                             i, qtd = 0;
+
+    // skip messages published after the values already sent on polling headers
+    for (i = 0; i < requested_channel->qtd_old_messages; i++) {
+        message = messages[i];
+        if (((greater_message_time == 0) && (greater_message_tag == -1)) || (greater_message_time > message->time) || ((greater_message_time == message->time) && (greater_message_tag >= message->tag))) {
+            messages[qtd++] = message;
+        } else {
+            ngx_http_push_stream_release_worker_message(message);
+        }
+    }
+    requested_channel->qtd_old_messages = qtd;
 
-    if (ngx_http_push_stream_has_old_messages_to_send(channel, backtrack, if_modified_since, tag, greater_message_time, greater_message_tag, last_event_id)) {
-        if (backtrack > 0) {
-            ngx_uint_t qtd = (backtrack > channel->stored_messages) ? channel->stored_messages : backtrack;
-            ngx_uint_t start = channel->stored_messages - qtd;
-            ngx_shmtx_lock(channel->mutex);
-            // positioning at first message, and send the others
-            for (q = ngx_queue_head(&channel->message_queue); (qtd > 0) && q != ngx_queue_sentinel(&channel->message_queue); q = ngx_queue_next(q)) {
-                message = ngx_queue_data(q, ngx_http_push_stream_msg_t, queue);
-                if (message->deleted) {
-                    break;
-                }
+    if (qtd > 0) {
+        // the separator is not sent before the first message of the response
+        if (!ctx->message_sent) {
+            ngx_http_push_stream_send_response_messages(r, requested_channel->channel, messages, 1, 0, 0);
+            messages++;
+            qtd--;
+        }
 
-                if (start == 0) {
-                    qtd--;
-                    ngx_http_push_stream_send_response_message(r, channel, message, 0, ctx->message_sent);
-                } else {
-                    start--;
-                }
-            }
-            ngx_shmtx_unlock(channel->mutex);
-        } else if ((last_event_id != NULL) || (if_modified_since >= 0)) {
-            ngx_flag_t found = 0;
-            ngx_shmtx_lock(channel->mutex);
-            for (q = ngx_queue_head(&channel->message_queue); q != ngx_queue_sentinel(&channel->message_queue); q = ngx_queue_next(q)) {
-                message = ngx_queue_data(q, ngx_http_push_stream_msg_t, queue);
-                if (message->deleted) {
-                    break;
-                }
+        ngx_http_push_stream_send_response_messages(r, requested_channel->channel, messages, qtd, 0, 1);
+    }
 
-                if ((!found) && (last_event_id != NULL) && (message->event_id != NULL) && (ngx_memn2cmp(message->event_id->data, last_event_id->data, message->event_id->len, last_event_id->len) == 0)) {
-                    found = 1;
-                    continue;
-                }
+    ngx_http_push_stream_release_old_messages(requested_channel);
+}
 
-                if ((!found) && (if_modified_since >= 0) && ((message->time > if_modified_since) || ((message->time == if_modified_since) && (tag >= 0) && (message->tag >= tag)))) {
-                    found = 1;
-                    if ((message->time == if_modified_since) && (message->tag == tag)) {
-                        continue;
-                    }
-                }
+static void
+ngx_http_push_stream_release_old_messages(ngx_http_push_stream_requested_channel_t *requested_channel)
+{
+    ngx_uint_t                             i;
 
-                if (found && (((greater_message_time == 0) && (greater_message_tag == -1)) || (greater_message_time > message->time) || ((greater_message_time == message->time) && (greater_message_tag >= message->tag)))) {
-                    ngx_http_push_stream_send_response_message(r, channel, message, 0, ctx->message_sent);
-                }
-            }
-            ngx_shmtx_unlock(channel->mutex);
-        }
+    for (i = 0; i < requested_channel->qtd_old_messages; i++) {
+        ngx_http_push_stream_release_worker_message(requested_channel->old_messages[i]);
+    }
+    requested_channel->qtd_old_messages = 0;
+}
+
+static void
+ngx_http_push_stream_release_requested_channels_old_messages(ngx_http_push_stream_requested_channel_t *requested_channels)
+{
+    ngx_queue_t                           *q;
+
+    for (q = ngx_queue_head(&requested_channels->queue); q != ngx_queue_sentinel(&requested_channels->queue); q = ngx_queue_next(q)) {
+        ngx_http_push_stream_release_old_messages(ngx_queue_data(q, ngx_http_push_stream_requested_channel_t, queue));
     }
 }
 
 static ngx_http_push_stream_pid_queue_t *
-ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(ngx_slab_pool_t *shpool, ngx_http_push_stream_channel_t *channel, ngx_log_t *log)
+ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_log_t *log)
 {
+    ngx_slab_pool_t                      *shpool = data->shpool;
     ngx_http_push_stream_pid_queue_t     *worker_sentinel;
-    ngx_queue_t                          *q;
 
-    for (q = ngx_queue_head(&channel->workers_with_subscribers); q != ngx_queue_sentinel(&channel->workers_with_subscribers); q = ngx_queue_next(q)) {
-        worker_sentinel = ngx_queue_data(q, ngx_http_push_stream_pid_queue_t, queue);
+    if ((worker_sentinel = ngx_http_push_stream_channel_worker_sentinel(channel, ngx_process_slot)) != NULL) {
         if (worker_sentinel->pid == ngx_pid) {
             return worker_sentinel;
         }
+
+        // left by a worker which died on this slot
+        ngx_http_push_stream_discount_dead_worker_locked(shpool, channel, worker_sentinel);
     }
 
     if ((worker_sentinel = ngx_slab_alloc(shpool, sizeof(ngx_http_push_stream_pid_queue_t))) == NULL) {
@@ -588,13 +645,17 @@ ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(ngx_slab_pool
     }
 
     // initialize
-    ngx_queue_insert_tail(&channel->workers_with_subscribers, &worker_sentinel->queue);
-
     worker_sentinel->subscribers = 0;
     worker_sentinel->pid = ngx_pid;
     worker_sentinel->slot = ngx_process_slot;
     ngx_queue_init(&worker_sentinel->subscriptions);
 
+    if (ngx_http_push_stream_insert_channel_worker_sentinel_locked(data, channel, worker_sentinel) != NGX_OK) {
+        ngx_slab_free(shpool, worker_sentinel);
+        ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to allocate worker subscriber queue markers index in shared memory");
+        return NULL;
+    }
+
     return worker_sentinel;
 }
 
@@ -623,9 +684,9 @@ ngx_http_push_stream_assing_subscription_to_channel(ngx_slab_pool_t *shpool, ngx
     ngx_http_push_stream_main_conf_t           *mcf = ngx_http_get_module_main_conf(subscription->subscriber->request, ngx_http_push_stream_module);
     ngx_http_push_stream_pid_queue_t           *worker_subscribers_sentinel;
 
-    ngx_shmtx_lock(channel->mutex);
-    if ((worker_subscribers_sentinel = ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(shpool, channel, log)) == NULL) {
-        ngx_shmtx_unlock(channel->mutex);
+    ngx_http_push_stream_lock_channel(channel);
+    if ((worker_subscribers_sentinel = ngx_http_push_stream_get_worker_subscriber_channel_sentinel_locked(mcf->shm_data, channel, log)) == NULL) {
+        ngx_http_push_stream_unlock_channel(channel);
         return NGX_ERROR;
     }
 
@@ -635,7 +696,7 @@ ngx_http_push_stream_assing_subscription_to_channel(ngx_slab_pool_t *shpool, ngx
     ngx_queue_insert_tail(subscriptions, &subscription->queue);
     ngx_queue_insert_tail(&worker_subscribers_sentinel->subscriptions, &subscription->channel_worker_queue);
     subscription->channel_worker_sentinel = worker_subscribers_sentinel;
-    ngx_shmtx_unlock(channel->mutex);
+    ngx_http_push_stream_unlock_channel(channel);
 
     ngx_http_push_stream_send_event(mcf, log, channel, &NGX_HTTP_PUSH_STREAM_EVENT_TYPE_CLIENT_SUBSCRIBED, NULL);
 
@@ -29,6 +29,9 @@ static void            nxg_http_push_stream_free_channel_memory(ngx_slab_pool_t
 static void            ngx_http_push_stream_run_cleanup_pool_handler(ngx_pool_t *p, ngx_pool_cleanup_pt handler);
 static void            ngx_http_push_stream_cleanup_request_context(ngx_http_request_t *r);
 static ngx_int_t       ngx_http_push_stream_send_response_padding(ngx_http_request_t *r, size_t len, ngx_flag_t sending_header);
+static ngx_str_t *     ngx_http_push_stream_get_padding(ngx_http_request_t *r, size_t len, ngx_flag_t sending_header);
+static ngx_int_t       ngx_http_push_stream_append_response_text(ngx_http_request_t *r, ngx_chain_t ***last, const u_char *text, uint len);
+static ngx_int_t       ngx_http_push_stream_append_response_message(ngx_http_request_t *r, ngx_chain_t ***last, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_flag_t send_callback, ngx_flag_t send_separator);
 void                   ngx_http_push_stream_delete_channels_data(ngx_http_push_stream_shm_data_t *data);
 void                   ngx_http_push_stream_collect_expired_messages_and_empty_channels_data(ngx_http_push_stream_shm_data_t *data, ngx_flag_t force);
 void                   ngx_http_push_stream_free_memory_of_expired_messages_and_channels_data(ngx_http_push_stream_shm_data_t *data, ngx_flag_t force);
@@ -40,33 +43,259 @@ ngx_uint_t
 ngx_http_push_stream_ensure_qtd_of_messages(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_uint_t max_messages, ngx_flag_t expired)
 {
     ngx_http_push_stream_msg_t             *msg;
-    ngx_queue_t                            *q;
     ngx_uint_t                              qtd_removed = 0;
 
     if (max_messages == NGX_CONF_UNSET_UINT) {
         return qtd_removed;
     }
 
-    ngx_shmtx_lock(channel->mutex);
-    while (!ngx_queue_empty(&channel->message_queue) && ((channel->stored_messages > max_messages) || expired)) {
-        q = ngx_queue_head(&channel->message_queue);
-        msg = ngx_queue_data(q, ngx_http_push_stream_msg_t, queue);
+    ngx_http_push_stream_lock_channel(channel);
+    while ((channel->stored_messages > 0) && ((channel->stored_messages > max_messages) || expired)) {
+        msg = ngx_http_push_stream_channel_stored_message(channel, 0);
 
         if (expired && (msg->deleted || (msg->expires == 0) || (msg->expires > ngx_time()) || (msg->workers_ref_count > 0))) {
             break;
         }
 
         qtd_removed++;
+        if (channel->event_ids != NULL) {
+            ngx_http_push_stream_remove_channel_event_id(channel, channel->messages_offset);
+        }
+        channel->messages_head = (channel->messages_head + 1) & (channel->messages_capacity - 1);
+        channel->messages_offset++;
         NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(channel->stored_messages);
-        ngx_queue_remove(&msg->queue);
         ngx_http_push_stream_throw_the_message_away(msg, data);
     }
-    ngx_shmtx_unlock(channel->mutex);
+    ngx_http_push_stream_unlock_channel(channel);
 
     return qtd_removed;
 }
 
 
+static ngx_int_t
+ngx_http_push_stream_grow_channel_messages(ngx_http_push_stream_channel_t *channel, ngx_slab_pool_t *shpool)
+{
+    ngx_http_push_stream_msg_t            **messages;
+    ngx_http_push_stream_event_id_entry_t  *event_ids = NULL;
+    ngx_uint_t                              i, capacity = (channel->messages_capacity > 0) ? channel->messages_capacity * 2 : NGX_HTTP_PUSH_STREAM_CHANNEL_MESSAGES_INITIAL_CAPACITY;
+
+    if ((messages = ngx_slab_alloc(shpool, capacity * sizeof(ngx_http_push_stream_msg_t *))) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if ((channel->event_ids != NULL) && ((event_ids = ngx_slab_alloc(shpool, 2 * capacity * sizeof(ngx_http_push_stream_event_id_entry_t))) == NULL)) {
+        ngx_slab_free(shpool, messages);
+        return NGX_ERROR;
+    }
+
+    // unwrap the stored messages to the beginning of the new ring
+    for (i = 0; i < channel->stored_messages; i++) {
+        messages[i] = ngx_http_push_stream_channel_stored_message(channel, i);
+    }
+
+    if (channel->messages != NULL) {
+        ngx_slab_free(shpool, channel->messages);
+    }
+
+    channel->messages = messages;
+    channel->messages_head = 0;
+    channel->messages_capacity = capacity;
+
+    if (event_ids != NULL) {
+        ngx_slab_free(shpool, channel->event_ids);
+        channel->event_ids = event_ids;
+        ngx_http_push_stream_index_channel_event_ids(channel);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_push_stream_insert_channel_worker_sentinel_locked(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_pid_queue_t *worker)
+{
+    ngx_slab_pool_t                        *shpool = data->shpool;
+    ngx_http_push_stream_pid_queue_t      **sentinels;
+    ngx_uint_t                              size = ngx_max(channel->workers_sentinels_size, 1);
+
+    if ((ngx_uint_t) worker->slot >= channel->workers_sentinels_size) {
+        while (size <= (ngx_uint_t) worker->slot) {
+            size *= 2;
+        }
+
+        if ((sentinels = ngx_slab_alloc(shpool, size * sizeof(ngx_http_push_stream_pid_queue_t *))) == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(sentinels, size * sizeof(ngx_http_push_stream_pid_queue_t *));
+        if (channel->workers_sentinels != NULL) {
+            ngx_memcpy(sentinels, channel->workers_sentinels, channel->workers_sentinels_size * sizeof(ngx_http_push_stream_pid_queue_t *));
+            ngx_slab_free(shpool, channel->workers_sentinels);
+        }
+
+        channel->workers_sentinels = sentinels;
+        channel->workers_sentinels_size = size;
+    }
+
+    channel->workers_sentinels[worker->slot] = worker;
+    ngx_queue_insert_tail(&channel->workers_with_subscribers, &worker->queue);
+
+    worker->channel = channel;
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_queue_insert_tail(&data->ipc[worker->slot]->channels_entries, &worker->slot_queue);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_push_stream_remove_channel_worker_sentinel_locked(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_pid_queue_t *worker, ngx_slab_pool_t *shpool)
+{
+    if (ngx_http_push_stream_channel_worker_sentinel(channel, worker->slot) == worker) {
+        channel->workers_sentinels[worker->slot] = NULL;
+    }
+    ngx_queue_remove(&worker->queue);
+
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_queue_remove(&worker->slot_queue);
+    ngx_slab_free_locked(shpool, worker);
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+// the event ids are only indexed after the first message with one is stored on the channel
+static ngx_int_t
+ngx_http_push_stream_init_channel_event_ids(ngx_http_push_stream_channel_t *channel, ngx_slab_pool_t *shpool)
+{
+    if ((channel->event_ids = ngx_slab_alloc(shpool, 2 * channel->messages_capacity * sizeof(ngx_http_push_stream_event_id_entry_t))) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_push_stream_index_channel_event_ids(channel);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_push_stream_index_channel_event_ids(ngx_http_push_stream_channel_t *channel)
+{
+    ngx_uint_t                              i;
+
+    for (i = 0; i < 2 * channel->messages_capacity; i++) {
+        channel->event_ids[i].oldest = NGX_HTTP_PUSH_STREAM_EVENT_ID_ENTRY_EMPTY;
+    }
+
+    for (i = 0; i < channel->stored_messages; i++) {
+        ngx_http_push_stream_insert_channel_event_id(channel, channel->messages_offset + i);
+    }
+}
+
+
+static ngx_http_push_stream_event_id_entry_t *
+ngx_http_push_stream_find_channel_event_id(ngx_http_push_stream_channel_t *channel, uint32_t key, ngx_str_t *event_id)
+{
+    ngx_http_push_stream_event_id_entry_t  *entry;
+    ngx_http_push_stream_msg_t             *msg;
+    ngx_uint_t                              i, mask = 2 * channel->messages_capacity - 1;
+
+    for (i = key & mask; channel->event_ids[i].oldest != NGX_HTTP_PUSH_STREAM_EVENT_ID_ENTRY_EMPTY; i = (i + 1) & mask) {
+        entry = channel->event_ids + i;
+        if (entry->key == key) {
+            msg = ngx_http_push_stream_channel_stored_message(channel, entry->oldest - channel->messages_offset);
+            if (ngx_memn2cmp(msg->event_id->data, event_id->data, msg->event_id->len, event_id->len) == 0) {
+                return entry;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_push_stream_insert_channel_event_id(ngx_http_push_stream_channel_t *channel, ngx_uint_t position)
+{
+    ngx_http_push_stream_msg_t             *msg = ngx_http_push_stream_channel_stored_message(channel, position - channel->messages_offset);
+    ngx_http_push_stream_event_id_entry_t  *entry;
+    ngx_uint_t                              i, mask = 2 * channel->messages_capacity - 1;
+    uint32_t                                key;
+
+    if (msg->event_id == NULL) {
+        return;
+    }
+
+    key = ngx_crc32_short(msg->event_id->data, msg->event_id->len);
+    if ((entry = ngx_http_push_stream_find_channel_event_id(channel, key, msg->event_id)) != NULL) {
+        entry->newest = position;
+        return;
+    }
+
+    // there is always an empty entry, the hash has twice the entries of the messages ring
+    for (i = key & mask; channel->event_ids[i].oldest != NGX_HTTP_PUSH_STREAM_EVENT_ID_ENTRY_EMPTY; i = (i + 1) & mask) { /* void */ }
+
+    channel->event_ids[i].key = key;
+    channel->event_ids[i].oldest = position;
+    channel->event_ids[i].newest = position;
+}
+
+
+// must be called before the oldest message leaves the ring
+static void
+ngx_http_push_stream_remove_channel_event_id(ngx_http_push_stream_channel_t *channel, ngx_uint_t position)
+{
+    ngx_http_push_stream_msg_t             *msg = ngx_http_push_stream_channel_stored_message(channel, position - channel->messages_offset);
+    ngx_http_push_stream_event_id_entry_t  *entry, *table = channel->event_ids;
+    ngx_uint_t                              i, j, home, mask = 2 * channel->messages_capacity - 1;
+
+    if ((msg->event_id == NULL) || ((entry = ngx_http_push_stream_find_channel_event_id(channel, ngx_crc32_short(msg->event_id->data, msg->event_id->len), msg->event_id)) == NULL)) {
+        return;
+    }
+
+    if (entry->newest != position) {
+        // another message has the same event id, look for the next one
+        for (j = position + 1; j < entry->newest; j++) {
+            ngx_http_push_stream_msg_t *next = ngx_http_push_stream_channel_stored_message(channel, j - channel->messages_offset);
+            if ((next->event_id != NULL) && (ngx_memn2cmp(next->event_id->data, msg->event_id->data, next->event_id->len, msg->event_id->len) == 0)) {
+                break;
+            }
+        }
+        entry->oldest = j;
+        return;
+    }
+
+    // backward shift the following entries, keeping the hash without tombstones
+    for (i = entry - table, j = i; ; ) {
+        j = (j + 1) & mask;
+        if (table[j].oldest == NGX_HTTP_PUSH_STREAM_EVENT_ID_ENTRY_EMPTY) {
+            break;
+        }
+
+        home = table[j].key & mask;
+        if ((i <= j) ? ((home <= i) || (home > j)) : ((home <= i) && (home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].oldest = NGX_HTTP_PUSH_STREAM_EVENT_ID_ENTRY_EMPTY;
+}
+
+
+// index of the oldest stored message with the event id, or -1
+static ngx_int_t
+ngx_http_push_stream_get_channel_event_id_index(ngx_http_push_stream_channel_t *channel, ngx_str_t *event_id)
+{
+    ngx_http_push_stream_event_id_entry_t  *entry;
+
+    if ((channel->event_ids == NULL) || ((entry = ngx_http_push_stream_find_channel_event_id(channel, ngx_crc32_short(event_id->data, event_id->len), event_id)) == NULL)) {
+        return -1;
+    }
+
+    return entry->oldest - channel->messages_offset;
+}
+
+
 static void
 ngx_http_push_stream_delete_channels(void)
 {
@@ -85,7 +314,7 @@ ngx_http_push_stream_delete_channels_data(ngx_http_push_stream_shm_data_t *data)
     ngx_http_push_stream_main_conf_t            *mcf = data->mcf;
     ngx_http_push_stream_channel_t              *channel;
     ngx_http_push_stream_pid_queue_t            *worker, *channel_worker;
-    ngx_queue_t                                 *cur_worker, *cur;
+    ngx_queue_t                                 *cur;
     ngx_queue_t                                 *q;
 
     ngx_shmtx_lock(&data->channels_to_delete_mutex);
@@ -95,16 +324,12 @@ ngx_http_push_stream_delete_channels_data(ngx_http_push_stream_shm_data_t *data)
 
         // remove subscribers if any
         if (channel->subscribers > 0) {
-            ngx_shmtx_lock(channel->mutex);
+            ngx_http_push_stream_lock_channel(channel);
             // find the current worker
-            for (cur_worker = ngx_queue_head(&channel->workers_with_subscribers); cur_worker != ngx_queue_sentinel(&channel->workers_with_subscribers); cur_worker = ngx_queue_next(cur_worker)) {
-                channel_worker = ngx_queue_data(cur_worker, ngx_http_push_stream_pid_queue_t, queue);
-                if (channel_worker->pid == ngx_pid) {
-                    worker = channel_worker;
-                    break;
-                }
+            if (((channel_worker = ngx_http_push_stream_channel_worker_sentinel(channel, ngx_process_slot)) != NULL) && (channel_worker->pid == ngx_pid)) {
+                worker = channel_worker;
             }
-            ngx_shmtx_unlock(channel->mutex);
+            ngx_http_push_stream_unlock_channel(channel);
         }
 
         if (worker != NULL) {
@@ -114,14 +339,14 @@ ngx_http_push_stream_delete_channels_data(ngx_http_push_stream_shm_data_t *data)
                 ngx_http_push_stream_subscription_t *subscription = ngx_queue_data(cur, ngx_http_push_stream_subscription_t, channel_worker_queue);
                 ngx_http_push_stream_subscriber_t *subscriber = subscription->subscriber;
 
-                ngx_shmtx_lock(channel->mutex);
+                ngx_http_push_stream_lock_channel(channel);
                 NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(channel->subscribers);
                 NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(worker->subscribers);
                 // remove the subscription for the channel from subscriber
                 ngx_queue_remove(&subscription->queue);
                 // remove the subscription for the channel from worker
                 ngx_queue_remove(&subscription->channel_worker_queue);
-                ngx_shmtx_unlock(channel->mutex);
+                ngx_http_push_stream_unlock_channel(channel);
 
                 ngx_http_push_stream_send_event(mcf, ngx_cycle->log, subscription->channel, &NGX_HTTP_PUSH_STREAM_EVENT_TYPE_CLIENT_UNSUBSCRIBED, subscriber->request->pool);
 
@@ -165,10 +390,8 @@ ngx_http_push_stream_collect_deleted_channels_data(ngx_http_push_stream_shm_data
 
         // remove all messages
         qtd_removed = ngx_http_push_stream_ensure_qtd_of_messages(data, channel, 0, 0);
-        if (qtd_removed > 0) {
-            ngx_shmtx_lock(&data->channels_queue_mutex);
-            NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER_BY(data->stored_messages, qtd_removed);
-            ngx_shmtx_unlock(&data->channels_queue_mutex);
+        if (!channel->for_events && (data->ipc[ngx_process_slot] != NULL)) {
+            data->ipc[ngx_process_slot]->stored_messages -= qtd_removed;
         }
 
         // channel has no subscribers and can be released
@@ -207,6 +430,12 @@ ngx_http_push_stream_cleanup_shutting_down_worker(void)
     ngx_http_push_stream_global_shm_data_t *global_data = (ngx_http_push_stream_global_shm_data_t *) ngx_http_push_stream_global_shm_zone->data;
     ngx_queue_t                            *q;
 
+    // the wakeups batched by this worker are sent before it goes away
+    if (ngx_http_push_stream_ipc_wakeup_event.timer_set) {
+        ngx_del_timer(&ngx_http_push_stream_ipc_wakeup_event);
+        ngx_http_push_stream_ipc_wakeup_timer_wake_handler(&ngx_http_push_stream_ipc_wakeup_event);
+    }
+
     for (q = ngx_queue_head(&global_data->shm_datas_queue); q != ngx_queue_sentinel(&global_data->shm_datas_queue); q = ngx_queue_next(q)) {
         ngx_http_push_stream_shm_data_t *data = ngx_queue_data(q, ngx_http_push_stream_shm_data_t, shm_data_queue);
         ngx_http_push_stream_cleanup_shutting_down_worker_data(data);
@@ -218,7 +447,7 @@ ngx_http_push_stream_cleanup_shutting_down_worker(void)
 static ngx_inline void
 ngx_http_push_stream_cleanup_shutting_down_worker_data(ngx_http_push_stream_shm_data_t *data)
 {
-    ngx_http_push_stream_worker_data_t          *thisworker_data = data->ipc + ngx_process_slot;
+    ngx_http_push_stream_worker_data_t          *thisworker_data = data->ipc[ngx_process_slot];
     ngx_queue_t                                 *q;
 
     while (!ngx_queue_empty(&thisworker_data->subscribers_queue)) {
@@ -242,45 +471,83 @@ ngx_http_push_stream_cleanup_shutting_down_worker_data(ngx_http_push_stream_shm_
     ngx_http_push_stream_clean_worker_data(data);
 }
 
-ngx_uint_t
-ngx_http_push_stream_apply_text_template(ngx_str_t **dst_value, ngx_str_t **dst_message, ngx_str_t *text, const ngx_str_t *template, const ngx_str_t *token, ngx_slab_pool_t *shpool, ngx_pool_t *temp_pool)
+static u_char *
+ngx_http_push_stream_copy_to_message_block(ngx_str_t *dst, u_char *last, ngx_str_t *text, ngx_flag_t null_terminated)
 {
-    if (text != NULL) {
-        if ((*dst_value = ngx_slab_alloc(shpool, sizeof(ngx_str_t) + text->len + 1)) == NULL) {
-            return NGX_ERROR;
-        }
-
-        (*dst_value)->len = text->len;
-        (*dst_value)->data = (u_char *) ((*dst_value) + 1);
-        ngx_memcpy((*dst_value)->data, text->data, text->len);
-        (*dst_value)->data[(*dst_value)->len] = '\0';
-
-        ngx_str_t *aux = ngx_http_push_stream_str_replace(template, token, text, 0, temp_pool);
-        if (aux == NULL) {
-            return NGX_ERROR;
-        }
-
-        if (((*dst_message) = ngx_slab_alloc(shpool, sizeof(ngx_str_t) + aux->len)) == NULL) {
-            return NGX_ERROR;
-        }
-
-        (*dst_message)->len = aux->len;
-        (*dst_message)->data = (u_char *) ((*dst_message) + 1);
-        ngx_memcpy((*dst_message)->data, aux->data, (*dst_message)->len);
+    dst->len = text->len;
+    dst->data = last;
+    last = ngx_cpymem(last, text->data, text->len);
+    if (null_terminated) {
+        *last++ = '\0';
     }
 
-    return NGX_OK;
+    return last;
 }
 
+
 ngx_http_push_stream_msg_t *
 ngx_http_push_stream_convert_char_to_msg_on_shared(ngx_http_push_stream_main_conf_t *mcf, u_char *data, size_t len, ngx_http_push_stream_channel_t *channel, ngx_int_t id, ngx_str_t *event_id, ngx_str_t *event_type, time_t time, ngx_int_t tag, ngx_pool_t *temp_pool)
 {
     ngx_slab_pool_t                           *shpool = mcf->shpool;
+    ngx_http_push_stream_shm_data_t           *shm_data = mcf->shm_data;
+    ngx_http_push_stream_msg_t                *msg, fields_msg;
+    ngx_http_push_stream_template_fields_t     fields;
     ngx_queue_t                               *q;
-    ngx_http_push_stream_msg_t                *msg;
-    int                                        i = 0;
+    ngx_str_t                                 *event_id_message = NULL, *event_type_message = NULL, *str_slots;
+    size_t                                     size, *formatted_lens = NULL;
+    u_char                                    *last;
+    ngx_uint_t                                 qtd_str_slots = 0, index;
+
+    size = sizeof(ngx_http_push_stream_msg_t) + len + 1;
 
-    if ((msg = ngx_slab_alloc(shpool, sizeof(ngx_http_push_stream_msg_t))) == NULL) {
+    if (event_id != NULL) {
+        if ((event_id_message = ngx_http_push_stream_str_replace(&NGX_HTTP_PUSH_STREAM_EVENTSOURCE_ID_TEMPLATE, &NGX_HTTP_PUSH_STREAM_TOKEN_MESSAGE_EVENT_ID, event_id, 0, temp_pool)) == NULL) {
+            return NULL;
+        }
+        size += event_id->len + 1 + event_id_message->len;
+        qtd_str_slots += 2;
+    }
+
+    if (event_type != NULL) {
+        if ((event_type_message = ngx_http_push_stream_str_replace(&NGX_HTTP_PUSH_STREAM_EVENTSOURCE_EVENT_TEMPLATE, &NGX_HTTP_PUSH_STREAM_TOKEN_MESSAGE_EVENT_TYPE, event_type, 0, temp_pool)) == NULL) {
+            return NULL;
+        }
+        size += event_type->len + 1 + event_type_message->len;
+        qtd_str_slots += 2;
+    }
+
+    // the formatted messages are only produced on first use, here is reserved room for them and for their formatting state
+    size += (sizeof(ngx_str_t) + sizeof(ngx_atomic_t)) * mcf->qtd_templates;
+    size += sizeof(ngx_str_t) * qtd_str_slots;
+
+    // templates with subscribers are formatted right away on the message block, the others only if a subscriber arrives while the message is stored
+    if ((shm_data != NULL) && (shm_data->qtd_templates > 0) && (mcf->qtd_templates > 0)) {
+        if ((formatted_lens = ngx_palloc(temp_pool, sizeof(size_t) * mcf->qtd_templates)) == NULL) {
+            return NULL;
+        }
+
+        fields_msg.raw.data = data;
+        fields_msg.raw.len = len;
+        fields_msg.event_id = event_id;
+        fields_msg.event_type = event_type;
+        fields_msg.id = id;
+        fields_msg.time = time;
+        fields_msg.tag = tag;
+
+        for (q = ngx_queue_head(&mcf->msg_templates); q != ngx_queue_sentinel(&mcf->msg_templates); q = ngx_queue_next(q)) {
+            ngx_http_push_stream_template_t *cur = ngx_queue_data(q, ngx_http_push_stream_template_t, queue);
+            index = cur->index - 1;
+            formatted_lens[index] = NGX_MAX_SIZE_T_VALUE;
+            if ((index < shm_data->qtd_templates) && (shm_data->template_subscribers[index] > 0)) {
+                ngx_http_push_stream_prepare_template_fields(channel, &fields_msg, cur, &fields);
+                formatted_lens[index] = ngx_http_push_stream_formatted_message_len(cur, &fields, &fields_msg.raw);
+                size += ngx_http_push_stream_framed_message_len(cur, formatted_lens[index]);
+            }
+        }
+    }
+
+    // [msg][formatted messages][formatting states][slots][formatted texts][raw][event id][event type]
+    if ((msg = ngx_slab_alloc(shpool, size)) == NULL) {
         return NULL;
     }
 
@@ -288,7 +555,7 @@ ngx_http_push_stream_convert_char_to_msg_on_shared(ngx_http_push_stream_main_con
     msg->event_type = NULL;
     msg->event_id_message = NULL;
     msg->event_type_message = NULL;
-    msg->formatted_messages = NULL;
+    msg->formatted_messages = (ngx_str_t *) (msg + 1);
     msg->deleted = 0;
     msg->expires = 0;
     msg->id = id;
@@ -298,83 +565,144 @@ ngx_http_push_stream_convert_char_to_msg_on_shared(ngx_http_push_stream_main_con
     msg->qtd_templates = mcf->qtd_templates;
     ngx_queue_init(&msg->queue);
 
-    if ((msg->raw.data = ngx_slab_alloc(shpool, len + 1)) == NULL) {
-        ngx_http_push_stream_free_message_memory(shpool, msg);
-        return NULL;
+    ngx_memzero(msg->formatted_messages, (sizeof(ngx_str_t) + sizeof(ngx_atomic_t)) * msg->qtd_templates);
+
+    str_slots = (ngx_str_t *) ngx_http_push_stream_formatted_message_state(msg, msg->qtd_templates);
+    last = (u_char *) (str_slots + qtd_str_slots);
+
+    // the formatted texts stay before the raw text, this is how they are told apart from the ones formatted later on their own blocks
+    if (formatted_lens != NULL) {
+        for (q = ngx_queue_head(&mcf->msg_templates); q != ngx_queue_sentinel(&mcf->msg_templates); q = ngx_queue_next(q)) {
+            ngx_http_push_stream_template_t *cur = ngx_queue_data(q, ngx_http_push_stream_template_t, queue);
+            index = cur->index - 1;
+            if (formatted_lens[index] != NGX_MAX_SIZE_T_VALUE) {
+                ngx_http_push_stream_prepare_template_fields(channel, &fields_msg, cur, &fields);
+                msg->formatted_messages[index].data = last;
+                last = ngx_http_push_stream_write_framed_message(last, cur, &fields, &fields_msg.raw, formatted_lens[index]);
+                msg->formatted_messages[index].len = last - msg->formatted_messages[index].data;
+                *ngx_http_push_stream_formatted_message_state(msg, index) = NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTED;
+            }
+        }
     }
 
     msg->raw.len = len;
+    msg->raw.data = last;
     // copy the message to shared memory
-    ngx_memcpy(msg->raw.data, data, len);
-    msg->raw.data[msg->raw.len] = '\0';
+    last = ngx_cpymem(last, data, len);
+    *last++ = '\0';
 
+    if (event_id != NULL) {
+        msg->event_id = str_slots++;
+        msg->event_id_message = str_slots++;
+        last = ngx_http_push_stream_copy_to_message_block(msg->event_id, last, event_id, 1);
+        last = ngx_http_push_stream_copy_to_message_block(msg->event_id_message, last, event_id_message, 0);
+    }
 
-    if (ngx_http_push_stream_apply_text_template(&msg->event_id, &msg->event_id_message, event_id, &NGX_HTTP_PUSH_STREAM_EVENTSOURCE_ID_TEMPLATE, &NGX_HTTP_PUSH_STREAM_TOKEN_MESSAGE_EVENT_ID, shpool, temp_pool) != NGX_OK) {
-        ngx_http_push_stream_free_message_memory(shpool, msg);
-        return NULL;
+    if (event_type != NULL) {
+        msg->event_type = str_slots++;
+        msg->event_type_message = str_slots++;
+        last = ngx_http_push_stream_copy_to_message_block(msg->event_type, last, event_type, 1);
+        last = ngx_http_push_stream_copy_to_message_block(msg->event_type_message, last, event_type_message, 0);
     }
 
-    if (ngx_http_push_stream_apply_text_template(&msg->event_type, &msg->event_type_message, event_type, &NGX_HTTP_PUSH_STREAM_EVENTSOURCE_EVENT_TEMPLATE, &NGX_HTTP_PUSH_STREAM_TOKEN_MESSAGE_EVENT_TYPE, shpool, temp_pool) != NGX_OK) {
-        ngx_http_push_stream_free_message_memory(shpool, msg);
-        return NULL;
+    return msg;
+}
+
+
+static ngx_http_push_stream_template_t *
+ngx_http_push_stream_get_template_by_index(ngx_http_push_stream_main_conf_t *mcf, ngx_uint_t index)
+{
+    ngx_queue_t                               *q;
+    ngx_http_push_stream_template_t           *cur;
+
+    for (q = ngx_queue_head(&mcf->msg_templates); q != ngx_queue_sentinel(&mcf->msg_templates); q = ngx_queue_next(q)) {
+        cur = ngx_queue_data(q, ngx_http_push_stream_template_t, queue);
+        if (cur->index == index) {
+            return cur;
+        }
     }
 
-    if ((msg->formatted_messages = ngx_slab_alloc(shpool, sizeof(ngx_str_t) * msg->qtd_templates)) == NULL) {
-        ngx_http_push_stream_free_message_memory(shpool, msg);
+    return NULL;
+}
+
+
+static ngx_str_t *
+ngx_http_push_stream_apply_template_to_message(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_http_push_stream_template_t *template, ngx_pool_t *temp_pool)
+{
+    ngx_str_t                                 *aux = NULL;
+    ngx_http_push_stream_template_fields_t     fields;
+
+    ngx_http_push_stream_prepare_template_fields(channel, msg, template, &fields);
+
+    if ((aux = ngx_http_push_stream_create_str(temp_pool, ngx_http_push_stream_formatted_message_len(template, &fields, &msg->raw))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, temp_pool->log, 0, "push stream module: unable to allocate memory to format message");
         return NULL;
     }
-    ngx_memzero(msg->formatted_messages, sizeof(ngx_str_t) * msg->qtd_templates);
 
-    for (q = ngx_queue_head(&mcf->msg_templates); q != ngx_queue_sentinel(&mcf->msg_templates); q = ngx_queue_next(q)) {
-        ngx_http_push_stream_template_t *cur = ngx_queue_data(q, ngx_http_push_stream_template_t, queue);
-        ngx_str_t *aux = NULL;
-        if (cur->eventsource) {
-            ngx_http_push_stream_line_t     *cur_line;
-            ngx_queue_t                     *lines, *q_line;
-
-            if ((lines = ngx_http_push_stream_split_by_crlf(&msg->raw, temp_pool)) == NULL) {
-                ngx_http_push_stream_free_message_memory(shpool, msg);
-                return NULL;
-            }
+    ngx_http_push_stream_write_formatted_message(aux->data, template, &fields, &msg->raw);
 
-            for (q_line = ngx_queue_head(lines); q_line != ngx_queue_sentinel(lines); q_line = ngx_queue_next(q_line )) {
-                cur_line = ngx_queue_data(q_line , ngx_http_push_stream_line_t, queue);
-                if ((cur_line->line = ngx_http_push_stream_format_message(channel, msg, cur_line->line, cur, temp_pool)) == NULL) {
-                    break;
-                }
-            }
+    if (template->websocket) {
+        aux = ngx_http_push_stream_get_formatted_websocket_frame(&NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE), aux->data, aux->len, temp_pool);
+    }
 
-            ngx_str_t *tmp = ngx_http_push_stream_join_with_crlf(lines, temp_pool);
-            if ((aux = ngx_http_push_stream_create_str(temp_pool, tmp->len + 1)) != NULL) {
-                ngx_sprintf(aux->data, "%V\n", tmp);
-            }
-        } else {
-            aux = ngx_http_push_stream_format_message(channel, msg, &msg->raw, cur, temp_pool);
-        }
+    return aux;
+}
 
-        if (aux == NULL) {
-            ngx_http_push_stream_free_message_memory(shpool, msg);
-            return NULL;
-        }
 
-        ngx_str_t *text = aux;
-        if (cur->websocket) {
-            text = ngx_http_push_stream_get_formatted_websocket_frame(&NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE), aux->data, aux->len, temp_pool);
-        }
+static ngx_int_t
+ngx_http_push_stream_format_message_on_shared(ngx_http_push_stream_main_conf_t *mcf, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_http_push_stream_template_t *template, ngx_str_t *formatted, ngx_log_t *log)
+{
+    u_char                                    *data;
+    ngx_http_push_stream_template_fields_t     fields;
+    size_t                                     len;
 
-        ngx_str_t *formmated = (msg->formatted_messages + i);
-        if ((text == NULL) || ((formmated->data = ngx_slab_alloc(shpool, text->len)) == NULL)) {
-            ngx_http_push_stream_free_message_memory(shpool, msg);
-            return NULL;
+    // the message and its websocket frame header are written straight to shared memory
+    ngx_http_push_stream_prepare_template_fields(channel, msg, template, &fields);
+    len = ngx_http_push_stream_formatted_message_len(template, &fields, &msg->raw);
+    if ((data = ngx_slab_alloc(mcf->shpool, ngx_max(ngx_http_push_stream_framed_message_len(template, len), 1))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to format message on shared memory");
+        return NGX_ERROR;
+    }
+
+    formatted->len = ngx_http_push_stream_write_framed_message(data, template, &fields, &msg->raw, len) - data;
+    formatted->data = data;
+    return NGX_OK;
+}
+
+
+// time and tag of a new message, the tag orders the messages published on the same second
+static void
+ngx_http_push_stream_next_message_sequence(ngx_http_push_stream_shm_data_t *data, time_t *time, ngx_int_t *tag)
+{
+#if (NGX_PTR_SIZE == 8)
+    ngx_atomic_uint_t                       old, sequence;
+    time_t                                  last_time;
+
+    do {
+        old = data->last_message_sequence;
+        last_time = (time_t) (old >> 32);
+        *time = ngx_time();
+        // a worker whose cached time is behind keeps the sequence going instead of moving it back
+        if (*time <= last_time) {
+            *time = last_time;
+            *tag = (ngx_int_t) (old & 0xffffffff) + 1;
+        } else {
+            *tag = 1;
         }
+        sequence = ((ngx_atomic_uint_t) *time << 32) | (ngx_atomic_uint_t) *tag;
+    } while (!ngx_atomic_cmp_set(&data->last_message_sequence, old, sequence));
+#else
+    // the sequence does not fit on an atomic word, a spinlock used only by publishers protects it
+    ngx_spinlock(&data->last_message_lock, ngx_pid, 1024);
 
-        formmated->len = text->len;
-        ngx_memcpy(formmated->data, text->data, formmated->len);
+    *time = ngx_max(ngx_time(), data->last_message_time);
+    *tag = ((*time == data->last_message_time) ? (data->last_message_tag + 1) : 1);
 
-        i++;
-    }
+    data->last_message_time = *time;
+    data->last_message_tag = *tag;
 
-    return msg;
+    ngx_unlock(&data->last_message_lock);
+#endif
 }
 
 
@@ -384,27 +712,32 @@ ngx_http_push_stream_add_msg_to_channel(ngx_http_push_stream_main_conf_t *mcf, n
     ngx_http_push_stream_shm_data_t        *data = mcf->shm_data;
     ngx_http_push_stream_msg_t             *msg;
     ngx_uint_t                              qtd_removed;
+    ngx_http_push_stream_worker_data_t     *thisworker_data;
     ngx_int_t                               id;
-    time_t                                  time;
+    time_t                                  time, expires;
     ngx_int_t                               tag;
 
-    ngx_shmtx_lock(channel->mutex);
-
-    ngx_shmtx_lock(&data->shpool->mutex);
+    ngx_http_push_stream_lock_channel(channel);
 
-    id = channel->last_message_id + 1;
-    time = ngx_time();
-    tag = ((time == data->last_message_time) ? (data->last_message_tag + 1) : 1);
+    if (store_messages && (channel->stored_messages == channel->messages_capacity) && (ngx_http_push_stream_grow_channel_messages(channel, data->shpool) != NGX_OK)) {
+        ngx_http_push_stream_unlock_channel(channel);
+        ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to allocate memory to store messages of the channel in shared memory");
+        return NGX_ERROR;
+    }
 
-    data->last_message_time = time;
-    data->last_message_tag = tag;
+    if (store_messages && (event_id != NULL) && (channel->event_ids == NULL) && (ngx_http_push_stream_init_channel_event_ids(channel, data->shpool) != NGX_OK)) {
+        ngx_http_push_stream_unlock_channel(channel);
+        ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to allocate memory to index the event ids of the channel in shared memory");
+        return NGX_ERROR;
+    }
 
-    ngx_shmtx_unlock(&data->shpool->mutex);
+    id = channel->last_message_id + 1;
+    ngx_http_push_stream_next_message_sequence(data, &time, &tag);
 
     // create a buffer copy in shared mem
     msg = ngx_http_push_stream_convert_char_to_msg_on_shared(mcf, text, len, channel, id, event_id, event_type, time, tag, temp_pool);
     if (msg == NULL) {
-        ngx_shmtx_unlock(channel->mutex);
+        ngx_http_push_stream_unlock_channel(channel);
         ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to allocate message in shared memory");
         return NGX_ERROR;
     }
@@ -415,34 +748,40 @@ ngx_http_push_stream_add_msg_to_channel(ngx_http_push_stream_main_conf_t *mcf, n
     channel->last_message_time = msg->time;
     channel->last_message_tag = msg->tag;
     // set message expiration time
-    msg->expires = msg->time + mcf->message_ttl;
+    msg->expires = expires = msg->time + mcf->message_ttl;
     channel->expires = ngx_time() + mcf->channel_inactivity_time;
 
-    // put messages on the queue
+    // put messages on the ring
     if (store_messages) {
-        ngx_queue_insert_tail(&channel->message_queue, &msg->queue);
+        ngx_http_push_stream_channel_stored_message(channel, channel->stored_messages) = msg;
         channel->stored_messages++;
+        if (channel->event_ids != NULL) {
+            ngx_http_push_stream_insert_channel_event_id(channel, channel->messages_offset + channel->stored_messages - 1);
+        }
+    }
+    ngx_http_push_stream_unlock_channel(channel);
+
+    if (store_messages) {
+        ngx_http_push_stream_schedule_channel_expiry(data, channel, expires);
     }
-    ngx_shmtx_unlock(channel->mutex);
 
     // now see if the queue is too big
     qtd_removed = ngx_http_push_stream_ensure_qtd_of_messages(data, channel, mcf->max_messages_stored_per_channel, 0);
 
     if (!channel->for_events) {
-        ngx_shmtx_lock(&data->channels_queue_mutex);
-        data->published_messages++;
-
-        NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER_BY(data->stored_messages, qtd_removed);
-
-        if (store_messages) {
-            data->stored_messages++;
-        }
-        ngx_shmtx_unlock(&data->channels_queue_mutex);
+        thisworker_data = data->ipc[ngx_process_slot];
+        thisworker_data->published_messages++;
+        thisworker_data->stored_messages += (store_messages ? 1 : 0) - (ngx_int_t) qtd_removed;
     }
 
     // send an alert to workers
     ngx_http_push_stream_broadcast(channel, msg, log, mcf);
 
+    // a message not stored is only kept while workers are sending it
+    if (!store_messages) {
+        ngx_http_push_stream_throw_the_message_away(msg, data);
+    }
+
     // turn on timer to cleanup buffer of old messages
     ngx_http_push_stream_buffer_cleanup_timer_set();
 
@@ -578,50 +917,86 @@ ngx_http_push_stream_send_response_content_header(ngx_http_request_t *r, ngx_htt
 
 static ngx_int_t
 ngx_http_push_stream_send_response_message(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_flag_t send_callback, ngx_flag_t send_separator)
+{
+    return ngx_http_push_stream_send_response_messages(r, channel, &msg, 1, send_callback, send_separator);
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_send_response_messages(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t **msgs, ngx_uint_t qtd, ngx_flag_t send_callback, ngx_flag_t send_separator)
+{
+    ngx_http_push_stream_module_ctx_t     *ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module);
+    ngx_chain_t                           *out = NULL, **last = &out, *cl;
+    ngx_int_t                              rc = NGX_OK;
+    ngx_uint_t                             i;
+
+    if (r->connection->error) {
+        return NGX_ERROR;
+    }
+
+    // all messages go through the output filters as a single chain
+    for (i = 0; (i < qtd) && (rc == NGX_OK); i++) {
+        rc = ngx_http_push_stream_append_response_message(r, &last, channel, msgs[i], send_callback, send_separator);
+    }
+
+    if ((rc != NGX_OK) || (out == NULL)) {
+        return rc;
+    }
+
+    for (cl = out; cl->next != NULL; cl = cl->next) { /* void */ }
+    cl->buf->flush = 1;
+    cl->buf->last_in_chain = 1;
+
+    if (((rc = ngx_http_push_stream_output_filter(r, out)) == NGX_OK) && (ctx != NULL)) {
+        ctx->message_sent = 1;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_append_response_message(ngx_http_request_t *r, ngx_chain_t ***last, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *msg, ngx_flag_t send_callback, ngx_flag_t send_separator)
 {
     ngx_http_push_stream_loc_conf_t       *pslcf = ngx_http_get_module_loc_conf(r, ngx_http_push_stream_module);
     ngx_http_push_stream_module_ctx_t     *ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module);
     ngx_flag_t                             use_jsonp = (ctx != NULL) && (ctx->callback != NULL);
-    ngx_int_t rc = NGX_OK;
+    ngx_str_t                             *str, *padding;
+    ngx_int_t                              rc = NGX_OK;
 
+    // all parts of the message point to the shared text
     if (pslcf->location_type == NGX_HTTP_PUSH_STREAM_SUBSCRIBER_MODE_EVENTSOURCE) {
         if (msg->event_id_message != NULL) {
-            rc = ngx_http_push_stream_send_response_text(r, msg->event_id_message->data, msg->event_id_message->len, 0);
+            rc = ngx_http_push_stream_append_response_text(r, last, msg->event_id_message->data, msg->event_id_message->len);
         }
 
         if ((rc == NGX_OK) && (msg->event_type_message != NULL)) {
-            rc = ngx_http_push_stream_send_response_text(r, msg->event_type_message->data, msg->event_type_message->len, 0);
+            rc = ngx_http_push_stream_append_response_text(r, last, msg->event_type_message->data, msg->event_type_message->len);
         }
     }
 
-    if (rc == NGX_OK) {
-        ngx_str_t *str = ngx_http_push_stream_get_formatted_message(r, channel, msg);
-        if (str != NULL) {
-            if ((rc == NGX_OK) && use_jsonp && send_callback) {
-                rc = ngx_http_push_stream_send_response_text(r, ctx->callback->data, ctx->callback->len, 0);
-                if (rc == NGX_OK) {
-                    rc = ngx_http_push_stream_send_response_text(r, NGX_HTTP_PUSH_STREAM_CALLBACK_INIT_CHUNK.data, NGX_HTTP_PUSH_STREAM_CALLBACK_INIT_CHUNK.len, 0);
-                }
+    if ((rc == NGX_OK) && ((str = ngx_http_push_stream_get_formatted_message(r, channel, msg)) != NULL)) {
+        if (use_jsonp && send_callback) {
+            rc = ngx_http_push_stream_append_response_text(r, last, ctx->callback->data, ctx->callback->len);
+            if (rc == NGX_OK) {
+                rc = ngx_http_push_stream_append_response_text(r, last, NGX_HTTP_PUSH_STREAM_CALLBACK_INIT_CHUNK.data, NGX_HTTP_PUSH_STREAM_CALLBACK_INIT_CHUNK.len);
             }
+        }
 
-            if ((rc == NGX_OK) && use_jsonp && send_separator) {
-                rc = ngx_http_push_stream_send_response_text(r, NGX_HTTP_PUSH_STREAM_CALLBACK_MID_CHUNK.data, NGX_HTTP_PUSH_STREAM_CALLBACK_MID_CHUNK.len, 0);
-            }
+        if ((rc == NGX_OK) && use_jsonp && send_separator) {
+            rc = ngx_http_push_stream_append_response_text(r, last, NGX_HTTP_PUSH_STREAM_CALLBACK_MID_CHUNK.data, NGX_HTTP_PUSH_STREAM_CALLBACK_MID_CHUNK.len);
+        }
 
-            if (rc == NGX_OK) {
-                rc = ngx_http_push_stream_send_response_text(r, str->data, str->len, 0);
-                if (rc == NGX_OK) {
-                    ctx->message_sent = 1;
-                }
-            }
+        if (rc == NGX_OK) {
+            rc = ngx_http_push_stream_append_response_text(r, last, str->data, str->len);
+        }
 
-            if ((rc == NGX_OK) && use_jsonp && send_callback) {
-                rc = ngx_http_push_stream_send_response_text(r, NGX_HTTP_PUSH_STREAM_CALLBACK_END_CHUNK.data, NGX_HTTP_PUSH_STREAM_CALLBACK_END_CHUNK.len, 0);
-            }
+        if ((rc == NGX_OK) && use_jsonp && send_callback) {
+            rc = ngx_http_push_stream_append_response_text(r, last, NGX_HTTP_PUSH_STREAM_CALLBACK_END_CHUNK.data, NGX_HTTP_PUSH_STREAM_CALLBACK_END_CHUNK.len);
+        }
 
-            if (rc == NGX_OK) {
-                rc = ngx_http_push_stream_send_response_padding(r, str->len, 0);
-            }
+        if ((rc == NGX_OK) && ((padding = ngx_http_push_stream_get_padding(r, str->len, 0)) != NULL)) {
+            rc = ngx_http_push_stream_append_response_text(r, last, padding->data, padding->len);
         }
     }
 
@@ -629,6 +1004,41 @@ ngx_http_push_stream_send_response_message(ngx_http_request_t *r, ngx_http_push_
 }
 
 
+static ngx_int_t
+ngx_http_push_stream_append_response_text(ngx_http_request_t *r, ngx_chain_t ***last, const u_char *text, uint len)
+{
+    ngx_buf_t     *b;
+    ngx_chain_t   *out;
+
+    // empty parts are skipped, only the last buffer of the chain is flushed
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    if ((out = ngx_http_push_stream_get_buf(r)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    b = out->buf;
+
+    b->last_buf = 0;
+    b->last_in_chain = 0;
+    b->flush = 0;
+    b->memory = 1;
+    b->temporary = 0;
+    b->pos = (u_char *) text;
+    b->start = b->pos;
+    b->end = b->pos + len;
+    b->last = b->end;
+
+    out->next = NULL;
+    **last = out;
+    *last = &out->next;
+
+    return NGX_OK;
+}
+
+
 ngx_chain_t *
 ngx_http_push_stream_get_buf(ngx_http_request_t *r)
 {
@@ -668,12 +1078,25 @@ ngx_http_push_stream_output_filter(ngx_http_request_t *r, ngx_chain_t *in)
     c = r->connection;
     wev = c->write;
 
+#if (NGX_DEBUG)
+    // a slow subscriber must not hold the publishers of the channels sharing the mutex
+    if (ngx_http_push_stream_channel_locks_held > 0) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0, "push stream module: writing to a subscriber while holding a channel mutex");
+    }
+#endif
+
     rc = ngx_http_output_filter(r, in);
 
     if ((rc == NGX_OK) && (ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module)) != NULL) {
         ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &in, (ngx_buf_tag_t) &ngx_http_push_stream_module);
     }
 
+    // the buffers point to the formatted messages, they can only be released when nothing is pending to be written
+    if ((rc != NGX_ERROR) && (ctx != NULL) && (ctx->send_pool != NULL) && (ctx->busy == NULL) && (r->out == NULL) && !c->buffered) {
+        ngx_destroy_pool(ctx->send_pool);
+        ctx->send_pool = NULL;
+    }
+
     if (c->buffered & NGX_HTTP_LOWLEVEL_BUFFERED) {
 
         clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
@@ -836,21 +1259,33 @@ ngx_http_push_stream_send_response_text(ngx_http_request_t *r, const u_char *tex
 
 static ngx_int_t
 ngx_http_push_stream_send_response_padding(ngx_http_request_t *r, size_t len, ngx_flag_t sending_header)
+{
+    ngx_str_t *padding = ngx_http_push_stream_get_padding(r, len, sending_header);
+
+    if (padding != NULL) {
+        ngx_http_push_stream_send_response_text(r, padding->data, padding->len, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_str_t *
+ngx_http_push_stream_get_padding(ngx_http_request_t *r, size_t len, ngx_flag_t sending_header)
 {
     ngx_http_push_stream_module_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module);
     ngx_http_push_stream_loc_conf_t   *pslcf = ngx_http_get_module_loc_conf(r, ngx_http_push_stream_module);
     ngx_flag_t eventsource = (pslcf->location_type == NGX_HTTP_PUSH_STREAM_SUBSCRIBER_MODE_EVENTSOURCE);
 
-    if (ctx->padding != NULL) {
+    if ((ctx != NULL) && (ctx->padding != NULL)) {
         ngx_int_t diff = ((sending_header) ? ctx->padding->header_min_len : ctx->padding->message_min_len) - len;
         if (diff > 0) {
             ngx_int_t padding_index = diff / 100;
-            ngx_str_t *padding = eventsource ? ngx_http_push_stream_module_paddings_chunks_for_eventsource[padding_index] : ngx_http_push_stream_module_paddings_chunks[padding_index];
-            ngx_http_push_stream_send_response_text(r, padding->data, padding->len, 0);
+            return eventsource ? ngx_http_push_stream_module_paddings_chunks_for_eventsource[padding_index] : ngx_http_push_stream_module_paddings_chunks[padding_index];
         }
     }
 
-    return NGX_OK;
+    return NULL;
 }
 
 
@@ -963,9 +1398,10 @@ ngx_http_push_stream_delete_channel(ngx_http_push_stream_main_conf_t *mcf, ngx_h
         channel->deleted = 1;
         (channel->wildcard) ? NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->wildcard_channels) : NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->channels);
 
-        // remove channel from active tree and queue
-        ngx_rbtree_delete(&data->tree, &channel->node);
+        // remove channel from active index and queue
+        ngx_http_push_stream_channel_index_delete(data, channel);
         ngx_queue_remove(&channel->queue);
+        ngx_http_push_stream_unschedule_channel_expiry(data, channel);
     }
     ngx_shmtx_unlock(&data->channels_queue_mutex);
 
@@ -1012,6 +1448,12 @@ ngx_http_push_stream_collect_expired_messages_and_empty_channels_data(ngx_http_p
     ngx_queue_t                        *q;
     ngx_pool_t                         *temp_pool = NULL;
 
+    // only the channels due on the expiry wheel are checked, all of them when forced
+    if (!force) {
+        ngx_http_push_stream_expire_channels_data(data);
+        return;
+    }
+
     if (mcf->events_channel_id.len > 0) {
         if ((temp_pool = ngx_create_pool(4096, ngx_cycle->log)) == NULL) {
             ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: unable to allocate memory to temporary pool");
@@ -1019,30 +1461,216 @@ ngx_http_push_stream_collect_expired_messages_and_empty_channels_data(ngx_http_p
         }
     }
 
-    ngx_http_push_stream_collect_expired_messages_data(data, force);
+    ngx_http_push_stream_collect_expired_messages_data(data, force);
+
+    ngx_shmtx_lock(&data->channels_queue_mutex);
+    for (q = ngx_queue_head(&data->channels_queue); q != ngx_queue_sentinel(&data->channels_queue);) {
+        channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, queue);
+        q = ngx_queue_next(q);
+
+        if ((channel->stored_messages == 0) && (channel->subscribers == 0) && (channel->expires < ngx_time()) && !channel->for_events) {
+            ngx_http_push_stream_move_channel_to_trash_locked(data, channel);
+            ngx_http_push_stream_send_event(mcf, ngx_cycle->log, channel, &NGX_HTTP_PUSH_STREAM_EVENT_TYPE_CHANNEL_DESTROYED, temp_pool);
+        }
+    }
+    ngx_shmtx_unlock(&data->channels_queue_mutex);
+
+    if (temp_pool != NULL) {
+        ngx_destroy_pool(temp_pool);
+    }
+}
+
+
+// must be called with channels_queue_mutex locked
+static void
+ngx_http_push_stream_move_channel_to_trash_locked(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel)
+{
+    // once the wheel mutex is taken after the flag is set, the channel cannot be scheduled again
+    channel->deleted = 1;
+    ngx_http_push_stream_unschedule_channel_expiry(data, channel);
+    channel->expires = ngx_time() + NGX_HTTP_PUSH_STREAM_DEFAULT_SHM_MEMORY_CLEANUP_OBJECTS_TTL;
+    (channel->wildcard) ? NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->wildcard_channels) : NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->channels);
+
+    // move the channel to trash queue
+    ngx_http_push_stream_channel_index_delete(data, channel);
+    ngx_queue_remove(&channel->queue);
+    ngx_shmtx_lock(&data->channels_trash_mutex);
+    ngx_queue_insert_tail(&data->channels_trash, &channel->queue);
+    data->channels_in_trash++;
+    ngx_shmtx_unlock(&data->channels_trash_mutex);
+}
+
+
+void
+ngx_http_push_stream_schedule_channel_expiry(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, time_t expires)
+{
+    // most calls change nothing, like the ones on each publish, and are answered without the lock
+    if (channel->deleted || ((channel->expiry_time != 0) && (expires >= channel->expiry_time))) {
+        return;
+    }
+
+    ngx_shmtx_lock(&data->expiry_wheel_mutex);
+    // a channel is only moved to an earlier second, if it is checked too soon it is scheduled again
+    if (!channel->deleted && ((channel->expiry_time == 0) || (expires < channel->expiry_time))) {
+        if (channel->expiry_time != 0) {
+            ngx_queue_remove(&channel->expiry_queue);
+        }
+
+        channel->expiry_time = expires;
+        // seconds already processed are checked on the next one
+        expires = ngx_max(expires, data->expiry_wheel_time + 1);
+        ngx_queue_insert_tail(&data->expiry_wheel[expires & (NGX_HTTP_PUSH_STREAM_EXPIRY_WHEEL_SIZE - 1)], &channel->expiry_queue);
+    }
+    ngx_shmtx_unlock(&data->expiry_wheel_mutex);
+}
+
+
+void
+ngx_http_push_stream_unschedule_channel_expiry(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel)
+{
+    ngx_shmtx_lock(&data->expiry_wheel_mutex);
+    if (channel->expiry_time != 0) {
+        ngx_queue_remove(&channel->expiry_queue);
+        channel->expiry_time = 0;
+    }
+    ngx_shmtx_unlock(&data->expiry_wheel_mutex);
+}
+
+
+// seconds the oldest channel due for a check is waiting for it
+time_t
+ngx_http_push_stream_get_cleanup_lag(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_http_push_stream_channel_t     *channel;
+    time_t                              now = ngx_time(), lag = 0;
+
+    ngx_shmtx_lock(&data->expiry_wheel_mutex);
+    if (!ngx_queue_empty(&data->expired_channels)) {
+        channel = ngx_queue_data(ngx_queue_head(&data->expired_channels), ngx_http_push_stream_channel_t, expiry_queue);
+        lag = ngx_max(now - channel->expiry_time, 0);
+    }
+    ngx_shmtx_unlock(&data->expiry_wheel_mutex);
+
+    return lag;
+}
+
+
+// counters are updated without locks by each process on its own slot, the sum may miss an update in progress
+void
+ngx_http_push_stream_sum_worker_counters(ngx_http_push_stream_shm_data_t *data, ngx_uint_t *published_messages, ngx_uint_t *stored_messages, ngx_uint_t *subscribers)
+{
+    ngx_int_t                           published = 0, stored = 0;
+    int                                 i;
+
+    *subscribers = 0;
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        if (data->ipc[i] == NULL) {
+            continue;
+        }
+        published += data->ipc[i]->published_messages;
+        stored += data->ipc[i]->stored_messages;
+        if (data->ipc[i]->pid > 0) {
+            *subscribers += data->ipc[i]->subscribers;
+        }
+    }
+
+    *published_messages = ngx_max(published, 0);
+    *stored_messages = ngx_max(stored, 0);
+}
+
+
+static void
+ngx_http_push_stream_expire_channels_data(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_http_push_stream_main_conf_t   *mcf = data->mcf;
+    ngx_http_push_stream_channel_t     *channel;
+    ngx_http_push_stream_msg_t         *msg;
+    ngx_queue_t                        *q, *slot;
+    ngx_pool_t                         *temp_pool = NULL;
+    ngx_uint_t                          qtd_removed;
+    ngx_flag_t                          collected;
+    ngx_uint_t                          budget = ngx_http_push_stream_cleanup_budget(data, 0);
+    time_t                              now = ngx_time(), t, next;
+
+    // take the channels due until now from the slots not processed yet, a whole turn at most
+    ngx_shmtx_lock(&data->expiry_wheel_mutex);
+    t = ngx_max(data->expiry_wheel_time + 1, now - NGX_HTTP_PUSH_STREAM_EXPIRY_WHEEL_SIZE + 1);
+    for (; t <= now; t++) {
+        slot = &data->expiry_wheel[t & (NGX_HTTP_PUSH_STREAM_EXPIRY_WHEEL_SIZE - 1)];
+        for (q = ngx_queue_head(slot); q != ngx_queue_sentinel(slot);) {
+            channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, expiry_queue);
+            q = ngx_queue_next(q);
+
+            // channels due on a next turn of the wheel stay on the slot
+            if (channel->expiry_time <= now) {
+                ngx_queue_remove(&channel->expiry_queue);
+                ngx_queue_insert_tail(&data->expired_channels, &channel->expiry_queue);
+            }
+        }
+    }
+    data->expiry_wheel_time = ngx_max(data->expiry_wheel_time, now);
+    ngx_shmtx_unlock(&data->expiry_wheel_mutex);
+
+    // the channels not checked when the budget runs out wait on the expired queue for the next cleanup
+    for (; budget > 0; budget--) {
+        ngx_shmtx_lock(&data->expiry_wheel_mutex);
+        if (ngx_queue_empty(&data->expired_channels)) {
+            ngx_shmtx_unlock(&data->expiry_wheel_mutex);
+            break;
+        }
+        q = ngx_queue_head(&data->expired_channels);
+        channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, expiry_queue);
+        ngx_queue_remove(q);
+        channel->expiry_time = 0;
+        ngx_shmtx_unlock(&data->expiry_wheel_mutex);
 
-    ngx_shmtx_lock(&data->channels_queue_mutex);
-    for (q = ngx_queue_head(&data->channels_queue); q != ngx_queue_sentinel(&data->channels_queue);) {
-        channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, queue);
-        q = ngx_queue_next(q);
+        if (channel->deleted) {
+            continue;
+        }
 
-        if ((channel->stored_messages == 0) && (channel->subscribers == 0) && (channel->expires < ngx_time()) && !channel->for_events) {
-            channel->deleted = 1;
-            channel->expires = ngx_time() + NGX_HTTP_PUSH_STREAM_DEFAULT_SHM_MEMORY_CLEANUP_OBJECTS_TTL;
-            (channel->wildcard) ? NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->wildcard_channels) : NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->channels);
+        qtd_removed = ngx_http_push_stream_ensure_qtd_of_messages(data, channel, channel->stored_messages, 1);
 
-            // move the channel to trash queue
-            ngx_rbtree_delete(&data->tree, &channel->node);
-            ngx_queue_remove(&channel->queue);
-            ngx_shmtx_lock(&data->channels_trash_mutex);
-            ngx_queue_insert_tail(&data->channels_trash, &channel->queue);
-            data->channels_in_trash++;
-            ngx_shmtx_unlock(&data->channels_trash_mutex);
+        if (!channel->for_events && (data->ipc[ngx_process_slot] != NULL)) {
+            data->ipc[ngx_process_slot]->stored_messages -= qtd_removed;
+        }
+
+        collected = 0;
+        ngx_shmtx_lock(&data->channels_queue_mutex);
+        if (!channel->deleted && (channel->stored_messages == 0) && (channel->subscribers == 0) && (channel->expires < now) && !channel->for_events) {
+            ngx_http_push_stream_move_channel_to_trash_locked(data, channel);
+            collected = 1;
+        }
+        ngx_shmtx_unlock(&data->channels_queue_mutex);
 
+        if (collected) {
+            if ((mcf->events_channel_id.len > 0) && (temp_pool == NULL) && ((temp_pool = ngx_create_pool(4096, ngx_cycle->log)) == NULL)) {
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push stream module: unable to allocate memory to temporary pool");
+                continue;
+            }
             ngx_http_push_stream_send_event(mcf, ngx_cycle->log, channel, &NGX_HTTP_PUSH_STREAM_EVENT_TYPE_CHANNEL_DESTROYED, temp_pool);
+            continue;
+        }
+
+        // check the channel again when its oldest message expires, or when it may be inactive
+        ngx_http_push_stream_lock_channel(channel);
+        if (channel->stored_messages > 0) {
+            msg = ngx_http_push_stream_channel_stored_message(channel, 0);
+            next = (msg->expires > now) ? msg->expires : now + 1;
+        } else if (channel->for_events) {
+            // the events channel is never collected, it is scheduled again by its next message
+            next = 0;
+        } else if (channel->subscribers > 0) {
+            // the channel is scheduled again when its last subscriber leaves, this is only a safety net
+            next = now + mcf->channel_inactivity_time;
+        } else {
+            next = (channel->expires > now) ? channel->expires : now + 1;
+        }
+        ngx_http_push_stream_unlock_channel(channel);
+
+        if (next > 0) {
+            ngx_http_push_stream_schedule_channel_expiry(data, channel, next);
         }
     }
-    ngx_shmtx_unlock(&data->channels_queue_mutex);
 
     if (temp_pool != NULL) {
         ngx_destroy_pool(temp_pool);
@@ -1063,7 +1691,9 @@ ngx_http_push_stream_collect_expired_messages_data(ngx_http_push_stream_shm_data
         channel = ngx_queue_data(q, ngx_http_push_stream_channel_t, queue);
 
         qtd_removed = ngx_http_push_stream_ensure_qtd_of_messages(data, channel, (force) ? 0 : channel->stored_messages, 1);
-        NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER_BY(data->stored_messages, qtd_removed);
+        if (!channel->for_events && (data->ipc[ngx_process_slot] != NULL)) {
+            data->ipc[ngx_process_slot]->stored_messages -= qtd_removed;
+        }
     }
 
     ngx_shmtx_unlock(&data->channels_queue_mutex);
@@ -1075,14 +1705,17 @@ ngx_http_push_stream_free_memory_of_expired_channels(ngx_http_push_stream_shm_da
 {
     ngx_http_push_stream_channel_t         *channel;
     ngx_queue_t                            *cur;
+    ngx_uint_t                              budget = ngx_http_push_stream_cleanup_budget(data, force);
 
     ngx_shmtx_lock(&data->channels_trash_mutex);
-    while (!ngx_queue_empty(&data->channels_trash)) {
+    for (; (budget > 0) && !ngx_queue_empty(&data->channels_trash); budget--) {
         cur = ngx_queue_head(&data->channels_trash);
         channel = ngx_queue_data(cur, ngx_http_push_stream_channel_t, queue);
 
         if ((ngx_time() > channel->expires) || force) {
             ngx_queue_remove(&channel->queue);
+            // a channel still linked on the wheel would corrupt it once freed
+            ngx_http_push_stream_unschedule_channel_expiry(data, channel);
             nxg_http_push_stream_free_channel_memory(shpool, channel);
             NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->channels_in_trash);
         } else {
@@ -1099,20 +1732,29 @@ nxg_http_push_stream_free_channel_memory(ngx_slab_pool_t *shpool, ngx_http_push_
     // delete the worker-subscriber queue
     ngx_http_push_stream_pid_queue_t     *worker;
     ngx_queue_t                          *cur;
-    ngx_shmtx_t                          *mutex = channel->mutex;
+    ngx_http_push_stream_channel_mutex_t *mutex = channel->mutex;
 
     if (channel->channel_deleted_message != NULL) ngx_http_push_stream_free_message_memory(shpool, channel->channel_deleted_message);
-    ngx_shmtx_lock(mutex);
+    ngx_http_push_stream_lock_channel_mutex(mutex);
     while (!ngx_queue_empty(&channel->workers_with_subscribers)) {
         cur = ngx_queue_head(&channel->workers_with_subscribers);
         worker = ngx_queue_data(cur, ngx_http_push_stream_pid_queue_t, queue);
-        ngx_queue_remove(&worker->queue);
-        ngx_slab_free(shpool, worker);
+        ngx_http_push_stream_remove_channel_worker_sentinel_locked(channel, worker, shpool);
+    }
+
+    if (channel->workers_sentinels != NULL) {
+        ngx_slab_free(shpool, channel->workers_sentinels);
     }
 
+    if (channel->messages != NULL) {
+        ngx_slab_free(shpool, channel->messages);
+    }
+    if (channel->event_ids != NULL) {
+        ngx_slab_free(shpool, channel->event_ids);
+    }
     ngx_slab_free(shpool, channel->id.data);
     ngx_slab_free(shpool, channel);
-    ngx_shmtx_unlock(mutex);
+    ngx_http_push_stream_unlock_channel_mutex(mutex);
 }
 
 
@@ -1125,6 +1767,8 @@ ngx_http_push_stream_memory_cleanup(void)
     for (q = ngx_queue_head(&global_data->shm_datas_queue); q != ngx_queue_sentinel(&global_data->shm_datas_queue); q = ngx_queue_next(q)) {
         ngx_http_push_stream_shm_data_t *data = ngx_queue_data(q, ngx_http_push_stream_shm_data_t, shm_data_queue);
         ngx_http_push_stream_delete_channels_data(data);
+        ngx_http_push_stream_check_worker_inbox(data);
+        ngx_http_push_stream_discount_dead_workers(data);
         if (ngx_shmtx_trylock(&data->cleanup_mutex)) {
             ngx_http_push_stream_collect_deleted_channels_data(data);
             ngx_http_push_stream_collect_expired_messages_and_empty_channels_data(data, 0);
@@ -1147,7 +1791,7 @@ ngx_http_push_stream_buffer_cleanup(void)
     for (q = ngx_queue_head(&global_data->shm_datas_queue); q != ngx_queue_sentinel(&global_data->shm_datas_queue); q = ngx_queue_next(q)) {
         ngx_http_push_stream_shm_data_t *data = ngx_queue_data(q, ngx_http_push_stream_shm_data_t, shm_data_queue);
         if (ngx_shmtx_trylock(&data->cleanup_mutex)) {
-            ngx_http_push_stream_collect_expired_messages_data(data, 0);
+            ngx_http_push_stream_expire_channels_data(data);
             ngx_shmtx_unlock(&data->cleanup_mutex);
         }
     }
@@ -1177,13 +1821,14 @@ ngx_http_push_stream_free_memory_of_expired_messages_and_channels_data(ngx_http_
     ngx_slab_pool_t                        *shpool = data->shpool;
     ngx_http_push_stream_msg_t             *message;
     ngx_queue_t                            *cur;
+    ngx_uint_t                              budget = ngx_http_push_stream_cleanup_budget(data, force);
 
     ngx_shmtx_lock(&data->messages_trash_mutex);
-    while (!ngx_queue_empty(&data->messages_trash)) {
+    for (; (budget > 0) && !ngx_queue_empty(&data->messages_trash); budget--) {
         cur = ngx_queue_head(&data->messages_trash);
         message = ngx_queue_data(cur, ngx_http_push_stream_msg_t, queue);
 
-        if (force || ((message->workers_ref_count <= 0) && (ngx_time() > message->expires))) {
+        if (force || ((message->workers_ref_count == 0) && (ngx_time() > message->expires))) {
             ngx_queue_remove(&message->queue);
             ngx_http_push_stream_free_message_memory(shpool, message);
             NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->messages_in_trash);
@@ -1206,35 +1851,35 @@ ngx_http_push_stream_free_message_memory(ngx_slab_pool_t *shpool, ngx_http_push_
     }
 
     ngx_shmtx_lock(&shpool->mutex);
-    if (msg->formatted_messages != NULL) {
-        for (i = 0; i < msg->qtd_templates; i++) {
-            ngx_str_t *formmated = (msg->formatted_messages + i);
-            if ((formmated != NULL) && (formmated->data != NULL)) {
-                ngx_slab_free_locked(shpool, formmated->data);
-            }
+    // only the messages formatted after the message was created have their own blocks, all other texts are on the message block
+    for (i = 0; i < msg->qtd_templates; i++) {
+        ngx_str_t *formmated = (msg->formatted_messages + i);
+        if ((formmated->data != NULL) && ((formmated->data < (u_char *) msg) || (formmated->data > msg->raw.data))) {
+            ngx_slab_free_locked(shpool, formmated->data);
         }
-
-        ngx_slab_free_locked(shpool, msg->formatted_messages);
     }
 
-    if (msg->raw.data != NULL) ngx_slab_free_locked(shpool, msg->raw.data);
-    if (msg->event_id != NULL) ngx_slab_free_locked(shpool, msg->event_id);
-    if (msg->event_type != NULL) ngx_slab_free_locked(shpool, msg->event_type);
-    if (msg->event_id_message != NULL) ngx_slab_free_locked(shpool, msg->event_id_message);
-    if (msg->event_type_message != NULL) ngx_slab_free_locked(shpool, msg->event_type_message);
     ngx_slab_free_locked(shpool, msg);
     ngx_shmtx_unlock(&shpool->mutex);
 }
 
 
+static void
+ngx_http_push_stream_release_worker_message(ngx_http_push_stream_msg_t *msg)
+{
+    // the last worker releasing a discarded message starts its time on trash
+    if ((ngx_atomic_fetch_add(&msg->workers_ref_count, -1) == 1) && msg->deleted) {
+        msg->expires = ngx_time() + NGX_HTTP_PUSH_STREAM_DEFAULT_SHM_MEMORY_CLEANUP_OBJECTS_TTL;
+    }
+}
+
+
 static void
 ngx_http_push_stream_free_worker_message_memory(ngx_slab_pool_t *shpool, ngx_http_push_stream_worker_msg_t *worker_msg)
 {
+    ngx_http_push_stream_release_worker_message(worker_msg->msg);
+
     ngx_shmtx_lock(&shpool->mutex);
-    worker_msg->msg->workers_ref_count--;
-    if ((worker_msg->msg->workers_ref_count <= 0) && worker_msg->msg->deleted) {
-        worker_msg->msg->expires = ngx_time() + NGX_HTTP_PUSH_STREAM_DEFAULT_SHM_MEMORY_CLEANUP_OBJECTS_TTL;
-    }
     ngx_queue_remove(&worker_msg->queue);
     ngx_slab_free_locked(shpool, worker_msg);
     ngx_shmtx_unlock(&shpool->mutex);
@@ -1377,96 +2022,265 @@ ngx_http_push_stream_str_replace(const ngx_str_t *org, const ngx_str_t *find, co
 static ngx_str_t *
 ngx_http_push_stream_get_formatted_message(ngx_http_request_t *r, ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *message)
 {
+    ngx_http_push_stream_main_conf_t       *mcf = ngx_http_get_module_main_conf(r, ngx_http_push_stream_module);
     ngx_http_push_stream_loc_conf_t        *pslcf = ngx_http_get_module_loc_conf(r, ngx_http_push_stream_module);
-    if (pslcf->message_template_index > 0) {
-        return message->formatted_messages + pslcf->message_template_index - 1;
+    ngx_http_push_stream_template_t        *template;
+    ngx_str_t                              *formatted;
+    ngx_atomic_t                           *state;
+    ngx_atomic_uint_t                       current;
+    ngx_uint_t                              index, i;
+
+    if (pslcf->message_template_index <= 0) {
+        return &message->raw;
+    }
+
+    if ((template = pslcf->message_template_parsed) == NULL) {
+        return NULL;
+    }
+
+    index = pslcf->message_template_index - 1;
+    if (index >= message->qtd_templates) {
+        // the template was added on a reload after the message was created, there is no room for it on the message
+        return ngx_http_push_stream_apply_template_to_message(channel, message, template, ngx_http_push_stream_get_send_pool(r));
+    }
+
+    formatted = message->formatted_messages + index;
+    state = ngx_http_push_stream_formatted_message_state(message, index);
+
+    // the first worker needing the template formats the message on shared memory, the others wait for it
+    for (i = 0; i < NGX_HTTP_PUSH_STREAM_MESSAGE_FORMAT_ATTEMPTS; i++) {
+        if (*state == NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTED) {
+            ngx_memory_barrier();
+            return formatted;
+        }
+
+        if ((*state == NGX_HTTP_PUSH_STREAM_MESSAGE_NOT_FORMATTED) && ngx_atomic_cmp_set(state, NGX_HTTP_PUSH_STREAM_MESSAGE_NOT_FORMATTED, ngx_http_push_stream_formatting_state(ngx_pid))) {
+            if (ngx_http_push_stream_format_message_on_shared(mcf, channel, message, template, formatted, r->connection->log) != NGX_OK) {
+                *state = NGX_HTTP_PUSH_STREAM_MESSAGE_NOT_FORMATTED;
+                return NULL;
+            }
+
+            ngx_memory_barrier();
+            *state = NGX_HTTP_PUSH_STREAM_MESSAGE_FORMATTED;
+            return formatted;
+        }
+
+        ngx_sched_yield();
     }
-    return &message->raw;
+
+    // a worker that died while formatting the message would keep every other one waiting for it
+    current = *state;
+    if (ngx_http_push_stream_is_formatting(current) && (kill(ngx_http_push_stream_formatting_pid(current), 0) == -1) && (ngx_errno == NGX_ESRCH)) {
+        ngx_atomic_cmp_set(state, current, NGX_HTTP_PUSH_STREAM_MESSAGE_NOT_FORMATTED);
+    }
+
+    // the worker formatting the message is taking too long, do not hold this one
+    return ngx_http_push_stream_apply_template_to_message(channel, message, template, ngx_http_push_stream_get_send_pool(r));
 }
 
 
-static ngx_str_t *
-ngx_http_push_stream_format_message(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *message, ngx_str_t *text, ngx_http_push_stream_template_t *template, ngx_pool_t *temp_pool)
-{
-    u_char                    *last;
-    ngx_str_t                 *txt = NULL;
-    size_t                     len = 0;
-    ngx_queue_t               *q;
-    u_char                     id[NGX_INT_T_LEN + 1];
-    u_char                     tag[NGX_INT_T_LEN + 1];
-    u_char                     size[NGX_INT_T_LEN + 1];
-    u_char                     time[NGX_HTTP_PUSH_STREAM_TIME_FMT_LEN + 1];
-    size_t                     id_len, tag_len, time_len, size_len;
-
-    ngx_str_t *channel_id = (channel != NULL) ? &channel->id : &NGX_HTTP_PUSH_STREAM_EMPTY;
-    ngx_str_t *event_id = (message->event_id != NULL) ? message->event_id : &NGX_HTTP_PUSH_STREAM_EMPTY;
-    ngx_str_t *event_type = (message->event_type != NULL) ? message->event_type : &NGX_HTTP_PUSH_STREAM_EMPTY;
-
-    ngx_sprintf(id, "%d%Z", message->id);
-    id_len = ngx_strlen(id);
-
-    last = ngx_http_time(time, message->time);
-    time_len = last - time;
-
-    ngx_sprintf(tag, "%d%Z", message->tag);
-    tag_len = ngx_strlen(tag);
-
-    ngx_sprintf(size, "%d%Z", text->len);
-    size_len = ngx_strlen(size);
-
-    len += template->qtd_channel * channel_id->len;
-    len += template->qtd_event_id * event_id->len;
-    len += template->qtd_event_type * event_type->len;
-    len += template->qtd_message_id * id_len;
-    len += template->qtd_time * time_len;
-    len += template->qtd_tag * tag_len;
-    len += template->qtd_text * text->len;
-    len += template->qtd_size * size_len;
-    len += template->literal_len;
-
-    txt = ngx_http_push_stream_create_str(temp_pool, len);
-    if (txt == NULL) {
-        ngx_log_error(NGX_LOG_ERR, temp_pool->log, 0, "push stream module: unable to allocate memory to format message");
-        return NULL;
+static ngx_pool_t *
+ngx_http_push_stream_get_send_pool(ngx_http_request_t *r)
+{
+    ngx_http_push_stream_module_ctx_t      *ctx = ngx_http_get_module_ctx(r, ngx_http_push_stream_module);
+
+    // a long lived connection would keep each message formatted for it on the request pool until it is closed
+    if (ctx == NULL) {
+        return r->pool;
+    }
+
+    if ((ctx->send_pool == NULL) && ((ctx->send_pool = ngx_create_pool(4096, r->connection->log)) == NULL)) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: unable to allocate memory for temporary pool");
+        return r->pool;
+    }
+
+    return ctx->send_pool;
+}
+
+
+static void
+ngx_http_push_stream_prepare_template_fields(ngx_http_push_stream_channel_t *channel, ngx_http_push_stream_msg_t *message, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields)
+{
+    fields->channel_id = (channel != NULL) ? &channel->id : &NGX_HTTP_PUSH_STREAM_EMPTY;
+    fields->event_id = (message->event_id != NULL) ? message->event_id : &NGX_HTTP_PUSH_STREAM_EMPTY;
+    fields->event_type = (message->event_type != NULL) ? message->event_type : &NGX_HTTP_PUSH_STREAM_EMPTY;
+    fields->id_len = 0;
+    fields->tag_len = 0;
+    fields->time = NULL;
+    fields->time_len = 0;
+
+    // only the fields used by the template are formatted
+    if (template->qtd_message_id > 0) {
+        fields->id_len = ngx_sprintf(fields->id, "%d", message->id) - fields->id;
+    }
+
+    if (template->qtd_time > 0) {
+        fields->time = ngx_http_push_stream_get_formatted_time(message->time);
+        fields->time_len = fields->time->http_time_len;
+    }
+
+    if (template->qtd_tag > 0) {
+        fields->tag_len = ngx_sprintf(fields->tag, "%d", message->tag) - fields->tag;
+    }
+
+    fields->fixed_len = template->literal_len;
+    fields->fixed_len += template->qtd_channel * fields->channel_id->len;
+    fields->fixed_len += template->qtd_event_id * fields->event_id->len;
+    fields->fixed_len += template->qtd_event_type * fields->event_type->len;
+    fields->fixed_len += template->qtd_message_id * fields->id_len;
+    fields->fixed_len += template->qtd_time * fields->time_len;
+    fields->fixed_len += template->qtd_tag * fields->tag_len;
+}
+
+
+static size_t
+ngx_http_push_stream_formatted_text_len(ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, size_t len)
+{
+    size_t                     size_len = 1, n;
+
+    for (n = len; n >= 10; n /= 10) {
+        size_len++;
     }
 
-    last = txt->data;
-    for (q = ngx_queue_head(&template->parts); q != ngx_queue_sentinel(&template->parts); q = ngx_queue_next(q)) {
-        ngx_http_push_stream_template_parts_t *cur = ngx_queue_data(q, ngx_http_push_stream_template_parts_t, queue);
-        switch (cur->kind) {
+    return fields->fixed_len + (template->qtd_text * len) + ((template->qtd_size > 0) ? template->qtd_size * size_len : 0);
+}
+
+
+static u_char *
+ngx_http_push_stream_write_formatted_text(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, u_char *text, size_t len)
+{
+    ngx_http_push_stream_template_op_t *op, *end;
+
+    for (op = template->ops, end = template->ops + template->qtd_ops; op < end; op++) {
+        switch (op->kind) {
             case PUSH_STREAM_TEMPLATE_PART_TYPE_CHANNEL:
-                last = ngx_cpymem(last, channel_id->data, channel_id->len);
+                last = ngx_cpymem(last, fields->channel_id->data, fields->channel_id->len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_EVENT_ID:
-                last = ngx_cpymem(last, event_id->data, event_id->len);
+                last = ngx_cpymem(last, fields->event_id->data, fields->event_id->len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_EVENT_TYPE:
-                last = ngx_cpymem(last, event_type->data, event_type->len);
+                last = ngx_cpymem(last, fields->event_type->data, fields->event_type->len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_ID:
-                last = ngx_cpymem(last, id, id_len);
+                last = ngx_cpymem(last, fields->id, fields->id_len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_LITERAL:
-                last = ngx_cpymem(last, cur->text.data, cur->text.len);
+                last = ngx_cpymem(last, op->text.data, op->text.len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_TAG:
-                last = ngx_cpymem(last, tag, tag_len);
+                last = ngx_cpymem(last, fields->tag, fields->tag_len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_TEXT:
-                last = ngx_cpymem(last, text->data, text->len);
+                last = ngx_cpymem(last, text, len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_SIZE:
-                last = ngx_cpymem(last, size, size_len);
+                last = ngx_sprintf(last, "%uz", len);
                 break;
             case PUSH_STREAM_TEMPLATE_PART_TYPE_TIME:
-                last = ngx_cpymem(last, time, time_len);
+                last = ngx_cpymem(last, fields->time->http_time, fields->time_len);
                 break;
             default:
                 break;
         }
     }
 
-    return txt;
+    return last;
+}
+
+
+// next CR, LF or CRLF from start, the position of each byte is searched again only after it is passed
+static u_char *
+ngx_http_push_stream_next_line_break(u_char *start, u_char *end, u_char **cr, u_char **lf, size_t *step)
+{
+    u_char                    *pos;
+
+    if (*cr < start) {
+        *cr = memchr(start, '\r', end - start);
+        *cr = (*cr != NULL) ? *cr : end;
+    }
+
+    if (*lf < start) {
+        *lf = memchr(start, '\n', end - start);
+        *lf = (*lf != NULL) ? *lf : end;
+    }
+
+    pos = ngx_min(*cr, *lf);
+    *step = ((pos == *cr) && (pos + 1 < end) && (pos[1] == '\n')) ? 2 : 1;
+
+    return pos;
+}
+
+
+// each non empty line of the text is formatted with the template, and the event ends with an empty line
+static size_t
+ngx_http_push_stream_formatted_eventsource_len(ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text)
+{
+    u_char                    *start = text->data, *end = text->data + text->len, *cr = NULL, *lf = NULL, *pos;
+    size_t                     len = 1, step;
+
+    while (start < end) {
+        pos = ngx_http_push_stream_next_line_break(start, end, &cr, &lf, &step);
+        if (pos > start) {
+            len += ngx_http_push_stream_formatted_text_len(template, fields, pos - start);
+        }
+        start = pos + step;
+    }
+
+    return len;
+}
+
+
+static u_char *
+ngx_http_push_stream_write_formatted_eventsource(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text)
+{
+    u_char                    *start = text->data, *end = text->data + text->len, *cr = NULL, *lf = NULL, *pos;
+    size_t                     step;
+
+    while (start < end) {
+        pos = ngx_http_push_stream_next_line_break(start, end, &cr, &lf, &step);
+        if (pos > start) {
+            last = ngx_http_push_stream_write_formatted_text(last, template, fields, start, pos - start);
+        }
+        start = pos + step;
+    }
+
+    *last++ = '\n';
+
+    return last;
+}
+
+
+static size_t
+ngx_http_push_stream_formatted_message_len(ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text)
+{
+    return template->eventsource ? ngx_http_push_stream_formatted_eventsource_len(template, fields, text) : ngx_http_push_stream_formatted_text_len(template, fields, text->len);
+}
+
+
+static u_char *
+ngx_http_push_stream_write_formatted_message(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text)
+{
+    return template->eventsource ? ngx_http_push_stream_write_formatted_eventsource(last, template, fields, text) : ngx_http_push_stream_write_formatted_text(last, template, fields, text->data, text->len);
+}
+
+
+// the formatted message plus the websocket frame header, when the template is used by websocket subscribers
+static size_t
+ngx_http_push_stream_framed_message_len(ngx_http_push_stream_template_t *template, size_t len)
+{
+    return template->websocket ? ngx_http_push_stream_websocket_frame_header_len(sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE), len) + len : len;
+}
+
+
+static u_char *
+ngx_http_push_stream_write_framed_message(u_char *last, ngx_http_push_stream_template_t *template, ngx_http_push_stream_template_fields_t *fields, ngx_str_t *text, size_t len)
+{
+    if (template->websocket) {
+        last = ngx_http_push_stream_write_websocket_frame_header(last, &NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_LAST_FRAME_BYTE), len);
+    }
+
+    return ngx_http_push_stream_write_formatted_message(last, template, fields, text);
 }
 
 
@@ -1495,6 +2309,7 @@ ngx_http_push_stream_add_request_context(ngx_http_request_t *r)
 
     ctx->busy = NULL;
     ctx->free = NULL;
+    ctx->send_pool = NULL;
     ctx->disconnect_timer = NULL;
     ctx->ping_timer = NULL;
     ctx->subscriber = NULL;
@@ -1538,7 +2353,12 @@ ngx_http_push_stream_cleanup_request_context(ngx_http_request_t *r)
             ngx_destroy_pool(ctx->temp_pool);
         }
 
+        if (ctx->send_pool != NULL) {
+            ngx_destroy_pool(ctx->send_pool);
+        }
+
         ctx->temp_pool = NULL;
+        ctx->send_pool = NULL;
         ctx->disconnect_timer = NULL;
         ctx->ping_timer = NULL;
         ctx->subscriber = NULL;
@@ -1551,27 +2371,34 @@ ngx_http_push_stream_worker_subscriber_cleanup(ngx_http_push_stream_subscriber_t
 {
     ngx_http_push_stream_main_conf_t        *mcf = ngx_http_get_module_main_conf(worker_subscriber->request, ngx_http_push_stream_module);
     ngx_http_push_stream_shm_data_t         *data = mcf->shm_data;
-    ngx_slab_pool_t                         *shpool = mcf->shpool;
     ngx_queue_t                             *cur;
 
     while (!ngx_queue_empty(&worker_subscriber->subscriptions)) {
         cur = ngx_queue_head(&worker_subscriber->subscriptions);
         ngx_http_push_stream_subscription_t *subscription = ngx_queue_data(cur, ngx_http_push_stream_subscription_t, queue);
-        ngx_shmtx_lock(subscription->channel->mutex);
+        ngx_http_push_stream_lock_channel(subscription->channel);
         NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(subscription->channel->subscribers);
         NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(subscription->channel_worker_sentinel->subscribers);
         ngx_queue_remove(&subscription->channel_worker_queue);
         ngx_queue_remove(&subscription->queue);
-        ngx_shmtx_unlock(subscription->channel->mutex);
+        ngx_http_push_stream_unlock_channel(subscription->channel);
+
+        // the channel may be collected once its last subscriber leaves
+        if (subscription->channel->subscribers == 0) {
+            ngx_http_push_stream_schedule_channel_expiry(data, subscription->channel, subscription->channel->expires);
+        }
 
         ngx_http_push_stream_send_event(mcf, ngx_cycle->log, subscription->channel, &NGX_HTTP_PUSH_STREAM_EVENT_TYPE_CLIENT_UNSUBSCRIBED, worker_subscriber->request->pool);
     }
 
-    ngx_shmtx_lock(&shpool->mutex);
+    // only this worker changes its queue and counter
     ngx_queue_remove(&worker_subscriber->worker_queue);
-    NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->subscribers);
-    NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->ipc[ngx_process_slot].subscribers);
-    ngx_shmtx_unlock(&shpool->mutex);
+    NGX_HTTP_PUSH_STREAM_DECREMENT_COUNTER(data->ipc[ngx_process_slot]->subscribers);
+
+    if (worker_subscriber->template_subscribers != NULL) {
+        ngx_atomic_fetch_add(worker_subscriber->template_subscribers, -1);
+        worker_subscriber->template_subscribers = NULL;
+    }
 }
 
 
@@ -1606,13 +2433,11 @@ ngx_http_push_stream_match_channel_info_format_and_content_type(ngx_http_request
 static ngx_str_t *
 ngx_http_push_stream_get_formatted_current_time(ngx_pool_t *pool)
 {
-    ngx_tm_t                            tm;
     ngx_str_t                          *currenttime;
 
-    currenttime = ngx_http_push_stream_create_str(pool, 19); //ISO 8601 pattern
+    currenttime = ngx_http_push_stream_create_str(pool, NGX_HTTP_PUSH_STREAM_ISO_8601_LEN);
     if (currenttime != NULL) {
-        ngx_gmtime(ngx_time(), &tm);
-        ngx_sprintf(currenttime->data, (char *) NGX_HTTP_PUSH_STREAM_DATE_FORMAT_ISO_8601.data, tm.ngx_tm_year, tm.ngx_tm_mon, tm.ngx_tm_mday, tm.ngx_tm_hour, tm.ngx_tm_min, tm.ngx_tm_sec);
+        ngx_memcpy(currenttime->data, ngx_http_push_stream_get_formatted_time(ngx_time())->iso_8601, NGX_HTTP_PUSH_STREAM_ISO_8601_LEN);
     } else {
         currenttime = &NGX_HTTP_PUSH_STREAM_EMPTY;
     }
@@ -1620,6 +2445,24 @@ ngx_http_push_stream_get_formatted_current_time(ngx_pool_t *pool)
     return currenttime;
 }
 
+
+// messages are formatted mostly with the time of the last seconds, each one is formatted once
+static ngx_http_push_stream_time_cache_t *
+ngx_http_push_stream_get_formatted_time(time_t sec)
+{
+    ngx_http_push_stream_time_cache_t  *cached = &ngx_http_push_stream_time_cache[sec & (NGX_HTTP_PUSH_STREAM_TIME_CACHE_SIZE - 1)];
+    ngx_tm_t                            tm;
+
+    if ((cached->http_time_len == 0) || (cached->sec != sec)) {
+        cached->sec = sec;
+        cached->http_time_len = ngx_http_time(cached->http_time, sec) - cached->http_time;
+        ngx_gmtime(sec, &tm);
+        ngx_sprintf(cached->iso_8601, (char *) NGX_HTTP_PUSH_STREAM_DATE_FORMAT_ISO_8601.data, tm.ngx_tm_year, tm.ngx_tm_mon, tm.ngx_tm_mday, tm.ngx_tm_hour, tm.ngx_tm_min, tm.ngx_tm_sec);
+    }
+
+    return cached;
+}
+
 static ngx_str_t *
 ngx_http_push_stream_get_formatted_hostname(ngx_pool_t *pool)
 {
@@ -1670,19 +2513,7 @@ ngx_http_push_stream_get_formatted_websocket_frame(const u_char *opcode, off_t o
 
     frame = ngx_http_push_stream_create_str(temp_pool, NGX_HTTP_PUSH_STREAM_WEBSOCKET_FRAME_HEADER_MAX_LENGTH + len);
     if (frame != NULL) {
-        last = ngx_copy(frame->data, opcode, opcode_len);
-
-        if (len <= 125) {
-            last = ngx_copy(last, &len, 1);
-        } else if (len < (1 << 16)) {
-            last = ngx_copy(last, &NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_16_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_16_BYTE));
-            uint16_t len_net = htons(len);
-            last = ngx_copy(last, &len_net, 2);
-        } else {
-            last = ngx_copy(last, &NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_64_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_64_BYTE));
-            uint64_t len_net = ngx_http_push_stream_htonll(len);
-            last = ngx_copy(last, &len_net, 8);
-        }
+        last = ngx_http_push_stream_write_websocket_frame_header(frame->data, opcode, opcode_len, len);
         last = ngx_copy(last, text, len);
         frame->len = last - frame->data;
     }
@@ -1690,6 +2521,34 @@ ngx_http_push_stream_get_formatted_websocket_frame(const u_char *opcode, off_t o
 }
 
 
+static size_t
+ngx_http_push_stream_websocket_frame_header_len(off_t opcode_len, off_t len)
+{
+    return opcode_len + ((len <= 125) ? 1 : ((len < (1 << 16)) ? 3 : 9));
+}
+
+
+static u_char *
+ngx_http_push_stream_write_websocket_frame_header(u_char *last, const u_char *opcode, off_t opcode_len, off_t len)
+{
+    last = ngx_copy(last, opcode, opcode_len);
+
+    if (len <= 125) {
+        last = ngx_copy(last, &len, 1);
+    } else if (len < (1 << 16)) {
+        last = ngx_copy(last, &NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_16_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_16_BYTE));
+        uint16_t len_net = htons(len);
+        last = ngx_copy(last, &len_net, 2);
+    } else {
+        last = ngx_copy(last, &NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_64_BYTE, sizeof(NGX_HTTP_PUSH_STREAM_WEBSOCKET_PAYLOAD_LEN_64_BYTE));
+        uint64_t len_net = ngx_http_push_stream_htonll(len);
+        last = ngx_copy(last, &len_net, 8);
+    }
+
+    return last;
+}
+
+
 static ngx_str_t *
 ngx_http_push_stream_create_str(ngx_pool_t *pool, uint len)
 {
@@ -2375,10 +3234,48 @@ ngx_http_push_stream_create_shmtx(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char
 }
 
 
+ngx_int_t
+ngx_http_push_stream_create_channel_mutex(ngx_http_push_stream_channel_mutex_t *mutex, u_char *name)
+{
+    mutex->acquisitions = 0;
+    mutex->contentions = 0;
+
+    return ngx_http_push_stream_create_shmtx(&mutex->mutex, &mutex->lock, name);
+}
+
+
+void
+ngx_http_push_stream_lock_channel_mutex(ngx_http_push_stream_channel_mutex_t *mutex)
+{
+    if (!ngx_shmtx_trylock(&mutex->mutex)) {
+        ngx_atomic_fetch_add(&mutex->contentions, 1);
+        ngx_shmtx_lock(&mutex->mutex);
+    }
+
+    mutex->acquisitions++;
+
+#if (NGX_DEBUG)
+    ngx_http_push_stream_channel_locks_held++;
+#endif
+}
+
+
+void
+ngx_http_push_stream_unlock_channel_mutex(ngx_http_push_stream_channel_mutex_t *mutex)
+{
+#if (NGX_DEBUG)
+    ngx_http_push_stream_channel_locks_held--;
+#endif
+
+    ngx_shmtx_unlock(&mutex->mutex);
+}
+
+
 ngx_flag_t
 ngx_http_push_stream_is_utf8(u_char *p, size_t n)
 {
-    u_char  c, *last;
+    u_char    c, *last;
+    uint64_t  word;
 
     last = p + n;
 
@@ -2387,11 +3284,20 @@ ngx_http_push_stream_is_utf8(u_char *p, size_t n)
         c = *p;
 
         if (c < 0x80) {
+            // skip the ASCII bytes a word at a time
+            if (last - p >= 8) {
+                ngx_memcpy(&word, p, 8);
+                if ((word & 0x8080808080808080ULL) == 0) {
+                    p += 8;
+                    continue;
+                }
+            }
+
             p++;
             continue;
         }
 
-        if (ngx_utf8_decode(&p, n) > 0x10ffff) {
+        if (ngx_utf8_decode(&p, last - p) > 0x10ffff) {
             /* invalid UTF-8 */
             return 0;
         }
@@ -2399,3 +3305,128 @@ ngx_http_push_stream_is_utf8(u_char *p, size_t n)
 
     return 1;
 }
+
+
+// the payload is unmasked and checked for ASCII on the same pass, only what follows the first non ASCII block is decoded
+ngx_flag_t
+ngx_http_push_stream_unmask_and_check_utf8(u_char *p, size_t n, u_char *mask_key)
+{
+    size_t                     ascii = ngx_http_push_stream_unmask_ascii(p, n, mask_key);
+
+    return (ascii == n) || ngx_http_push_stream_is_utf8(p + ascii, n - ascii);
+}
+
+
+void
+ngx_http_push_stream_select_unmask_implementation(ngx_log_t *log)
+{
+#if (NGX_HTTP_PUSH_STREAM_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ngx_http_push_stream_unmask_ascii = ngx_http_push_stream_unmask_ascii_avx2;
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "push stream module: unmasking websocket payloads with avx2");
+        return;
+    }
+#endif
+
+#if (NGX_HTTP_PUSH_STREAM_HAVE_SSE2)
+    ngx_http_push_stream_unmask_ascii = ngx_http_push_stream_unmask_ascii_sse2;
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "push stream module: unmasking websocket payloads with sse2");
+#else
+    ngx_http_push_stream_unmask_ascii = ngx_http_push_stream_unmask_ascii_word;
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "push stream module: unmasking websocket payloads by words");
+#endif
+}
+
+
+// the blocks start at multiples of 4 bytes, so the mask key repeated on the whole block lines up with the payload
+static size_t
+ngx_http_push_stream_unmask_ascii_word(u_char *p, size_t n, u_char *mask_key)
+{
+    uint32_t                   key = 0;
+    uint64_t                   mask, word;
+    size_t                     i, ascii = n;
+
+    if (mask_key != NULL) {
+        ngx_memcpy(&key, mask_key, 4);
+    }
+
+    mask = ((uint64_t) key << 32) | key;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        ngx_memcpy(&word, p + i, 8);
+        word ^= mask;
+        ngx_memcpy(p + i, &word, 8);
+        if ((ascii == n) && (word & 0x8080808080808080ULL)) {
+            ascii = i;
+        }
+    }
+
+    for (; i < n; i++) {
+        p[i] ^= ((u_char *) &key)[i % 4];
+        if ((ascii == n) && (p[i] & 0x80)) {
+            ascii = i;
+        }
+    }
+
+    return ascii;
+}
+
+
+#if (NGX_HTTP_PUSH_STREAM_HAVE_SSE2)
+static size_t
+ngx_http_push_stream_unmask_ascii_sse2(u_char *p, size_t n, u_char *mask_key)
+{
+    uint32_t                   key = 0;
+    __m128i                    mask, block;
+    size_t                     i, ascii = n, tail;
+
+    if (mask_key != NULL) {
+        ngx_memcpy(&key, mask_key, 4);
+    }
+
+    mask = _mm_set1_epi32((int) key);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        block = _mm_xor_si128(_mm_loadu_si128((__m128i *) (p + i)), mask);
+        _mm_storeu_si128((__m128i *) (p + i), block);
+        if ((ascii == n) && _mm_movemask_epi8(block)) {
+            ascii = i;
+        }
+    }
+
+    tail = ngx_http_push_stream_unmask_ascii_word(p + i, n - i, mask_key);
+
+    return (ascii < n) ? ascii : i + tail;
+}
+#endif
+
+
+#if (NGX_HTTP_PUSH_STREAM_HAVE_AVX2)
+__attribute__((target("avx2")))
+static size_t
+ngx_http_push_stream_unmask_ascii_avx2(u_char *p, size_t n, u_char *mask_key)
+{
+    uint32_t                   key = 0;
+    __m256i                    mask, block;
+    size_t                     i, ascii = n, tail;
+
+    if (mask_key != NULL) {
+        ngx_memcpy(&key, mask_key, 4);
+    }
+
+    mask = _mm256_set1_epi32((int) key);
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        block = _mm256_xor_si256(_mm256_loadu_si256((__m256i *) (p + i)), mask);
+        _mm256_storeu_si256((__m256i *) (p + i), block);
+        if ((ascii == n) && _mm256_movemask_epi8(block)) {
+            ascii = i;
+        }
+    }
+
+    tail = ngx_http_push_stream_unmask_ascii_sse2(p + i, n - i, mask_key);
+
+    return (ascii < n) ? ascii : i + tail;
+}
+#endif
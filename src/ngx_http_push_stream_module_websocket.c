@@ -189,9 +189,8 @@ ngx_http_push_stream_websocket_reading(ngx_http_request_t *r)
     ngx_int_t                          rc = NGX_OK;
     ngx_event_t                       *rev;
     ngx_connection_t                  *c;
-    uint64_t                           i;
     ngx_queue_t                       *q;
-    u_char                            *aux, *last;
+    size_t                             ascii;
     unsigned char                      opcode;
 
     ngx_http_push_stream_set_buffer(&ctx->frame->buf, ctx->frame->buf.start, ctx->frame->buf.last, 0);
@@ -279,6 +278,11 @@ ngx_http_push_stream_websocket_reading(ngx_http_request_t *r)
                     uint64_t len;
                     ngx_memcpy(&len, ctx->frame->header, 8);
                     ctx->frame->payload_len = ngx_http_push_stream_ntohll(len);
+                    // the most significant bit of a 64 bits length must be 0
+                    if (ctx->frame->payload_len & 0x8000000000000000ULL) {
+                        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: invalid websocket frame length");
+                        goto close;
+                    }
                 }
 
                 if (ctx->frame->mask) {
@@ -321,7 +325,25 @@ ngx_http_push_stream_websocket_reading(ngx_http_request_t *r)
                     }
 
                     if (ctx->frame->payload == NULL) {
-                        if ((ctx->frame->payload = ngx_pcalloc(ctx->temp_pool, ctx->frame->payload_len)) == NULL) {
+                        if (ctx->frame->payload_len > NGX_MAX_SIZE_T_VALUE - ctx->frame->consolidated.len) {
+                            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: websocket message too big to be received");
+                            goto close;
+                        }
+
+                        if ((cf->websocket_max_message_size > 0) && (ctx->frame->payload_len > cf->websocket_max_message_size - ctx->frame->consolidated.len)) {
+                            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: websocket message bigger than %uz bytes", cf->websocket_max_message_size);
+                            goto close;
+                        }
+
+                        if (ctx->frame->fragmented) {
+                            // the fragment is received straight at the end of the message being reassembled
+                            if (ngx_http_push_stream_reserve_websocket_message(ctx->frame, ctx->frame->payload_len, cf->websocket_max_message_size, ctx->temp_pool) != NGX_OK) {
+                                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: unable to allocate memory for consolidated payload for %uL bytes", ctx->frame->consolidated.len + ctx->frame->payload_len);
+                                goto finalize;
+                            }
+
+                            ctx->frame->payload = ctx->frame->consolidated.data + ctx->frame->consolidated.len;
+                        } else if ((ctx->frame->payload = ngx_palloc(ctx->temp_pool, ctx->frame->payload_len)) == NULL) {
                             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: unable to allocate memory for payload");
                             goto finalize;
                         }
@@ -333,48 +355,37 @@ ngx_http_push_stream_websocket_reading(ngx_http_request_t *r)
                         goto exit;
                     }
 
-                    if (ctx->frame->mask) {
-                        for (i = 0; i < ctx->frame->payload_len; i++) {
-                            ctx->frame->payload[i] = ctx->frame->payload[i] ^ ctx->frame->mask_key[i % 4];
+                    if (ctx->frame->fragmented) {
+                        // a character may be split between fragments, the message is checked as a whole on the last one
+                        ascii = ngx_http_push_stream_unmask_ascii(ctx->frame->payload, ctx->frame->payload_len, ctx->frame->mask ? ctx->frame->mask_key : NULL);
+                        if (ctx->frame->consolidated_ascii_len == ctx->frame->consolidated.len) {
+                            ctx->frame->consolidated_ascii_len += ascii;
                         }
+                        ctx->frame->consolidated.len += ctx->frame->payload_len;
+                    } else if (!ngx_http_push_stream_unmask_and_check_utf8(ctx->frame->payload, ctx->frame->payload_len, ctx->frame->mask ? ctx->frame->mask_key : NULL)) {
+                        goto finalize;
                     }
+                }
 
-                    if (!ngx_http_push_stream_is_utf8(ctx->frame->payload, ctx->frame->payload_len)) {
+                if (ctx->frame->fragmented && ctx->frame->last_fragment) {
+                    if (!ngx_http_push_stream_is_utf8(ctx->frame->consolidated.data + ctx->frame->consolidated_ascii_len, ctx->frame->consolidated.len - ctx->frame->consolidated_ascii_len)) {
                         goto finalize;
                     }
 
-                    if (ctx->frame->fragmented) {
-                        if (ctx->frame->consolidated.len == 0) {
-                            ctx->frame->consolidated.data = ctx->frame->payload;
-                            ctx->frame->consolidated.len = ctx->frame->payload_len;
-                        } else {
-                            if ((aux = ngx_pcalloc(ctx->temp_pool, ctx->frame->payload_len + ctx->frame->consolidated.len)) == NULL) {
-                                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push stream module: unable to allocate memory for consolidated payload for %ui bytes", ctx->frame->payload_len + ctx->frame->consolidated.len);
-                                goto finalize;
-                            }
-                            last = ngx_cpymem(aux, ctx->frame->consolidated.data, ctx->frame->consolidated.len);
-                            ngx_memcpy(last, ctx->frame->payload, ctx->frame->payload_len);
-                            ctx->frame->consolidated.data = aux;
-                            ctx->frame->consolidated.len = ctx->frame->payload_len + ctx->frame->consolidated.len;
-                        }
+                    ctx->frame->payload = ctx->frame->consolidated.data;
+                    ctx->frame->payload_len = ctx->frame->consolidated.len;
+                }
 
-                        if (ctx->frame->last_fragment) {
-                            ctx->frame->payload = ctx->frame->consolidated.data;
-                            ctx->frame->payload_len = ctx->frame->consolidated.len;
+                if (cf->websocket_allow_publish && ctx->frame->last_fragment && (ctx->frame->payload_len > 0) && (ctx->frame->opcode == NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_OPCODE)) {
+                    for (q = ngx_queue_head(&ctx->subscriber->subscriptions); q != ngx_queue_sentinel(&ctx->subscriber->subscriptions); q = ngx_queue_next(q)) {
+                        ngx_http_push_stream_subscription_t *subscription = ngx_queue_data(q, ngx_http_push_stream_subscription_t, queue);
+                        if (subscription->channel->for_events) {
+                            // skip events channel on publish by websocket connections
+                            continue;
                         }
-                    }
 
-                    if (cf->websocket_allow_publish && ctx->frame->last_fragment && (ctx->frame->opcode == NGX_HTTP_PUSH_STREAM_WEBSOCKET_TEXT_OPCODE)) {
-                        for (q = ngx_queue_head(&ctx->subscriber->subscriptions); q != ngx_queue_sentinel(&ctx->subscriber->subscriptions); q = ngx_queue_next(q)) {
-                            ngx_http_push_stream_subscription_t *subscription = ngx_queue_data(q, ngx_http_push_stream_subscription_t, queue);
-                            if (subscription->channel->for_events) {
-                                // skip events channel on publish by websocket connections
-                                continue;
-                            }
-
-                            if (ngx_http_push_stream_add_msg_to_channel(mcf, r->connection->log, subscription->channel, ctx->frame->payload, ctx->frame->payload_len, NULL, NULL, cf->store_messages, ctx->temp_pool) != NGX_OK) {
-                                goto finalize;
-                            }
+                        if (ngx_http_push_stream_add_msg_to_channel(mcf, r->connection->log, subscription->channel, ctx->frame->payload, ctx->frame->payload_len, NULL, NULL, cf->store_messages, ctx->temp_pool) != NGX_OK) {
+                            goto finalize;
                         }
                     }
                 }
@@ -383,6 +394,8 @@ ngx_http_push_stream_websocket_reading(ngx_http_request_t *r)
                     ctx->frame->last_fragment = 0;
                     ctx->frame->fragmented = 0;
                     ngx_str_set(&ctx->frame->consolidated, "");
+                    ctx->frame->consolidated_size = 0;
+                    ctx->frame->consolidated_ascii_len = 0;
 
                     if (ctx->temp_pool != NULL) {
                         ngx_destroy_pool(ctx->temp_pool);
@@ -439,6 +452,44 @@ finalize:
 }
 
 
+// the buffer of the message being reassembled is doubled when needed, up to the max message size
+static ngx_int_t
+ngx_http_push_stream_reserve_websocket_message(ngx_http_push_stream_frame_t *frame, size_t len, size_t max_size, ngx_pool_t *temp_pool)
+{
+    u_char                            *data;
+    size_t                             size, needed;
+
+    if (len <= frame->consolidated_size - frame->consolidated.len) {
+        return NGX_OK;
+    }
+
+    if (len > NGX_MAX_SIZE_T_VALUE - frame->consolidated.len) {
+        return NGX_ERROR;
+    }
+
+    needed = frame->consolidated.len + len;
+    size = (frame->consolidated_size > NGX_MAX_SIZE_T_VALUE / 2) ? needed : ngx_max(frame->consolidated_size * 2, needed);
+    if (max_size > 0) {
+        size = ngx_max(ngx_min(size, max_size), needed);
+    }
+
+    // allocated apart from the pool blocks, so the old buffer can be given back with ngx_pfree
+    if ((data = ngx_pmemalign(temp_pool, size, NGX_ALIGNMENT)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (frame->consolidated_size > 0) {
+        ngx_memcpy(data, frame->consolidated.data, frame->consolidated.len);
+        ngx_pfree(temp_pool, frame->consolidated.data);
+    }
+
+    frame->consolidated.data = data;
+    frame->consolidated_size = size;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_push_stream_recv(ngx_connection_t *c, ngx_event_t *rev, ngx_buf_t *buf, ssize_t len)
 {
@@ -39,6 +39,7 @@ ngx_http_push_stream_find_channel_on_tree(ngx_str_t *id, ngx_log_t *log, ngx_rbt
     uint32_t                            hash;
     ngx_rbtree_node_t                  *node, *sentinel;
     ngx_int_t                           rc;
+    ngx_uint_t                          depth = 0;
     ngx_http_push_stream_channel_t     *channel = NULL;
 
     hash = ngx_crc32_short(id->data, id->len);
@@ -46,7 +47,8 @@ ngx_http_push_stream_find_channel_on_tree(ngx_str_t *id, ngx_log_t *log, ngx_rbt
     node = tree->root;
     sentinel = tree->sentinel;
 
-    while ((node != NULL) && (node != sentinel)) {
+    // the depth limit protects lockless readers from a tree being rebalanced
+    while ((node != NULL) && (node != sentinel) && (depth++ < NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_MAX_DEPTH)) {
         if (hash < node->key) {
             node = node->left;
             continue;
@@ -73,19 +75,310 @@ ngx_http_push_stream_find_channel_on_tree(ngx_str_t *id, ngx_log_t *log, ngx_rbt
 }
 
 
+static ngx_http_push_stream_channel_t **
+ngx_http_push_stream_channel_hash_bucket(ngx_http_push_stream_channel_t **buckets, ngx_uint_t size, uint32_t key, ngx_str_t *id)
+{
+    ngx_http_push_stream_channel_t     *channel;
+    ngx_uint_t                          i, n, mask = size - 1;
+
+    // the table always has at least one empty bucket, the limit protects lockless readers
+    for (i = key & mask, n = 0; (buckets[i] != NULL) && (n < size); i = (i + 1) & mask, n++) {
+        channel = buckets[i];
+        if ((channel != NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED) && (channel->node.key == key) && (ngx_memn2cmp(id->data, channel->id.data, id->len, channel->id.len) == 0)) {
+            return &buckets[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_http_push_stream_channel_t **
+ngx_http_push_stream_channel_hash_find_bucket(ngx_http_push_stream_channel_hash_t *hash, uint32_t key, ngx_str_t *id)
+{
+    ngx_http_push_stream_channel_t    **bucket = NULL, **buckets;
+    ngx_uint_t                          size;
+
+    // the size is published after the buckets, reading it first never gives a size larger than the buckets
+    size = hash->size;
+    ngx_memory_barrier();
+    buckets = hash->buckets;
+    if ((buckets != NULL) && (size > 0)) {
+        bucket = ngx_http_push_stream_channel_hash_bucket(buckets, size, key, id);
+    }
+
+    if (bucket == NULL) {
+        size = hash->old_size;
+        ngx_memory_barrier();
+        buckets = hash->old_buckets;
+        if ((buckets != NULL) && (size > 0)) {
+            bucket = ngx_http_push_stream_channel_hash_bucket(buckets, size, key, id);
+        }
+    }
+
+    return bucket;
+}
+
+
+static void
+ngx_http_push_stream_channel_hash_place(ngx_http_push_stream_channel_hash_t *hash, ngx_http_push_stream_channel_t *channel)
+{
+    ngx_uint_t                          i, mask = hash->size - 1;
+
+    for (i = channel->node.key & mask; (hash->buckets[i] != NULL) && (hash->buckets[i] != NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED); i = (i + 1) & mask) { /* void */ }
+
+    if (hash->buckets[i] == NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED) {
+        hash->deleted--;
+    }
+
+    hash->buckets[i] = channel;
+    hash->used++;
+}
+
+
+// move at most step buckets from the old table to the current one, releasing the old table when it is empty
+static void
+ngx_http_push_stream_channel_hash_migrate(ngx_http_push_stream_channel_hash_t *hash, ngx_slab_pool_t *shpool, ngx_uint_t step)
+{
+    ngx_http_push_stream_channel_t     *channel;
+
+    if (hash->old_buckets == NULL) {
+        return;
+    }
+
+    while ((step-- > 0) && (hash->old_used > 0) && (hash->migrated < hash->old_size)) {
+        channel = hash->old_buckets[hash->migrated];
+        if ((channel != NULL) && (channel != NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED)) {
+            ngx_http_push_stream_channel_hash_place(hash, channel);
+            // keep the probe sequences of the old table intact for the remaining lookups
+            hash->old_buckets[hash->migrated] = NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED;
+            hash->old_used--;
+        }
+        hash->migrated++;
+    }
+
+    if ((hash->old_used == 0) || (hash->migrated >= hash->old_size)) {
+        // lockless readers may still be walking the old table, only release it on the next migration
+        if (hash->retired_buckets != NULL) {
+            ngx_slab_free(shpool, hash->retired_buckets);
+        }
+        hash->retired_buckets = hash->old_buckets;
+        hash->old_size = 0;
+        ngx_memory_barrier();
+        hash->old_buckets = NULL;
+        hash->old_used = 0;
+        hash->migrated = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_channel_hash_resize(ngx_http_push_stream_channel_hash_t *hash, ngx_slab_pool_t *shpool, ngx_log_t *log)
+{
+    ngx_http_push_stream_channel_t    **buckets;
+    ngx_uint_t                          size = hash->size;
+
+    // a previous resize must be finished before starting a new one
+    ngx_http_push_stream_channel_hash_migrate(hash, shpool, hash->old_size);
+
+    // grow only if the table is really loaded, otherwise just get rid of deleted buckets
+    if ((hash->used * 2) >= hash->size) {
+        size = hash->size * 2;
+    }
+
+    if ((buckets = ngx_slab_alloc(shpool, size * sizeof(ngx_http_push_stream_channel_t *))) == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to allocate memory to resize channels hash to %ui buckets", size);
+        return NGX_ERROR;
+    }
+    ngx_memzero(buckets, size * sizeof(ngx_http_push_stream_channel_t *));
+
+    // publish the buckets before the sizes, see ngx_http_push_stream_channel_hash_find_bucket
+    hash->old_buckets = hash->buckets;
+    ngx_memory_barrier();
+    hash->old_size = hash->size;
+    hash->old_used = hash->used;
+    hash->migrated = 0;
+
+    hash->buckets = buckets;
+    ngx_memory_barrier();
+    hash->size = size;
+    hash->used = 0;
+    hash->deleted = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_push_stream_channel_hash_init(ngx_http_push_stream_channel_hash_t *hash, ngx_slab_pool_t *shpool)
+{
+    size_t                              size = NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_INITIAL_SIZE * sizeof(ngx_http_push_stream_channel_t *);
+
+    if ((hash->buckets = ngx_slab_alloc(shpool, size)) == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memzero(hash->buckets, size);
+
+    hash->size = NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_INITIAL_SIZE;
+    hash->used = 0;
+    hash->deleted = 0;
+    hash->old_buckets = NULL;
+    hash->old_size = 0;
+    hash->old_used = 0;
+    hash->migrated = 0;
+    hash->retired_buckets = NULL;
+
+    return NGX_OK;
+}
+
+
+static ngx_http_push_stream_channel_t *
+ngx_http_push_stream_find_channel_on_index(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_http_push_stream_channel_t    **bucket;
+
+    if (data->channel_index == NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_HASH) {
+        bucket = ngx_http_push_stream_channel_hash_find_bucket(&data->channels_hash, ngx_crc32_short(id->data, id->len), id);
+        return (bucket != NULL) ? *bucket : NULL;
+    }
+
+    return ngx_http_push_stream_find_channel_on_tree(id, log, &data->tree);
+}
+
+
+// must be called with channels_queue_mutex locked
+static ngx_int_t
+ngx_http_push_stream_channel_index_insert(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel, ngx_log_t *log)
+{
+    ngx_http_push_stream_channel_hash_t    *hash = &data->channels_hash;
+
+    ngx_int_t                               rc = NGX_OK;
+
+    ngx_http_push_stream_channel_index_write_begin(data);
+
+    if (data->channel_index != NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_HASH) {
+        ngx_rbtree_insert(&data->tree, &channel->node);
+        ngx_http_push_stream_channel_index_write_end(data);
+        return NGX_OK;
+    }
+
+    ngx_http_push_stream_channel_hash_migrate(hash, data->shpool, NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_MIGRATION_STEP);
+
+    // keep the load factor, counting deleted buckets, under 75%
+    if (((hash->used + hash->deleted + 1) * 4) > (hash->size * 3)) {
+        if ((ngx_http_push_stream_channel_hash_resize(hash, data->shpool, log) != NGX_OK) && ((hash->used + hash->deleted + 1) >= hash->size)) {
+            rc = NGX_ERROR;
+        }
+    }
+
+    if (rc == NGX_OK) {
+        ngx_http_push_stream_channel_hash_place(hash, channel);
+    }
+
+    ngx_http_push_stream_channel_index_write_end(data);
+
+    return rc;
+}
+
+
+// must be called with channels_queue_mutex locked
+static void
+ngx_http_push_stream_channel_index_delete(ngx_http_push_stream_shm_data_t *data, ngx_http_push_stream_channel_t *channel)
+{
+    ngx_http_push_stream_channel_hash_t    *hash = &data->channels_hash;
+    ngx_http_push_stream_channel_t        **bucket;
+
+    ngx_http_push_stream_channel_index_write_begin(data);
+
+    if (data->channel_index != NGX_HTTP_PUSH_STREAM_CHANNEL_INDEX_HASH) {
+        ngx_rbtree_delete(&data->tree, &channel->node);
+        ngx_http_push_stream_channel_index_write_end(data);
+        return;
+    }
+
+    if ((hash->buckets != NULL) && ((bucket = ngx_http_push_stream_channel_hash_bucket(hash->buckets, hash->size, channel->node.key, &channel->id)) != NULL)) {
+        *bucket = NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED;
+        hash->used--;
+        hash->deleted++;
+    } else if ((hash->old_buckets != NULL) && ((bucket = ngx_http_push_stream_channel_hash_bucket(hash->old_buckets, hash->old_size, channel->node.key, &channel->id)) != NULL)) {
+        *bucket = NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_DELETED;
+        hash->old_used--;
+    }
+
+    ngx_http_push_stream_channel_hash_migrate(hash, data->shpool, NGX_HTTP_PUSH_STREAM_CHANNEL_HASH_MIGRATION_STEP);
+
+    ngx_http_push_stream_channel_index_write_end(data);
+}
+
+
+// index changes are done with channels_queue_mutex locked, the version lets lockless readers detect them
+static void
+ngx_http_push_stream_channel_index_write_begin(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_atomic_fetch_add(&data->channels_index_version, 1);
+    ngx_memory_barrier();
+}
+
+
+static void
+ngx_http_push_stream_channel_index_write_end(ngx_http_push_stream_shm_data_t *data)
+{
+    ngx_memory_barrier();
+    ngx_atomic_fetch_add(&data->channels_index_version, 1);
+}
+
+
+// channels removed from the index are only released after staying on the trash queue, so readers never touch freed memory
+static ngx_http_push_stream_channel_t *
+ngx_http_push_stream_find_channel_lockless(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_shm_data_t *data, ngx_flag_t *found)
+{
+    ngx_http_push_stream_channel_t     *channel;
+    ngx_atomic_uint_t                   version;
+    ngx_uint_t                          attempts;
+
+    for (attempts = 0; attempts < NGX_HTTP_PUSH_STREAM_CHANNEL_LOCKLESS_ATTEMPTS; attempts++) {
+        version = data->channels_index_version;
+        if (version & 1) {
+            // a writer is changing the index
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+        channel = ngx_http_push_stream_find_channel_on_index(id, log, data);
+        ngx_memory_barrier();
+
+        if (version == data->channels_index_version) {
+            *found = 1;
+            return channel;
+        }
+    }
+
+    *found = 0;
+    return NULL;
+}
+
+
 static ngx_http_push_stream_channel_t *
 ngx_http_push_stream_find_channel(ngx_str_t *id, ngx_log_t *log, ngx_http_push_stream_main_conf_t *mcf)
 {
     ngx_http_push_stream_shm_data_t    *data = mcf->shm_data;
     ngx_http_push_stream_channel_t     *channel = NULL;
+    ngx_flag_t                          found = 0;
 
     if (id == NULL) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: tried to find a channel with a null id");
         return NULL;
     }
 
+    channel = ngx_http_push_stream_find_channel_lockless(id, log, data, &found);
+    if (found) {
+        return channel;
+    }
+
+    // too much concurrent changes on the index, wait for the writers
     ngx_shmtx_lock(&data->channels_queue_mutex);
-    channel = ngx_http_push_stream_find_channel_on_tree(id, log, &data->tree);
+    channel = ngx_http_push_stream_find_channel_on_index(id, log, data);
     ngx_shmtx_unlock(&data->channels_queue_mutex);
 
     return channel;
@@ -100,16 +393,23 @@ ngx_http_push_stream_get_channel(ngx_str_t *id, ngx_log_t *log, ngx_http_push_st
     ngx_http_push_stream_channel_t        *channel;
     ngx_slab_pool_t                       *shpool = mcf->shpool;
     ngx_flag_t                             is_wildcard_channel = 0;
+    ngx_flag_t                             found = 0;
 
     if (id == NULL) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: tried to create a channel with a null id");
         return NULL;
     }
 
+    // most of the time the channel already exists, avoid the writer lock
+    channel = ngx_http_push_stream_find_channel_lockless(id, log, data, &found);
+    if (found && (channel != NULL)) {
+        return channel;
+    }
+
     ngx_shmtx_lock(&data->channels_queue_mutex);
 
     // check again to see if any other worker didn't create the channel
-    channel = ngx_http_push_stream_find_channel_on_tree(id, log, &data->tree);
+    channel = ngx_http_push_stream_find_channel_on_index(id, log, data);
     if (channel != NULL) { // we found our channel
         ngx_shmtx_unlock(&data->channels_queue_mutex);
         return channel;
@@ -154,15 +454,28 @@ ngx_http_push_stream_get_channel(ngx_str_t *id, ngx_log_t *log, ngx_http_push_st
     channel->for_events = ((mcf->events_channel_id.len > 0) && (channel->id.len == mcf->events_channel_id.len) && (ngx_strncmp(channel->id.data, mcf->events_channel_id.data, mcf->events_channel_id.len) == 0));
     channel->expires = ngx_time() + mcf->channel_inactivity_time;
 
-    ngx_queue_init(&channel->message_queue);
+    channel->messages = NULL;
+    channel->messages_head = 0;
+    channel->messages_capacity = 0;
+    channel->messages_offset = 0;
+    channel->event_ids = NULL;
+    channel->expiry_time = 0;
     ngx_queue_init(&channel->workers_with_subscribers);
+    channel->workers_sentinels = NULL;
+    channel->workers_sentinels_size = 0;
 
     channel->node.key = ngx_crc32_short(channel->id.data, channel->id.len);
-    ngx_rbtree_insert(&data->tree, &channel->node);
+    channel->mutex = &data->channels_mutex[channel->node.key % data->channels_mutexes];
+    if (ngx_http_push_stream_channel_index_insert(data, channel, log) != NGX_OK) {
+        ngx_slab_free(shpool, channel->id.data);
+        ngx_slab_free(shpool, channel);
+        ngx_shmtx_unlock(&data->channels_queue_mutex);
+        ngx_log_error(NGX_LOG_ERR, log, 0, "push stream module: unable to index new channel");
+        return NULL;
+    }
     ngx_queue_insert_tail(&data->channels_queue, &channel->queue);
     (channel->wildcard) ? data->wildcard_channels++ : data->channels++;
-
-    channel->mutex = &data->channels_mutex[data->mutex_round_robin++ % 10];
+    ngx_http_push_stream_schedule_channel_expiry(data, channel, channel->expires);
 
     ngx_shmtx_unlock(&data->channels_queue_mutex);
 